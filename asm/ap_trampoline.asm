@@ -0,0 +1,107 @@
+; Real-mode entry point of the application processors.
+;
+; The BSP copies this code to AP_TRAMPOLINE_ADDR and points the startup IPI at it. Each AP starts here
+; in real mode with CS = AP_TRAMPOLINE_ADDR >> 4, switches through protected mode into long mode
+; using the kernel page table, and calls the Rust entry point with its CPU index.
+; The code runs from its copy, so every absolute address is computed relative to that copy.
+
+[bits 16]
+
+global ap_trampoline_start
+global ap_trampoline_params
+global ap_trampoline_end
+
+AP_TRAMPOLINE_ADDR equ 0x8000
+%define PHYS(label) (AP_TRAMPOLINE_ADDR + (label) - ap_trampoline_start)
+
+CODE32_SELECTOR equ 0x08
+DATA_SELECTOR   equ 0x10
+CODE64_SELECTOR equ 0x18
+
+CR0_PE    equ 1 << 0
+CR0_PG    equ 1 << 31
+CR4_PAE   equ 1 << 5
+IA32_EFER equ 0xC0000080
+EFER_LME  equ 1 << 8
+
+section .text
+
+ap_trampoline_start:
+    cli
+    cld
+    xor     ax, ax
+    mov     ds, ax
+
+    lgdt    [PHYS(trampoline_gdt_ptr)]
+
+    mov     eax, cr0
+    or      eax, CR0_PE
+    mov     cr0, eax
+
+    jmp     dword CODE32_SELECTOR:PHYS(protected_mode)
+
+[bits 32]
+protected_mode:
+    mov     ax, DATA_SELECTOR
+    mov     ds, ax
+    mov     es, ax
+    mov     ss, ax
+
+    ; Enable PAE and load the kernel PML4, which the BSP placed below 4 GiB.
+    mov     eax, cr4
+    or      eax, CR4_PAE
+    mov     cr4, eax
+
+    mov     eax, [PHYS(ap_trampoline_params.cr3)]
+    mov     cr3, eax
+
+    ; Enable long mode, then paging.
+    mov     ecx, IA32_EFER
+    rdmsr
+    or      eax, EFER_LME
+    wrmsr
+
+    mov     eax, cr0
+    or      eax, CR0_PG
+    mov     cr0, eax
+
+    jmp     CODE64_SELECTOR:PHYS(long_mode)
+
+[bits 64]
+long_mode:
+    mov     ax, DATA_SELECTOR
+    mov     ds, ax
+    mov     es, ax
+    mov     ss, ax
+
+    mov     rsp, [PHYS(ap_trampoline_params.stack)]
+    mov     rdi, [PHYS(ap_trampoline_params.cpu)]
+    mov     rax, [PHYS(ap_trampoline_params.entry)]
+    call    rax
+
+.halt:
+    hlt
+    jmp     .halt
+
+; A flat GDT for the switch to long mode. The AP loads the kernel GDT in its Rust entry point.
+align 8
+trampoline_gdt:
+    dq 0                        ; Null
+    dq 0x00CF9A000000FFFF       ; 32-bit code
+    dq 0x00CF92000000FFFF       ; Data
+    dq 0x00AF9A000000FFFF       ; 64-bit code
+trampoline_gdt_end:
+
+trampoline_gdt_ptr:
+    dw trampoline_gdt_end - trampoline_gdt - 1
+    dd PHYS(trampoline_gdt)
+
+; Filled in by the BSP before each startup IPI; must match `TrampolineParams`.
+align 8
+ap_trampoline_params:
+.cr3:   dq 0                    ; Physical address of the kernel PML4
+.stack: dq 0                    ; Top of the AP's kernel stack
+.entry: dq 0                    ; Address of the Rust entry point
+.cpu:   dq 0                    ; CPU index passed to the entry point
+
+ap_trampoline_end:
@@ -48,6 +48,29 @@ pub struct ApicHeader {
     pub length: u8,
 }
 
+/// A Processor Local APIC entry of the MADT, describing one logical processor.
+#[derive(Clone, Copy)]
+#[repr(C, packed)]
+pub struct LocalApicEntry {
+    pub header: ApicHeader,
+    /// The ACPI processor UID.
+    pub processor_id: u8,
+    /// The local APIC ID of the processor, used to address IPIs to it.
+    pub apic_id: u8,
+    /// Bit 0: the processor is enabled. Bit 1: the processor can be enabled at runtime.
+    pub flags: u32,
+}
+
+impl LocalApicEntry {
+    const ENABLED: u32 = 1 << 0;
+    const ONLINE_CAPABLE: u32 = 1 << 1;
+
+    /// Returns whether the processor can be started.
+    pub fn is_usable(&self) -> bool {
+        self.flags & (Self::ENABLED | Self::ONLINE_CAPABLE) != 0
+    }
+}
+
 impl Madt {
     /// Constructs a reference to a `Madt` structure from a given physical address.
     /// This is typically used to map and access the MADT in memory after its address
@@ -55,4 +78,44 @@ impl Madt {
     pub fn from_address(address: u64) -> &'static Madt {
         unsafe { &*(address as *const Madt) }
     }
+
+    /// Returns an iterator over the variable-length entries that follow the MADT header.
+    pub fn entries(&self) -> MadtEntries {
+        let start = self as *const Madt as usize;
+        MadtEntries {
+            current: start + core::mem::size_of::<Madt>(),
+            end: start + self.header.length as usize,
+        }
+    }
+
+    /// Returns an iterator over the Processor Local APIC entries, one per logical processor.
+    pub fn local_apics(&self) -> impl Iterator<Item = &'static LocalApicEntry> {
+        self.entries()
+            .filter(|entry| entry.apic_type == ApicType::ProcessorLocalApic)
+            .map(|entry| unsafe { &*(entry as *const MadtEntry as *const LocalApicEntry) })
+    }
+}
+
+/// An iterator over the entries of a MADT.
+pub struct MadtEntries {
+    current: usize,
+    end: usize,
+}
+
+impl Iterator for MadtEntries {
+    type Item = &'static MadtEntry;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.current + core::mem::size_of::<MadtEntry>() > self.end {
+            return None;
+        }
+
+        let entry = unsafe { &*(self.current as *const MadtEntry) };
+        if entry.length == 0 {
+            return None; // A malformed entry would make the iteration loop forever.
+        }
+
+        self.current += entry.length as usize;
+        Some(entry)
+    }
 }
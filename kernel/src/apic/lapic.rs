@@ -15,6 +15,14 @@ pub const LVT_EOI: u32 = 0xB0; // Local Vector EOI Register
 pub const LVT_SPV: u32 = 0xF0; // Local Vector Spurious Interrupt Vector Register
 pub const LVT_TPR: u32 = 0x80; // Local Vector Task Priority Register
 
+// LAPIC Interrupt Command Register (ICR)
+pub const ICR_LOW: u32 = 0x300; // Vector and delivery mode; writing it sends the IPI
+pub const ICR_HIGH: u32 = 0x310; // Destination APIC ID in bits 24..31
+pub const ICR_DELIVERY_PENDING: u32 = 1 << 12; // Set while the previous IPI has not been accepted
+pub const ICR_LEVEL_ASSERT: u32 = 1 << 14; // Level assert, required for fixed IPIs
+pub const ICR_DELIVERY_INIT: u32 = 0b101 << 8; // INIT IPI: resets the target processor
+pub const ICR_DELIVERY_STARTUP: u32 = 0b110 << 8; // Startup IPI: starts the target at vector * 4 KB in real mode
+
 // LAPIC Timer Configuration Registers
 pub const TIMER_DIVIDE_CONFIG_REG: u32 = 0x3E0; // Timer Divide Configuration Register
 pub const TIMER_INITIAL_COUNT_REG: u32 = 0x380; // Timer Initial Count Register
@@ -72,6 +80,49 @@ impl Lapic {
         self.write_register(LVT_EOI, 0);
     }
 
+    /// Sends a fixed inter-processor interrupt with the given vector to the CPU with the given local APIC ID.
+    pub fn send_ipi(&self, apic_id: u32, vector: u8) {
+        self.wait_for_ipi_delivery();
+        self.write_register(ICR_HIGH, apic_id << 24);
+        self.write_register(ICR_LOW, vector as u32 | ICR_LEVEL_ASSERT);
+        self.wait_for_ipi_delivery();
+    }
+
+    /// Sends an INIT IPI, which puts the target processor into the wait-for-startup state.
+    pub fn send_init(&self, apic_id: u32) {
+        self.wait_for_ipi_delivery();
+        self.write_register(ICR_HIGH, apic_id << 24);
+        self.write_register(ICR_LOW, ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT);
+        self.wait_for_ipi_delivery();
+    }
+
+    /// Sends a startup IPI, which starts a processor in the wait-for-startup state in real mode
+    /// at physical address `page << 12`.
+    pub fn send_startup(&self, apic_id: u32, page: u8) {
+        self.wait_for_ipi_delivery();
+        self.write_register(ICR_HIGH, apic_id << 24);
+        self.write_register(
+            ICR_LOW,
+            ICR_DELIVERY_STARTUP | ICR_LEVEL_ASSERT | page as u32,
+        );
+        self.wait_for_ipi_delivery();
+    }
+
+    /// Enables the LAPIC of an application processor.
+    ///
+    /// The register page is already mapped and the PIC already disconnected by the bootstrap processor,
+    /// so only the processor's own LAPIC state is set up: its vector table, timer and spurious vector.
+    pub fn enable_local(&self) {
+        self.init();
+    }
+
+    /// Waits until the LAPIC has accepted the last IPI written to the ICR.
+    fn wait_for_ipi_delivery(&self) {
+        while self.read_register(ICR_LOW) & ICR_DELIVERY_PENDING != 0 {
+            core::hint::spin_loop();
+        }
+    }
+
     /// Initializes the LAPIC by setting up the vector table, configuring the timer,
     /// writing the spurious interrupt vector, and sending an End-of-Interrupt (EOI).
     fn init(&self) {
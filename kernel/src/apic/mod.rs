@@ -33,6 +33,26 @@ impl Apic {
         self.lapic.eoi();
     }
 
+    /// Sends an inter-processor interrupt with the given vector to the CPU with the given local APIC ID.
+    pub fn send_ipi(&self, apic_id: u32, vector: u8) {
+        self.lapic.send_ipi(apic_id, vector);
+    }
+
+    /// Sends the INIT IPI that starts the boot sequence of an application processor.
+    pub fn send_init(&self, apic_id: u32) {
+        self.lapic.send_init(apic_id);
+    }
+
+    /// Sends a startup IPI that starts an application processor at physical address `page << 12`.
+    pub fn send_startup(&self, apic_id: u32, page: u8) {
+        self.lapic.send_startup(apic_id, page);
+    }
+
+    /// Enables the LAPIC and its timer on the executing application processor.
+    pub fn enable_local_apic(&self) {
+        self.lapic.enable_local();
+    }
+
     /// Enables a specific IRQ line in the I/O APIC.
     pub fn enable_irq(&self, irq: u8) {
         self.ioapic.enable_irq(irq);
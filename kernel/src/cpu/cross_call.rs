@@ -0,0 +1,83 @@
+use super::percpu::{apic_id, current_cpu, online_cpus, MAX_CPUS};
+use crate::{apic::APIC, interrupts::without_interrupts, sync::mutex::SpinMutex};
+use core::{
+    hint::spin_loop,
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+};
+
+/// The interrupt vector of the IPI that asks a CPU to run a cross-CPU function call.
+pub const CROSS_CALL_VECTOR: u8 = 0xFD;
+
+/// A CPU mask that addresses every online CPU and the executing one, even while it is not online yet.
+pub const ALL_CPUS: u64 = u64::MAX;
+
+// Serializes cross-CPU calls: only one call is broadcast at a time.
+static CALL_LOCK: SpinMutex<()> = SpinMutex::new(());
+
+// The function and argument of the call being broadcast, valid while `CALL_PENDING` is not zero.
+static CALL_FUNC: AtomicUsize = AtomicUsize::new(0);
+static CALL_ARG: AtomicUsize = AtomicUsize::new(0);
+
+// The CPUs that still have to run the call, one bit per CPU index.
+static CALL_PENDING: AtomicU64 = AtomicU64::new(0);
+
+/// Runs `func(arg)` on every CPU in `cpus` (a bit mask of CPU indices) and waits until all of them are done.
+///
+/// The executing CPU is never interrupted; if it is part of `cpus`, it runs `func` directly with interrupts disabled.
+/// Offline CPUs are skipped. Since the caller waits for completion, `arg` may point to data on its stack.
+///
+/// A CPU waiting for its turn to broadcast keeps running calls addressed to it, so two CPUs that
+/// call each other with interrupts disabled do not deadlock.
+pub fn call_on(cpus: u64, func: fn(usize), arg: usize) {
+    without_interrupts(|| {
+        // Interrupts stay disabled from here on, so the caller cannot be moved to another CPU
+        // between picking the targets and running the local call.
+        let this_cpu = 1 << current_cpu();
+        let targets = cpus & online_cpus() & !this_cpu;
+
+        if cpus & this_cpu != 0 {
+            func(arg);
+        }
+        if targets == 0 {
+            return;
+        }
+
+        let _guard = loop {
+            if let Some(guard) = CALL_LOCK.try_lock() {
+                break guard;
+            }
+            handle_pending();
+            spin_loop();
+        };
+
+        CALL_FUNC.store(func as usize, Ordering::Relaxed);
+        CALL_ARG.store(arg, Ordering::Relaxed);
+        CALL_PENDING.store(targets, Ordering::Release);
+
+        {
+            let apic = unsafe { APIC.lock() };
+            for cpu in (0..MAX_CPUS).filter(|cpu| targets & (1 << cpu) != 0) {
+                apic.send_ipi(apic_id(cpu), CROSS_CALL_VECTOR);
+            }
+        }
+
+        while CALL_PENDING.load(Ordering::Acquire) != 0 {
+            spin_loop();
+        }
+    });
+}
+
+/// Runs the call being broadcast if the executing CPU still has to run it.
+///
+/// Called by the cross-call interrupt handler, and by CPUs waiting to broadcast a call of their own.
+pub fn handle_pending() {
+    let this_cpu = 1 << current_cpu();
+    if CALL_PENDING.load(Ordering::Acquire) & this_cpu == 0 {
+        return;
+    }
+
+    let func: fn(usize) = unsafe { core::mem::transmute(CALL_FUNC.load(Ordering::Relaxed)) };
+    func(CALL_ARG.load(Ordering::Relaxed));
+
+    CALL_PENDING.fetch_and(!this_cpu, Ordering::Release);
+}
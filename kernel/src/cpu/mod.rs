@@ -1,2 +1,5 @@
+pub(crate) mod cross_call;
 pub(crate) mod io;
+pub(crate) mod percpu;
 pub(crate) mod rtc;
+pub(crate) mod smp;
@@ -0,0 +1,77 @@
+use crate::registers::msr::{Msr, IA32_GS_BASE};
+use core::{
+    arch::asm,
+    ptr::addr_of,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+/// The maximum number of CPUs the kernel keeps per-CPU state for.
+pub const MAX_CPUS: usize = 16;
+
+/// Per-CPU data, located through the GS base of each processor.
+///
+/// The CPU index must stay the first field: `current_cpu` reads it with a single `gs`-relative load.
+#[repr(C)]
+pub struct PerCpu {
+    pub id: usize,    // Index of the CPU, in 0..MAX_CPUS
+    pub apic_id: u32, // Local APIC ID of the CPU
+}
+
+static mut PER_CPU: [PerCpu; MAX_CPUS] = [const { PerCpu { id: 0, apic_id: 0 } }; MAX_CPUS];
+
+// The CPUs that have finished their bring-up and take IPIs, one bit per CPU index.
+static ONLINE_CPUS: AtomicU64 = AtomicU64::new(0);
+
+/// Sets up the per-CPU area of the executing processor and points its GS base at it.
+///
+/// Must be called on every CPU after its GDT has been loaded, since reloading the GS selector clears the base.
+///
+/// The base is written to IA32_GS_BASE once and never swapped, so kernel entry does not use `swapgs`.
+/// This relies on user mode never loading GS: a GS selector load there would replace the base and make
+/// `current_cpu` read garbage on the next interrupt. User threads only run code the kernel sets up itself and
+/// CR4.FSGSBASE stays off, so nothing does today; running arbitrary user code requires moving this to
+/// IA32_KERNEL_GS_BASE with `swapgs` on every entry and exit first.
+pub fn init(id: usize, apic_id: u32) {
+    assert!(id < MAX_CPUS, "CPU index out of range");
+    unsafe {
+        PER_CPU[id] = PerCpu { id, apic_id };
+        Msr::write(IA32_GS_BASE, addr_of!(PER_CPU[id]) as u64);
+    }
+}
+
+/// Marks a CPU online, so that cross-CPU calls and TLB shootdowns are sent to it from now on.
+///
+/// Must be called last in the bring-up of a CPU, once its IDT and local APIC are set up and interrupts
+/// are enabled: a CPU that is sent an IPI before it can take it would keep the sender waiting forever.
+pub fn set_online(id: usize) {
+    ONLINE_CPUS.fetch_or(1 << id, Ordering::SeqCst);
+}
+
+/// Marks a CPU offline again, e.g. one that was parked because it did not finish its bring-up in time.
+pub fn set_offline(id: usize) {
+    ONLINE_CPUS.fetch_and(!(1 << id), Ordering::SeqCst);
+}
+
+/// Returns the set of online CPUs as a bit mask indexed by CPU index.
+pub fn online_cpus() -> u64 {
+    ONLINE_CPUS.load(Ordering::SeqCst)
+}
+
+/// Returns the local APIC ID of an online CPU, e.g. to address an IPI to it.
+pub fn apic_id(cpu: usize) -> u32 {
+    unsafe { PER_CPU[cpu].apic_id }
+}
+
+/// Returns the index of the executing CPU.
+#[inline]
+pub fn current_cpu() -> usize {
+    let id: usize;
+    unsafe {
+        asm!(
+            "mov {}, gs:[0]",
+            out(reg) id,
+            options(nostack, readonly, preserves_flags)
+        );
+    }
+    id
+}
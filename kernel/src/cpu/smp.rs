@@ -0,0 +1,172 @@
+use super::{
+    io::sleep_for,
+    percpu::{self, online_cpus, MAX_CPUS},
+};
+use crate::{
+    acpi::{madt::Madt, rsdp::RSDP_MANAGER},
+    apic::APIC,
+    gdt,
+    interrupts::{enable_interrupts, isr::IDT},
+    memory::{
+        self,
+        addr::PhysAddr,
+        paging::{self, tlb},
+    },
+    println,
+    registers::cpuid::CpuId,
+    tasks::scheduler::scheduler,
+    tss,
+};
+use core::{arch::asm, ptr};
+
+/// The physical address the real-mode trampoline is copied to. The page is reserved at boot,
+/// and must lie below 1 MB and be page-aligned, since a startup IPI addresses it by its page number.
+pub const AP_TRAMPOLINE_ADDR: PhysAddr = PhysAddr(0x8000);
+
+/// The size of the kernel stack each application processor starts on (2^AP_STACK_ORDER pages).
+const AP_STACK_ORDER: usize = 4; // 64 KB
+
+// How long to wait for an application processor to come online after its startup IPIs.
+const AP_START_TIMEOUT_MS: u64 = 100;
+
+// Symbols of `asm/ap_trampoline.asm`.
+extern "C" {
+    static ap_trampoline_start: u8;
+    static ap_trampoline_params: u8;
+    static ap_trampoline_end: u8;
+}
+
+/// The parameters the trampoline reads from its copy; must match `ap_trampoline_params`.
+#[repr(C)]
+struct TrampolineParams {
+    cr3: u64,   // Physical address of the kernel PML4, below 4 GB
+    stack: u64, // Top of the AP's kernel stack
+    entry: u64, // Address of `ap_main`
+    cpu: u64,   // CPU index passed to `ap_main`
+}
+
+/// Starts every usable processor listed in the MADT besides the bootstrap processor.
+///
+/// Each application processor gets the next free CPU index, is started through the INIT-SIPI-SIPI
+/// sequence and is waited for until it has come online, so the processors are started one at a time
+/// and can share the trampoline. Processors beyond `MAX_CPUS` are left halted.
+///
+/// # Safety
+///
+/// Must be called once on the bootstrap processor, after memory, the IDT and the APIC are initialized.
+pub unsafe fn start_aps() {
+    let madt = Madt::from_address(RSDP_MANAGER.sdt_headers.apic.unwrap());
+    let bsp_apic_id = CpuId::apic_id();
+
+    // Copy the trampoline to its low page.
+    let start = ptr::addr_of!(ap_trampoline_start);
+    let size = ptr::addr_of!(ap_trampoline_end) as usize - start as usize;
+    ptr::copy_nonoverlapping(start, AP_TRAMPOLINE_ADDR.as_mut_ptr::<u8>(), size);
+
+    let mut next_cpu = 1;
+    for entry in madt.local_apics() {
+        let apic_id = entry.apic_id as u32;
+        if !entry.is_usable() || apic_id == bsp_apic_id {
+            continue;
+        }
+        if next_cpu == MAX_CPUS {
+            println!("SMP: ignoring CPUs beyond {}", MAX_CPUS);
+            break;
+        }
+
+        if start_ap(next_cpu, apic_id) {
+            next_cpu += 1;
+        } else {
+            println!("SMP: CPU with APIC ID {} did not start", apic_id);
+        }
+    }
+
+    println!("SMP: {} CPUs online", online_cpus().count_ones());
+}
+
+// Starts one application processor and waits until it is online.
+unsafe fn start_ap(cpu: usize, apic_id: u32) -> bool {
+    let stack = memory::alloc_frames(AP_STACK_ORDER).expect("Out of memory for an AP stack");
+    let cr3 = paging::ROOT_PAGE_TABLE as u64;
+    assert!(
+        cr3 < 1 << 32,
+        "The kernel PML4 must lie below 4 GB for the AP trampoline"
+    );
+
+    let offset =
+        ptr::addr_of!(ap_trampoline_params) as usize - ptr::addr_of!(ap_trampoline_start) as usize;
+    let params = (AP_TRAMPOLINE_ADDR + offset).as_mut_ptr::<TrampolineParams>();
+    ptr::write_volatile(
+        params,
+        TrampolineParams {
+            cr3,
+            stack: stack.as_mut_ptr::<u8>() as u64 + (memory::PAGE_SIZE << AP_STACK_ORDER) as u64,
+            entry: ap_main as usize as u64,
+            cpu: cpu as u64,
+        },
+    );
+
+    // INIT, then up to two startup IPIs, as the MP specification prescribes.
+    APIC.lock().send_init(apic_id);
+    sleep_for(10);
+    for _ in 0..2 {
+        APIC.lock()
+            .send_startup(apic_id, (AP_TRAMPOLINE_ADDR.0 >> 12) as u8);
+        sleep_for(1);
+        if is_online(cpu) {
+            return true;
+        }
+    }
+
+    for _ in 0..AP_START_TIMEOUT_MS {
+        if is_online(cpu) {
+            return true;
+        }
+        sleep_for(1);
+    }
+
+    // Park the processor with INIT before its stack, CPU index and the trampoline parameters are reused:
+    // it may still be on its way through the trampoline or `ap_main`. One that came online in the
+    // meantime is parked as well, so that no IPI is sent to it anymore.
+    APIC.lock().send_init(apic_id);
+    sleep_for(10);
+    percpu::set_offline(cpu);
+
+    memory::free_frames(stack, AP_STACK_ORDER);
+    false
+}
+
+fn is_online(cpu: usize) -> bool {
+    online_cpus() & (1 << cpu) != 0
+}
+
+// The entry point of an application processor, called by the trampoline in long mode on the AP's stack.
+// Sets up the processor's own descriptor tables, per-CPU area, paging features and LAPIC,
+// and then idles with interrupts enabled until the scheduler gives it work.
+extern "C" fn ap_main(cpu: usize) -> ! {
+    unsafe {
+        gdt::init(cpu);
+        IDT.load();
+        percpu::init(cpu, CpuId::apic_id());
+        println!("CPU {} starting (APIC ID {})", cpu, CpuId::apic_id());
+
+        paging::init_cpu();
+        tss::load_tss(cpu);
+        APIC.lock().enable_local_apic();
+        enable_interrupts();
+
+        // Go online last, once the CPU can answer IPIs. Shootdowns sent before that did not reach it,
+        // so drop every translation it may have cached on the way.
+        percpu::set_online(cpu);
+        tlb::flush_global();
+
+        // From here on this context is the CPU's idle thread: the timer interrupt schedules
+        // threads onto the CPU, stealing them from busier CPUs.
+        if let Some(scheduler) = scheduler() {
+            scheduler.start_cpu();
+        }
+        loop {
+            asm!("hlt");
+        }
+    }
+}
@@ -0,0 +1,141 @@
+use core::ptr;
+
+/// A link embedded at the start of every node of an `IntrusiveList`.
+///
+/// The list does not own any memory: each free block stores its own `Link`,
+/// so pushing and removing nodes never allocates.
+#[repr(C)]
+pub struct Link {
+    next: *mut Link,
+    prev: *mut Link,
+}
+
+impl Link {
+    /// Returns a link that is not part of any list.
+    pub const fn new() -> Self {
+        Link {
+            next: ptr::null_mut(),
+            prev: ptr::null_mut(),
+        }
+    }
+}
+
+// A copy of a node is not linked into the lists of the original.
+impl Clone for Link {
+    fn clone(&self) -> Self {
+        Link::new()
+    }
+}
+
+/// A doubly-linked intrusive list.
+///
+/// Unlike `LinkedList`, any node can be unlinked in O(1) given only its address,
+/// which is what buddy allocators need to remove a free buddy during coalescing.
+/// Nodes can be added and taken at both ends, so the list also serves as a FIFO queue.
+#[derive(Copy, Clone)]
+pub struct IntrusiveList {
+    head: *mut Link,
+    tail: *mut Link,
+}
+
+unsafe impl Send for IntrusiveList {}
+
+impl IntrusiveList {
+    pub const fn new() -> Self {
+        IntrusiveList {
+            head: ptr::null_mut(),
+            tail: ptr::null_mut(),
+        }
+    }
+
+    /// Pushes a node to the front of the list.
+    ///
+    /// # Safety
+    ///
+    /// `node` must point to writable memory large enough to hold a `Link`
+    /// and must not already be part of a list.
+    pub unsafe fn push(&mut self, node: *mut Link) {
+        (*node).prev = ptr::null_mut();
+        (*node).next = self.head;
+        if self.head.is_null() {
+            self.tail = node;
+        } else {
+            (*self.head).prev = node;
+        }
+        self.head = node;
+    }
+
+    /// Pushes a node to the back of the list.
+    ///
+    /// # Safety
+    ///
+    /// `node` must point to writable memory large enough to hold a `Link`
+    /// and must not already be part of a list.
+    pub unsafe fn push_back(&mut self, node: *mut Link) {
+        (*node).next = ptr::null_mut();
+        (*node).prev = self.tail;
+        if self.tail.is_null() {
+            self.head = node;
+        } else {
+            (*self.tail).next = node;
+        }
+        self.tail = node;
+    }
+
+    /// Removes and returns the node at the front of the list.
+    pub fn pop(&mut self) -> Option<*mut Link> {
+        if self.is_empty() {
+            return None;
+        }
+
+        let node = self.head;
+        unsafe { self.remove(node) };
+        Some(node)
+    }
+
+    /// Removes and returns the node at the back of the list.
+    pub fn pop_back(&mut self) -> Option<*mut Link> {
+        if self.is_empty() {
+            return None;
+        }
+
+        let node = self.tail;
+        unsafe { self.remove(node) };
+        Some(node)
+    }
+
+    /// Returns the node at the front of the list without removing it.
+    pub fn front(&self) -> Option<*mut Link> {
+        if self.is_empty() {
+            None
+        } else {
+            Some(self.head)
+        }
+    }
+
+    /// Unlinks a node from the list.
+    ///
+    /// # Safety
+    ///
+    /// `node` must currently be linked into this list.
+    pub unsafe fn remove(&mut self, node: *mut Link) {
+        let next = (*node).next;
+        let prev = (*node).prev;
+
+        if prev.is_null() {
+            self.head = next;
+        } else {
+            (*prev).next = next;
+        }
+
+        if next.is_null() {
+            self.tail = prev;
+        } else {
+            (*next).prev = prev;
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.head.is_null()
+    }
+}
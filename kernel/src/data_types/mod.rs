@@ -1 +1,2 @@
+pub(crate) mod intrusive_list;
 pub(crate) mod linked_list;
@@ -1,5 +1,5 @@
 use super::framebuffer::Framebuffer;
-use crate::structures::PSF1Font;
+use crate::{interrupts::without_interrupts, structures::PSF1Font, sync::mutex::SpinMutex};
 use core::fmt::Write;
 
 struct Console {
@@ -20,8 +20,13 @@ pub struct Display {
 }
 
 // The static mutable DISPLAY variable is used to store the display state.
+// Every CPU prints to it, so console output goes through `print` and `clear_screen`, which hold PRINT_LOCK.
 pub static mut DISPLAY: Display = Display::default();
 
+// Serializes console output between CPUs. It is taken with interrupts disabled, so that an interrupt
+// handler that prints cannot spin on the lock held by the code it interrupted.
+static PRINT_LOCK: SpinMutex<()> = SpinMutex::new(());
+
 impl Display {
     /// Creates a new Display struct with all fields set to 0.
     pub const fn default() -> Display {
@@ -266,15 +271,17 @@ macro_rules! cls {
 // Helper function to clear the screen
 #[doc(hidden)]
 pub fn clear_screen() {
-    unsafe {
-        DISPLAY.clear_screen();
-    }
+    without_interrupts(|| {
+        let _guard = PRINT_LOCK.lock();
+        unsafe { DISPLAY.clear_screen() };
+    });
 }
 
 // Helper function to print text to the screen
 #[doc(hidden)]
 pub fn print(args: core::fmt::Arguments) {
-    unsafe {
-        DISPLAY.write_fmt(args).unwrap();
-    }
+    without_interrupts(|| {
+        let _guard = PRINT_LOCK.lock();
+        unsafe { DISPLAY.write_fmt(args).unwrap() };
+    });
 }
@@ -7,7 +7,8 @@ use crate::{
         },
         vfs_dir_entry::VfsDirectoryEntry,
     },
-    memory, print, println,
+    memory::dma::DmaBuffer,
+    print, println,
     storage::ahci::ahci_device::AhciDevice,
 };
 use alloc::vec::Vec;
@@ -309,6 +310,9 @@ impl FatDriver {
         let mut current_cluster = entry.get_cluster(); // Get the starting cluster of the file.
         let mut last_cluster = current_cluster; // Track the last cluster used for writing.
 
+        // Take a single DMA buffer for all sector writes; it is returned to the DMA pools when dropped.
+        let write_buffer = DmaBuffer::new_zeroed(self.fs.bytes_per_sector as usize);
+
         // Iterate over the number of clusters needed to write the entire data.
         for _ in 0..clusters_needed {
             // Determine the sector number corresponding to the current cluster.
@@ -319,18 +323,14 @@ impl FatDriver {
                 let bytes_left = size - written_bytes; // Calculate remaining bytes to be written.
                 let bytes_to_write = bytes_left.min(self.fs.bytes_per_sector as usize); // Determine how many bytes to write in this iteration.
 
-                // Allocate a DMA buffer for the sector write operation.
-                let write_buffer =
-                    memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
-
                 // Perform the actual write operation to the sector.
                 self.write_to_sector(
-                    buffer,         // Original data buffer.
-                    write_buffer,   // DMA buffer to use for writing.
-                    sector,         // Current sector to write to.
-                    sector_offset,  // Offset within the cluster.
-                    written_bytes,  // Offset within the buffer.
-                    bytes_to_write, // Number of bytes to write in this operation.
+                    buffer,                // Original data buffer.
+                    write_buffer.as_ptr(), // DMA buffer to use for writing.
+                    sector,                // Current sector to write to.
+                    sector_offset,         // Offset within the cluster.
+                    written_bytes,         // Offset within the buffer.
+                    bytes_to_write,        // Number of bytes to write in this operation.
                 );
 
                 // Update the count of written bytes.
@@ -410,23 +410,23 @@ impl FatDriver {
             // Create the ".." entry, which points to the parent directory.
             let dotdot_entry = DirectoryEntry::create_dotdot_entry(parent_cluster);
 
-            // Allocate a DMA buffer to read and write the directory sector.
-            let buffer = memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
+            // Take a DMA buffer to read and write the directory sector.
+            let buffer = DmaBuffer::new(self.fs.bytes_per_sector as usize);
 
             // Read the current sector contents where the new directory is located.
-            self.device.read_sectors(buffer, sector as u64, 1);
+            self.device.read_sectors(buffer.as_ptr(), sector as u64, 1);
 
             // Write the "." entry at the beginning of the directory.
-            core::ptr::write_volatile(buffer as *mut DirectoryEntry, dot_entry);
+            core::ptr::write_volatile(buffer.as_ptr() as *mut DirectoryEntry, dot_entry);
 
             // Write the ".." entry immediately after the "." entry.
             core::ptr::write_volatile(
-                buffer.add(size_of::<DirectoryEntry>() as usize) as *mut DirectoryEntry,
+                buffer.as_ptr().add(size_of::<DirectoryEntry>() as usize) as *mut DirectoryEntry,
                 dotdot_entry,
             );
 
             // Write the modified buffer back to the disk to finalize the new directory creation.
-            self.device.write_sectors(buffer, sector as u64, 1);
+            self.device.write_sectors(buffer.as_ptr(), sector as u64, 1);
         }
     }
 
@@ -447,14 +447,15 @@ impl FatDriver {
         let sector = node.sector;
         let offset = node.offset;
 
-        // Allocate a buffer to read the sector containing the directory entry.
-        let read_buffer = memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
+        // Take a buffer to read the sector containing the directory entry.
+        let read_buffer = DmaBuffer::new(self.fs.bytes_per_sector as usize);
 
         // Read the sector containing the directory entry into the buffer.
-        self.device.read_sectors(read_buffer, sector as u64, 1);
+        self.device
+            .read_sectors(read_buffer.as_ptr(), sector as u64, 1);
 
         // Calculate the pointer to the specific directory entry within the buffer.
-        let entry_ptr = unsafe { read_buffer.add(offset as usize) as *mut DirectoryEntry };
+        let entry_ptr = unsafe { read_buffer.as_ptr().add(offset as usize) as *mut DirectoryEntry };
 
         // Mark the directory entry as deleted by setting its first character to ENTRY_DELETED.
         // ENTRY_DELETED is typically 0xE5 in the FAT file system, indicating the entry is deleted.
@@ -463,13 +464,14 @@ impl FatDriver {
         }
 
         // Write the modified buffer back to the disk to update the directory entry.
-        self.device.write_sectors(read_buffer, sector as u64, 1);
+        self.device
+            .write_sectors(read_buffer.as_ptr(), sector as u64, 1);
     }
 
     fn read_boot_sector(device: &AhciDevice) -> Fat32BootSector {
-        let read_buffer = crate::memory::allocate_dma_buffer(512) as *mut u8;
-        device.read_sectors(read_buffer, 0, 1);
-        unsafe { *(read_buffer as *const Fat32BootSector) }
+        let read_buffer = DmaBuffer::new(512);
+        device.read_sectors(read_buffer.as_ptr(), 0, 1);
+        unsafe { *(read_buffer.as_ptr() as *const Fat32BootSector) }
     }
 
     fn is_valid_cluster(&self, cluster: u32) -> bool {
@@ -485,7 +487,7 @@ impl FatDriver {
 
         for i in 0..self.fs.sectors_per_cluster {
             let read_buffer = self.read_sector(sector, i as u32);
-            let sector_entries = self.read_sector_entries(sector, read_buffer);
+            let sector_entries = self.read_sector_entries(sector, read_buffer.as_ptr());
 
             if sector_entries.is_empty() {
                 return entries;
@@ -497,10 +499,10 @@ impl FatDriver {
         entries
     }
 
-    fn read_sector(&self, sector: u32, offset: u32) -> *mut u8 {
-        let read_buffer = memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
+    fn read_sector(&self, sector: u32, offset: u32) -> DmaBuffer {
+        let read_buffer = DmaBuffer::new(self.fs.bytes_per_sector as usize);
         self.device
-            .read_sectors(read_buffer, sector as u64 + offset as u64, 1);
+            .read_sectors(read_buffer.as_ptr(), sector as u64 + offset as u64, 1);
         read_buffer
     }
 
@@ -554,15 +556,16 @@ impl FatDriver {
         // Calculate the sector in the FAT that contains the entry for the given cluster
         let (fat_sector, fat_offset) = self.get_fat_sector(cluster);
 
-        // Allocate a buffer to read the FAT sector
-        let read_buffer = memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
+        // Take a buffer to read the FAT sector
+        let read_buffer = DmaBuffer::new(self.fs.bytes_per_sector as usize);
 
         // Read the FAT sector into the buffer
-        self.device.read_sectors(read_buffer, fat_sector as u64, 1);
+        self.device
+            .read_sectors(read_buffer.as_ptr(), fat_sector as u64, 1);
 
         // Extract the next cluster value from the FAT entry
         let next_cluster = unsafe {
-            let cluster_ptr = read_buffer.add(fat_offset as usize) as *const u32;
+            let cluster_ptr = read_buffer.as_ptr().add(fat_offset as usize) as *const u32;
             *cluster_ptr & 0x0FFFFFFF
         };
 
@@ -573,20 +576,22 @@ impl FatDriver {
         // Calculate the sector in the FAT that contains the entry for the given cluster
         let (fat_sector, fat_offset) = self.get_fat_sector(cluster);
 
-        // Allocate a buffer to read the FAT sector
-        let buffer = memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
+        // Take a buffer to read the FAT sector
+        let buffer = DmaBuffer::new(self.fs.bytes_per_sector as usize);
 
         // Read the FAT sector into the buffer
-        self.device.read_sectors(buffer, fat_sector as u64, 1);
+        self.device
+            .read_sectors(buffer.as_ptr(), fat_sector as u64, 1);
 
         // Calculate the pointer to the FAT entry within the buffer
-        let entry_ptr = buffer.add(fat_offset as usize) as *mut u32;
+        let entry_ptr = buffer.as_ptr().add(fat_offset as usize) as *mut u32;
 
         // Update the FAT entry to point to the new next cluster
         *entry_ptr = (*entry_ptr & 0xF0000000) | (next_cluster & 0x0FFFFFFF);
 
         // Write the modified FAT sector back to the device
-        self.device.write_sectors(buffer, fat_sector as u64, 1);
+        self.device
+            .write_sectors(buffer.as_ptr(), fat_sector as u64, 1);
     }
 
     fn get_fat_sector(&self, cluster: u32) -> (u32, u32) {
@@ -629,7 +634,7 @@ impl FatDriver {
 
         // Write the LFN entries to the buffer
         for lfn_entry in lfn_entries.iter() {
-            let entry_ptr = read_buffer.add(sector_offset as usize);
+            let entry_ptr = read_buffer.as_ptr().add(sector_offset as usize);
             core::ptr::write_volatile(entry_ptr as *mut LongDirectoryEntry, *lfn_entry);
             sector_offset += size_of::<LongDirectoryEntry>() as u32;
 
@@ -651,12 +656,12 @@ impl FatDriver {
                 entry_sector = self.get_sector(entry_cluster);
                 // Load the next sector into the buffer
                 self.device
-                    .read_sectors(read_buffer, entry_sector as u64, 1);
+                    .read_sectors(read_buffer.as_ptr(), entry_sector as u64, 1);
             }
         }
 
         // Write the short name entry into the buffer
-        let entry_ptr = read_buffer.add(sector_offset as usize);
+        let entry_ptr = read_buffer.as_ptr().add(sector_offset as usize);
 
         core::ptr::write_volatile(
             entry_ptr as *mut DirectoryEntry,
@@ -665,7 +670,7 @@ impl FatDriver {
 
         // Write the buffer back to disk
         self.device
-            .write_sectors(read_buffer, entry_sector as u64, 1);
+            .write_sectors(read_buffer.as_ptr(), entry_sector as u64, 1);
 
         Some(cluster) // Return the cluster of the new entry
     }
@@ -688,7 +693,9 @@ impl FatDriver {
 
                 for entry_idx in 0..(self.fs.bytes_per_sector / size_of::<DirectoryEntry>() as u16)
                 {
-                    let entry_ptr = buffer.add(entry_idx as usize * size_of::<DirectoryEntry>());
+                    let entry_ptr = buffer
+                        .as_ptr()
+                        .add(entry_idx as usize * size_of::<DirectoryEntry>());
                     let dir_entry = *(entry_ptr as *const DirectoryEntry);
 
                     if dir_entry.is_free() {
@@ -776,14 +783,15 @@ impl FatDriver {
         let mut updated_entry = node.entry;
         updated_entry.size = size as u32;
 
-        // Allocate a buffer to read the sector containing the directory entry
-        let read_buffer = memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
+        // Take a buffer to read the sector containing the directory entry
+        let read_buffer = DmaBuffer::new(self.fs.bytes_per_sector as usize);
 
         // Read the sector into the buffer
-        self.device.read_sectors(read_buffer, sector as u64, 1);
+        self.device
+            .read_sectors(read_buffer.as_ptr(), sector as u64, 1);
 
         // Get the pointer to the entry location in the buffer
-        let entry_ptr = unsafe { read_buffer.add(offset as usize) } as *mut DirectoryEntry;
+        let entry_ptr = unsafe { read_buffer.as_ptr().add(offset as usize) } as *mut DirectoryEntry;
 
         unsafe {
             // Update the metadata in the entry
@@ -793,20 +801,18 @@ impl FatDriver {
         }
 
         // Write the modified sector back to the device
-        self.device.write_sectors(read_buffer, sector as u64, 1);
+        self.device
+            .write_sectors(read_buffer.as_ptr(), sector as u64, 1);
     }
 
     unsafe fn clear_cluster(&self, cluster: u32) {
         let sector = self.get_sector(cluster);
-        let buffer = memory::allocate_dma_buffer(self.fs.bytes_per_sector as usize) as *mut u8;
-
-        // Zero out the buffer
-        core::ptr::write_bytes(buffer, 0, self.fs.bytes_per_sector as usize);
+        let buffer = DmaBuffer::new_zeroed(self.fs.bytes_per_sector as usize);
 
         // Write zeroed buffer to all sectors in the cluster
         for i in 0..self.fs.sectors_per_cluster {
             self.device
-                .write_sectors(buffer, sector as u64 + i as u64, 1);
+                .write_sectors(buffer.as_ptr(), sector as u64 + i as u64, 1);
         }
     }
 
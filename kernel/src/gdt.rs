@@ -1,5 +1,5 @@
 use super::tss::TssDescriptor;
-use crate::structures::DescriptorTablePointer;
+use crate::{cpu::percpu::MAX_CPUS, structures::DescriptorTablePointer};
 use bitfield_struct::bitfield;
 
 // External assembly function to flush the GDT.
@@ -288,12 +288,14 @@ impl GlobalDescriptorTable {
     }
 }
 
-/// The Global Descriptor Table (GDT) for the operating system.
-pub static mut GDT: GlobalDescriptorTable = GlobalDescriptorTable::new();
+/// The Global Descriptor Tables (GDT) of the operating system, one per CPU.
+/// The segments are the same on every CPU, but each GDT points to the TSS of its own CPU.
+pub static mut GDT: [GlobalDescriptorTable; MAX_CPUS] =
+    [const { GlobalDescriptorTable::new() }; MAX_CPUS];
 
-/// Initializes the GDT by flushing it to the CPU.
-pub fn init() {
+/// Initializes the GDT of a CPU by flushing it to the executing processor.
+pub fn init(cpu: usize) {
     unsafe {
-        GDT.flush();
+        GDT[cpu].flush();
     }
 }
@@ -1,10 +1,14 @@
-use super::{idt::InterruptDescriptorTable, timer::init_timer};
+use super::{end_of_interrupt, idt::InterruptDescriptorTable, timer::init_timer};
 use crate::{
-    cpu::io::{
-        io_wait, PortIO, ICW1_ICW4, ICW1_INIT, ICW4_8086, PIC_COMMAND_MASTER, PIC_COMMAND_SLAVE,
-        PIC_DATA_MASTER, PIC_DATA_SLAVE,
+    cpu::{
+        cross_call::{self, CROSS_CALL_VECTOR},
+        io::{
+            io_wait, PortIO, ICW1_ICW4, ICW1_INIT, ICW4_8086, PIC_COMMAND_MASTER,
+            PIC_COMMAND_SLAVE, PIC_DATA_MASTER, PIC_DATA_SLAVE,
+        },
     },
     drivers::keyboard::init_keyboard,
+    memory::{addr::VirtAddr, heap, paging},
     println,
 };
 use core::{arch::asm, fmt::Debug};
@@ -59,6 +63,8 @@ pub fn init() {
             IDT[i].set_gate(default_handler as u64, 0x8E, KERNEL_CS);
         }
 
+        IDT[CROSS_CALL_VECTOR as usize].set_gate(cross_call_handler as u64, 0x8E, KERNEL_CS);
+
         IDT[0x80].set_gate(
             syscall_handler as u64,
             0xEE, // Present, DPL=3, Type=0xE (32-bit interrupt gate)
@@ -141,6 +147,18 @@ pub extern "x86-interrupt" fn page_fault_handler(
         asm!("mov {}, cr2", out(reg) faulting_address);
     }
 
+    // On a kernel access to a non-present page, a missing kernel PML4 entry is copied from the kernel page
+    // table, and a page in the heap range is backed with a zeroed frame; the access is then retried.
+    // User-mode accesses (bit 2 of the error code) are never resolved here.
+    if error_code & 0x5 == 0
+        && unsafe {
+            paging::handle_page_fault(VirtAddr(faulting_address))
+                || heap::handle_page_fault(VirtAddr(faulting_address))
+        }
+    {
+        return;
+    }
+
     let instruction_pointer = stack_frame.value.instruction_pointer;
     let stack_pointer = stack_frame.value.stack_pointer;
 
@@ -177,6 +195,12 @@ pub extern "x86-interrupt" fn divide_by_zero_handler(stack_frame: InterruptStack
     println!("Interrupt: Divide by zero");
 }
 
+/// Handler for cross-CPU function call IPIs.
+pub extern "x86-interrupt" fn cross_call_handler(_stack_frame: InterruptStackFrame) {
+    cross_call::handle_pending();
+    end_of_interrupt();
+}
+
 pub extern "x86-interrupt" fn syscall_handler() {
     println!("Interrupt: Syscall");
     // Syscall handler code here
@@ -27,6 +27,34 @@ where
     result
 }
 
+/// Returns whether maskable interrupts are enabled (RFLAGS.IF).
+pub fn interrupts_enabled() -> bool {
+    let rflags: u64;
+    unsafe {
+        asm!("pushfq", "pop {}", out(reg) rflags, options(nomem, preserves_flags));
+    }
+    rflags & (1 << 9) != 0
+}
+
+/// Runs `f` with interrupts disabled and restores the previous interrupt state afterwards.
+///
+/// Unlike `no_interrupts`, this is safe to call from code that already runs with interrupts disabled,
+/// such as interrupt handlers or early boot.
+pub fn without_interrupts<F, R>(f: F) -> R
+where
+    F: FnOnce() -> R,
+{
+    let enabled = interrupts_enabled();
+    if enabled {
+        disable_interrupts();
+    }
+    let result = f();
+    if enabled {
+        enable_interrupts();
+    }
+    result
+}
+
 pub fn end_of_interrupt() {
     unsafe {
         if APIC.lock().is_enabled() {
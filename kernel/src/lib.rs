@@ -15,13 +15,13 @@ use interrupts::{
     isr::{self, KEYBOARD_IRQ},
     no_interrupts,
 };
-use memory::global_allocator::GlobalAllocator;
+use memory::{dma::DmaBuffer, global_allocator::GlobalAllocator};
+use registers::cpuid::CpuId;
 use structures::BootInfo;
 use tasks::{
     process::Process,
-    scheduler::{Scheduler, SCHEDULER},
-    thread::Priority,
-    KERNEL_STACK_SIZE, KERNEL_STACK_START,
+    scheduler::{self, Scheduler, CYCLES_PER_MS},
+    thread::{Policy, Priority, Thread},
 };
 
 extern crate alloc;
@@ -50,6 +50,7 @@ mod tss;
 static mut ALLOCATOR: GlobalAllocator = GlobalAllocator::new();
 
 pub const STACK_SIZE: usize = 0x4000; // 16 KB
+
 pub static mut INITIAL_RSP: u64 = 0;
 
 #[no_mangle] // don't mangle the name of this function
@@ -63,12 +64,14 @@ pub extern "C" fn _start(boot_info: &'static BootInfo) -> ! {
             cls!(); // clear the screen
             println!("Welcome to the StorkOS!"); // print a welcome message
 
-            gdt::init(); // initialize the Global Descriptor Table
+            gdt::init(0); // initialize the Global Descriptor Table of the bootstrap processor
             isr::init(); // initialize the Interrupt Descriptor Table
+            cpu::percpu::init(0, CpuId::apic_id()); // set up the per-CPU area of the bootstrap processor
+            cpu::percpu::set_online(0); // no other CPU runs yet, so none can send it an IPI early
 
             // initialize the memory
             memory::init(boot_info);
-            tss::load_tss();
+            tss::load_tss(0);
 
             rsdp::init_rsdp(boot_info);
             // apic::setup_apic();
@@ -78,14 +81,42 @@ pub extern "C" fn _start(boot_info: &'static BootInfo) -> ! {
         apic::enable_apic_mode(); // enable the APIC mode
         APIC.lock().enable_irq(KEYBOARD_IRQ as u8); // enable the keyboard interrupt
 
+        // Publish the scheduler before the application processors start, so that each of them can
+        // start scheduling as soon as it is online.
+        let scheduler = scheduler::init(Scheduler::new());
+        cpu::smp::start_aps(); // start the application processors
+
         pci::PCI::scan_pci_bus();
         storage::init();
 
         test_fs();
-        // test_proc();
+        memory::print_stats();
+
+        // Start scheduling on the bootstrap processor once booting is done, so that the kernel's
+        // service threads run whenever the CPU would otherwise idle.
+        scheduler.add_thread(Thread::new_kernel(
+            memory::zero_pool::refill_thread,
+            Priority::Idle,
+        ));
+        let stats_thread = Thread::new_kernel(tasks::stats_thread, Priority::Medium);
+        let (runtime, period) = (
+            tasks::STATS_RUNTIME_MS * CYCLES_PER_MS,
+            tasks::STATS_PERIOD_MS * CYCLES_PER_MS,
+        );
+        if scheduler
+            .add_deadline_thread(stats_thread, runtime, period)
+            .is_err()
+        {
+            println!("Scheduler statistics thread not admitted");
+        }
+        // test_proc(scheduler);
+        scheduler.start_cpu();
     }
 
-    loop {}
+    // This context is now the bootstrap processor's idle thread.
+    loop {
+        unsafe { asm!("hlt", options(nomem, nostack)) };
+    }
 }
 
 pub fn print_buffer_text(buffer: *mut u8, length: usize) {
@@ -115,20 +146,17 @@ fn panic(_info: &PanicInfo) -> ! {
     loop {}
 }
 
-pub unsafe fn test_proc() {
-    tasks::move_stack(KERNEL_STACK_START as *mut u8, KERNEL_STACK_SIZE as u64);
-
-    let proc1 = Process::create_kernel_process(test_thread1, Priority::Medium);
-    println!("Process 1 created");
+pub unsafe fn test_proc(scheduler: &Scheduler) {
+    // A fixed-priority thread runs ahead of every fair thread of its CPU, so the fair thread of
+    // process 2 runs on the CPUs that steal it.
+    let thread1 =
+        Thread::new_kernel(test_thread1, Priority::Medium).with_policy(Policy::FixedPriority);
+    println!("Kernel thread 1 created");
     let proc2 = Process::create_kernel_process(test_thread2, Priority::Medium);
     println!("Process 2 created");
 
-    let mut scheduler = Scheduler::new();
-
-    scheduler.add_thread(proc1.borrow().threads[0].borrow().clone());
-    scheduler.add_thread(proc2.borrow().threads[0].borrow().clone());
-
-    SCHEDULER = Some(scheduler);
+    scheduler.add_thread(thread1);
+    scheduler.add_thread(proc2.lock().threads[0].lock().clone());
 }
 
 extern "C" fn test_thread1() {
@@ -184,10 +212,10 @@ fn test_fs() {
         }
     }
 
-    let buffer = memory::allocate_dma_buffer(512) as *mut u8;
-    vfs.read_file("/test.txt", buffer);
+    let buffer = DmaBuffer::new_zeroed(512);
+    vfs.read_file("/test.txt", buffer.as_ptr());
 
-    print_buffer_text(buffer, 512);
+    print_buffer_text(buffer.as_ptr(), 512);
 
     vfs.create_file("/test2.txt");
 
@@ -203,10 +231,10 @@ fn test_fs() {
     let content = "Hello, World!";
     vfs.write_file("/test2.txt", content.as_ptr() as *mut u8, content.len());
 
-    let buffer = memory::allocate_dma_buffer(512) as *mut u8;
-    vfs.read_file("/test2.txt", buffer);
+    let buffer = DmaBuffer::new_zeroed(512);
+    vfs.read_file("/test2.txt", buffer.as_ptr());
 
-    print_buffer_text(buffer, content.len());
+    print_buffer_text(buffer.as_ptr(), content.len());
 
     vfs.create_dir("/test_dir");
     vfs.create_file("/test_dir/test_file.txt");
@@ -1,6 +1,13 @@
-use core::ops::{Add, AddAssign};
+use core::{
+    ops::{Add, AddAssign},
+    sync::atomic::{AtomicUsize, Ordering},
+};
 
-use super::HEAP_START;
+use super::PHYS_MAP_START;
+
+// The offset at which the kernel reaches physical memory: zero while the firmware's identity-mapping page
+// tables are loaded during early boot, and PHYS_MAP_START once paging::init has loaded the kernel's own.
+static PHYS_OFFSET: AtomicUsize = AtomicUsize::new(0);
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub struct PhysAddr(pub usize);
@@ -16,15 +23,21 @@ pub trait ToVirtAddr {
     fn to_virt_addr(&self) -> VirtAddr;
 }
 
+// Translates an address of the direct physical map with a single subtraction.
+// Any other address is taken to be identity-mapped, as is all low physical memory.
 impl ToPhysAddr for VirtAddr {
     fn to_phys_addr(&self) -> PhysAddr {
-        PhysAddr(self.0)
+        if self.0 >= PHYS_MAP_START.0 {
+            PhysAddr(self.0 - PHYS_MAP_START.0)
+        } else {
+            PhysAddr(self.0)
+        }
     }
 }
 
-impl ToPhysAddr for *mut u8 {
+impl<T> ToPhysAddr for *mut T {
     fn to_phys_addr(&self) -> PhysAddr {
-        PhysAddr(*self as usize)
+        VirtAddr::from_ptr(*self).to_phys_addr()
     }
 }
 
@@ -34,12 +47,6 @@ impl ToPhysAddr for u64 {
     }
 }
 
-impl ToPhysAddr for *mut u32 {
-    fn to_phys_addr(&self) -> PhysAddr {
-        PhysAddr(*self as usize)
-    }
-}
-
 impl ToVirtAddr for u64 {
     fn to_virt_addr(&self) -> VirtAddr {
         VirtAddr(*self as usize)
@@ -58,15 +65,29 @@ impl VirtAddr {
 }
 
 impl PhysAddr {
+    /// Returns a pointer through which the kernel accesses this physical address.
+    ///
+    /// This is its address in the direct physical map, or the address itself while the firmware's identity
+    /// mapping is still loaded during early boot. `ToPhysAddr` translates either kind of pointer back.
     pub fn as_mut_ptr<T>(self) -> *mut T {
-        self.0 as *mut T
+        (self.0 + PHYS_OFFSET.load(Ordering::Relaxed)) as *mut T
     }
 
+    /// Returns the address of this physical address in the direct physical map.
     pub fn to_virt_addr(self) -> VirtAddr {
-        VirtAddr(self.0 + HEAP_START.0)
+        VirtAddr(self.0 + PHYS_MAP_START.0)
     }
 }
 
+/// Makes `PhysAddr::as_mut_ptr` return addresses in the direct physical map.
+///
+/// # Safety
+///
+/// The direct map must be loaded into CR3.
+pub unsafe fn enable_direct_map() {
+    PHYS_OFFSET.store(PHYS_MAP_START.0, Ordering::Relaxed);
+}
+
 impl Add<usize> for PhysAddr {
     type Output = PhysAddr;
 
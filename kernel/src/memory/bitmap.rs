@@ -1,31 +1,81 @@
+use core::mem::size_of;
+
+// Number of bits stored in a single bitmap word.
+const WORD_BITS: usize = u64::BITS as usize;
+
 // The Bitmap struct represents a bitmap, a compact and efficient data structure to store binary data (bits).
 // Each bit in the bitmap can represent two states, typically used for flags, presence/absence, or other binary indicators.
+//
+// The bits are stored in 64-bit words, and a second (summary) level keeps one bit per word that is set when
+// the word is completely full. Searching for a clear bit therefore scans the summary first and only touches
+// the single leaf word that is known to contain a zero, instead of probing the bitmap bit by bit.
 pub struct Bitmap {
-    pub(crate) buffer: *mut u8, // Pointer to the memory buffer that stores the bits of the bitmap.
-    pub(crate) size: usize, // The size of the buffer in bytes, indicating how many bits are managed by this bitmap.
+    pub(crate) buffer: *mut u64, // Pointer to the memory buffer that stores the leaf words followed by the summary words.
+    pub(crate) size: usize,      // The number of bits managed by this bitmap.
+    summary: *mut u64, // Pointer to the summary level, one bit per leaf word ("word fully used").
 }
 
 impl Bitmap {
     /// Creates a new `Bitmap` instance.
     ///
-    /// This function constructs a new `Bitmap` by providing a memory buffer and its size.
-    /// The buffer serves as the underlying storage for the bitmap's bits.
+    /// This function constructs a new `Bitmap` by providing a memory buffer and the number of bits it tracks.
+    /// The buffer serves as the underlying storage for both levels of the bitmap and must be at least
+    /// `Bitmap::storage_size(size)` bytes long and 8-byte aligned. The contents are not initialized;
+    /// call `clear` before using a freshly created bitmap.
     ///
     /// # Arguments
     ///
-    /// * `buffer` - A mutable pointer to a u8 array representing the bitmap's storage in memory.
-    /// * `size` - The size of the buffer in bytes, determining the capacity of the bitmap.
+    /// * `buffer` - A mutable pointer to the memory that will hold the bitmap's words.
+    /// * `size` - The number of bits managed by the bitmap.
     ///
     /// # Returns
     ///
     /// A new instance of `Bitmap`.
     pub const fn new(buffer: *mut u8, size: usize) -> Bitmap {
-        Bitmap { buffer, size }
+        let words = Self::words_for(size);
+        Bitmap {
+            buffer: buffer as *mut u64,
+            size,
+            summary: (buffer as *mut u64).wrapping_add(words),
+        }
+    }
+
+    /// Returns the number of bytes of backing storage needed for a bitmap of `size` bits,
+    /// including the summary level.
+    pub const fn storage_size(size: usize) -> usize {
+        let words = Self::words_for(size);
+        (words + Self::words_for(words)) * size_of::<u64>()
+    }
+
+    /// Clears every bit in the bitmap.
+    ///
+    /// The unused bits of the last leaf word (and of the last summary word) are set, so that
+    /// searches never return an index past the end of the bitmap.
+    ///
+    /// # Safety
+    ///
+    /// The buffer passed to `new` must be valid for `storage_size(size)` bytes of writes.
+    pub unsafe fn clear(&mut self) {
+        let words = Self::words_for(self.size);
+        let summary_words = Self::words_for(words);
+
+        self.buffer.write_bytes(0, words);
+        self.summary.write_bytes(0, summary_words);
+
+        // Mark the padding bits of the last leaf word as used.
+        if self.size % WORD_BITS != 0 {
+            *self.buffer.add(words - 1) = !0 << (self.size % WORD_BITS);
+        }
+
+        // Mark the summary bits that do not correspond to a leaf word as full.
+        if words % WORD_BITS != 0 {
+            *self.summary.add(summary_words - 1) = !0 << (words % WORD_BITS);
+        }
     }
 
     /// Gets the value of a bit at a specific index in the bitmap.
     ///
-    /// This function is marked unsafe as it performs raw pointer arithmetic and dereferencing without bounds checking.
+    /// This function is marked unsafe as it performs raw pointer arithmetic and dereferencing.
     /// It retrieves the boolean value (true or false) of the bit at the given index.
     ///
     /// # Arguments
@@ -38,24 +88,17 @@ impl Bitmap {
     /// If the index is out of bounds, it returns `false`.
     pub unsafe fn get(&self, index: usize) -> bool {
         // Check if the index is within the bounds of the bitmap. Return false if it's out of bounds.
-        if index > (self.size * 8) {
+        if index >= self.size {
             return false;
         }
 
-        // Calculate the byte and bit position within the byte to find the target bit.
-        let byte_index = index / 8; // Identify which byte the bit is in.
-        let bit_index = index % 8; // Identify the bit's position within that byte.
-                                   // Create a mask to isolate the target bit within the byte.
-        let bit_indexer = 0b10000000 >> bit_index;
-
-        // Apply the mask to the target byte and return whether the target bit is set or not.
-        ((*self.buffer.add(byte_index as usize) as u8) & bit_indexer) != 0
+        (*self.buffer.add(index / WORD_BITS) & (1 << (index % WORD_BITS))) != 0
     }
 
     /// Sets or clears a bit at a specific index in the bitmap.
     ///
     /// This function is unsafe because it directly modifies memory.
-    /// It sets the bit at the specified index to the provided boolean value.
+    /// It sets the bit at the specified index to the provided boolean value and keeps the summary level in sync.
     ///
     /// # Arguments
     ///
@@ -67,22 +110,216 @@ impl Bitmap {
     /// `true` if the operation is within bounds and succeeds, `false` if the index is out of bounds.
     pub unsafe fn set(&mut self, index: usize, value: bool) -> bool {
         // Validate that the index is within the bitmap's bounds.
-        if index > (self.size * 8) {
+        if index >= self.size {
             return false;
         }
 
-        // Determine the byte and bit position to modify.
-        let byte_index = index / 8;
-        let bit_index = index % 8;
-        // Create a mask to manipulate the target bit.
-        let bit_indexer = 0b10000000 >> bit_index;
-        let ptr = self.buffer.add(byte_index as usize); // Get a pointer to the target byte.
+        let word_index = index / WORD_BITS;
+        let mask = 1 << (index % WORD_BITS);
+        let word = self.buffer.add(word_index);
 
-        // Clear the bit position. If the value is true, set the bit; otherwise, the bit remains cleared.
-        *ptr &= !bit_indexer; // Clear the target bit.
         if value {
-            *ptr |= bit_indexer; // Set the target bit if the value is true.
+            *word |= mask;
+        } else {
+            *word &= !mask;
         }
+        self.update_summary(word_index);
         true
     }
+
+    /// Sets or clears `count` consecutive bits starting at `start`, one word at a time.
+    ///
+    /// Bits outside the bitmap are ignored.
+    ///
+    /// # Arguments
+    ///
+    /// * `start` - The index of the first bit to modify.
+    /// * `count` - The number of bits to modify.
+    /// * `value` - The value to store in every bit of the range.
+    ///
+    /// # Returns
+    ///
+    /// The number of bits whose value actually changed.
+    pub unsafe fn set_range(&mut self, start: usize, count: usize, value: bool) -> usize {
+        let end = start.saturating_add(count).min(self.size);
+        let mut index = start;
+        let mut changed = 0;
+
+        while index < end {
+            let word_index = index / WORD_BITS;
+            let bit = index % WORD_BITS;
+            let bits = (WORD_BITS - bit).min(end - index);
+
+            // Build a mask covering `bits` bits starting at `bit`.
+            let mask = if bits == WORD_BITS {
+                !0
+            } else {
+                ((1u64 << bits) - 1) << bit
+            };
+
+            let word = self.buffer.add(word_index);
+            let old = *word;
+            *word = if value { old | mask } else { old & !mask };
+            changed += (old ^ *word).count_ones() as usize;
+
+            self.update_summary(word_index);
+            index += bits;
+        }
+
+        changed
+    }
+
+    /// Finds the first clear bit at or after `from`.
+    ///
+    /// Full words are skipped through the summary level, so the cost is a handful of word operations
+    /// regardless of how many bits are set.
+    ///
+    /// # Returns
+    ///
+    /// The index of the first clear bit, or `None` if every bit from `from` onwards is set.
+    pub unsafe fn find_first_zero(&self, from: usize) -> Option<usize> {
+        if from >= self.size {
+            return None;
+        }
+
+        // Check the partial word containing `from`, treating the bits below it as used.
+        let word_index = from / WORD_BITS;
+        let word = *self.buffer.add(word_index) | ((1 << (from % WORD_BITS)) - 1);
+        if word != !0 {
+            return Some(word_index * WORD_BITS + (!word).trailing_zeros() as usize);
+        }
+
+        // Let the summary level locate the next word that has a clear bit.
+        let word_index = self.next_free_word(word_index + 1)?;
+        let word = *self.buffer.add(word_index);
+        Some(word_index * WORD_BITS + (!word).trailing_zeros() as usize)
+    }
+
+    /// Finds the first set bit at or after `from`.
+    ///
+    /// # Returns
+    ///
+    /// The index of the first set bit, or `None` if every bit from `from` to the end of the bitmap is clear.
+    pub unsafe fn find_first_one(&self, from: usize) -> Option<usize> {
+        if from >= self.size {
+            return None;
+        }
+
+        let words = Self::words_for(self.size);
+        let mut word_index = from / WORD_BITS;
+        // Ignore the bits below `from` in the first word.
+        let mut word = *self.buffer.add(word_index) & !((1 << (from % WORD_BITS)) - 1);
+
+        loop {
+            if word != 0 {
+                let index = word_index * WORD_BITS + word.trailing_zeros() as usize;
+                return if index < self.size { Some(index) } else { None };
+            }
+
+            word_index += 1;
+            if word_index >= words {
+                return None;
+            }
+            word = *self.buffer.add(word_index);
+        }
+    }
+
+    /// Finds `count` consecutive clear bits at or after `from`.
+    ///
+    /// The run search works on whole words: words without any set bit extend the current run by 64 bits
+    /// at once, and full words are skipped through the summary level.
+    ///
+    /// # Returns
+    ///
+    /// The index of the first bit of the run, or `None` if no run of the requested length exists.
+    pub unsafe fn find_zero_run(&self, count: usize, from: usize) -> Option<usize> {
+        if count == 0 {
+            return Some(from);
+        }
+
+        let mut run_start = from;
+        let mut index = from;
+
+        while index < self.size {
+            let word_index = index / WORD_BITS;
+            let bit = index % WORD_BITS;
+
+            // Skip over completely used words without looking at them.
+            if bit == 0 && self.is_word_full(word_index) {
+                index = self.next_free_word(word_index + 1)? * WORD_BITS;
+                run_start = index;
+                continue;
+            }
+
+            // The remaining bits of the current word, shifted down to bit 0.
+            let word = *self.buffer.add(word_index) >> bit;
+
+            if word == 0 {
+                // Every remaining bit of the word is clear.
+                index += WORD_BITS - bit;
+            } else {
+                // Extend the run up to the first set bit, then skip the set bits.
+                let free = word.trailing_zeros() as usize;
+                if index + free - run_start >= count {
+                    return Some(run_start);
+                }
+                let used = (!(word >> free)).trailing_zeros() as usize;
+                index += free + used;
+                run_start = index;
+            }
+
+            if index - run_start >= count {
+                return Some(run_start);
+            }
+        }
+
+        None
+    }
+
+    // Returns the number of 64-bit words needed to hold `bits` bits.
+    const fn words_for(bits: usize) -> usize {
+        (bits + WORD_BITS - 1) / WORD_BITS
+    }
+
+    // Returns whether every bit of the given leaf word is set, according to the summary level.
+    unsafe fn is_word_full(&self, word_index: usize) -> bool {
+        (*self.summary.add(word_index / WORD_BITS) & (1 << (word_index % WORD_BITS))) != 0
+    }
+
+    // Updates the summary bit of a leaf word after it has been modified.
+    unsafe fn update_summary(&mut self, word_index: usize) {
+        let summary = self.summary.add(word_index / WORD_BITS);
+        let mask = 1 << (word_index % WORD_BITS);
+
+        if *self.buffer.add(word_index) == !0 {
+            *summary |= mask;
+        } else {
+            *summary &= !mask;
+        }
+    }
+
+    // Finds the first leaf word at or after `word_index` that has at least one clear bit.
+    unsafe fn next_free_word(&self, word_index: usize) -> Option<usize> {
+        let words = Self::words_for(self.size);
+        if word_index >= words {
+            return None;
+        }
+
+        let mut summary_index = word_index / WORD_BITS;
+        // Treat the summary bits below `word_index` as full.
+        let mut summary = *self.summary.add(summary_index) | ((1 << (word_index % WORD_BITS)) - 1);
+
+        loop {
+            if summary != !0 {
+                let index = summary_index * WORD_BITS + (!summary).trailing_zeros() as usize;
+                return if index < words { Some(index) } else { None };
+            }
+
+            summary_index += 1;
+            if summary_index >= Self::words_for(words) {
+                return None;
+            }
+            summary = *self.summary.add(summary_index);
+        }
+    }
 }
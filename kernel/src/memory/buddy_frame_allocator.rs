@@ -0,0 +1,222 @@
+use super::{
+    addr::{PhysAddr, ToPhysAddr},
+    iter_and_apply, page_frame,
+    physical_page_allocator::PhysicalPageAllocator,
+    PAGE_SIZE,
+};
+use crate::{
+    data_types::intrusive_list::{IntrusiveList, Link},
+    println,
+    structures::BootInfo,
+};
+
+/// The largest block order managed by the buddy allocator (2^18 pages = 1 GiB).
+pub const MAX_ORDER: usize = 18;
+
+// Frame state flag marking the first frame of a free block; the low bits hold the block order.
+const FRAME_FREE: u8 = 0x80;
+
+/// BuddyFrameAllocator manages physical page frames as power-of-two blocks using a binary buddy system.
+///
+/// Every usable region of the EFI memory map is split into naturally aligned blocks of 2^order pages,
+/// which are kept in one free list per order. Allocation splits a larger block when the requested order
+/// is empty, and freeing merges a block with its buddy for as long as the buddy is free, so both
+/// operations take O(MAX_ORDER) steps and freed memory is always found again.
+///
+/// Fields:
+/// - free_lists: One intrusive doubly-linked list per order. The list links live inside the free frames,
+///   which are reached through the direct physical map, so the allocator needs no memory for its free lists.
+/// - frames: The number of frames covered by the page frame database, whose per-frame buddy state
+///   records the order of every block. This lets `free` test whether a buddy is a free block of the
+///   same order in O(1).
+/// - free_frames: The number of frames currently available for allocation.
+/// - total_frames: The number of frames handed to the allocator.
+pub struct BuddyFrameAllocator {
+    free_lists: [IntrusiveList; MAX_ORDER + 1],
+    frames: usize,
+    free_frames: usize,
+    total_frames: usize,
+}
+
+impl BuddyFrameAllocator {
+    pub const fn new() -> BuddyFrameAllocator {
+        BuddyFrameAllocator {
+            free_lists: [IntrusiveList::new(); MAX_ORDER + 1],
+            frames: 0,
+            free_frames: 0,
+            total_frames: 0,
+        }
+    }
+
+    /// Builds the buddy allocator from the EFI memory map.
+    ///
+    /// Every page of every usable region that the boot allocator has not handed out yet (kernel image,
+    /// bitmap, boot page tables, page frame database) is moved into the buddy free lists. From this point on the boot allocator owns no free pages.
+    ///
+    /// # Safety
+    ///
+    /// This function is unsafe because it writes into every free frame it takes over. The caller must ensure
+    /// that all usable memory is reachable through `PhysAddr::as_mut_ptr`, that `boot_allocator` was initialized
+    /// from the same `boot_info`, and that the page frame database has been initialized.
+    ///
+    /// # Arguments
+    ///
+    /// * `boot_info` - A reference to the boot information structure, containing the EFI memory map.
+    /// * `boot_allocator` - The bitmap allocator used during early boot.
+    pub unsafe fn init(
+        &mut self,
+        boot_info: &'static BootInfo,
+        boot_allocator: &mut PhysicalPageAllocator,
+    ) {
+        // Track every frame covered by the page frame database, which ends at the highest usable region.
+        self.frames = page_frame::frame_count();
+
+        // Move every remaining free page of every usable region into the buddy free lists.
+        iter_and_apply(boot_info, |descriptor| {
+            if descriptor.is_usable() {
+                boot_allocator.take_free_ranges(
+                    PhysAddr(descriptor.physical_start as usize),
+                    descriptor.number_of_pages as usize,
+                    |start, pages| self.add_range(start, pages),
+                );
+            }
+        });
+
+        println!(
+            "Buddy frame allocator initialized: {} frames, {} MB free",
+            self.total_frames,
+            self.free_memory_mb()
+        );
+    }
+
+    /// Allocates a block of 2^order physically contiguous frames.
+    ///
+    /// # Returns
+    ///
+    /// The physical address of the first frame of the block, aligned to the block size,
+    /// or `None` if no block of the requested order can be found.
+    pub fn alloc(&mut self, order: usize) -> Option<PhysAddr> {
+        if order > MAX_ORDER {
+            return None;
+        }
+
+        // Find the smallest non-empty order that can satisfy the request.
+        let mut current = (order..=MAX_ORDER).find(|&o| !self.free_lists[o].is_empty())?;
+        let block = self.free_lists[current].pop()?.to_phys_addr().0;
+        let pfn = block / PAGE_SIZE;
+
+        // Split the block down to the requested order, returning the upper halves to the free lists.
+        while current > order {
+            current -= 1;
+            unsafe { self.push_free(pfn + (1 << current), current) };
+        }
+
+        unsafe { self.set_state(pfn, order as u8) };
+        self.free_frames -= 1 << order;
+
+        Some(PhysAddr(block))
+    }
+
+    /// Allocates enough contiguous frames to hold `pages` pages.
+    ///
+    /// The request is rounded up to the next power of two; the returned block must be freed with the
+    /// same page count.
+    pub fn alloc_pages(&mut self, pages: usize) -> Option<PhysAddr> {
+        self.alloc(Self::order_for(pages))
+    }
+
+    /// Returns a block of 2^order frames to the allocator, merging it with its buddies.
+    ///
+    /// # Safety
+    ///
+    /// `addr` must have been returned by `alloc` with the same `order`, and the block must no longer be in use.
+    pub unsafe fn free(&mut self, addr: PhysAddr, order: usize) {
+        let mut pfn = addr.0 / PAGE_SIZE;
+        let mut order = order;
+
+        self.free_frames += 1 << order;
+
+        // Merge with the buddy for as long as it is a free block of the same order.
+        while order < MAX_ORDER {
+            let buddy = pfn ^ (1 << order);
+            if buddy >= self.frames || self.state(buddy) != FRAME_FREE | order as u8 {
+                break;
+            }
+
+            self.free_lists[order].remove(Self::link(buddy));
+            self.set_state(buddy, 0);
+            self.set_state(pfn, 0);
+
+            pfn = pfn.min(buddy);
+            order += 1;
+        }
+
+        self.push_free(pfn, order);
+    }
+
+    /// Frees a block previously returned by `alloc_pages`.
+    ///
+    /// # Safety
+    ///
+    /// See `free`.
+    pub unsafe fn free_pages(&mut self, addr: PhysAddr, pages: usize) {
+        self.free(addr, Self::order_for(pages));
+    }
+
+    /// Returns the smallest order whose block holds at least `pages` pages.
+    pub fn order_for(pages: usize) -> usize {
+        pages.max(1).next_power_of_two().trailing_zeros() as usize
+    }
+
+    /// Returns the amount of free memory in megabytes.
+    pub fn free_memory_mb(&self) -> usize {
+        self.free_frames * PAGE_SIZE / 1024 / 1024
+    }
+
+    /// Returns the number of free frames.
+    pub fn free_frames(&self) -> usize {
+        self.free_frames
+    }
+
+    // Adds a run of free pages, splitting it into the largest naturally aligned blocks that fit.
+    unsafe fn add_range(&mut self, start: PhysAddr, pages: usize) {
+        let mut pfn = start.0 / PAGE_SIZE;
+        let end = (pfn + pages).min(self.frames);
+
+        while pfn < end {
+            // The block order is limited by the alignment of the frame number and by the remaining length.
+            let align_order = if pfn == 0 {
+                MAX_ORDER
+            } else {
+                pfn.trailing_zeros() as usize
+            };
+            let size_order = (usize::BITS - 1 - (end - pfn).leading_zeros()) as usize;
+            let order = align_order.min(size_order).min(MAX_ORDER);
+
+            // Go through `free` so that the block merges with neighbours added from an adjacent range.
+            self.free(PhysAddr(pfn * PAGE_SIZE), order);
+            self.total_frames += 1 << order;
+
+            pfn += 1 << order;
+        }
+    }
+
+    // Pushes a block to the free list of its order and records it in the frame state array.
+    unsafe fn push_free(&mut self, pfn: usize, order: usize) {
+        self.free_lists[order].push(Self::link(pfn));
+        self.set_state(pfn, FRAME_FREE | order as u8);
+    }
+
+    // Returns the free list link stored at the start of a frame.
+    fn link(pfn: usize) -> *mut Link {
+        PhysAddr(pfn * PAGE_SIZE).as_mut_ptr()
+    }
+
+    unsafe fn state(&self, pfn: usize) -> u8 {
+        page_frame::by_pfn(pfn).unwrap().buddy_state()
+    }
+
+    unsafe fn set_state(&mut self, pfn: usize, state: u8) {
+        page_frame::by_pfn(pfn).unwrap().set_buddy_state(state);
+    }
+}
@@ -0,0 +1,183 @@
+use super::{
+    addr::{PhysAddr, ToPhysAddr},
+    buddy_frame_allocator::BuddyFrameAllocator,
+    page_frame::{self, FrameFlags},
+    PAGE_SIZE,
+};
+use crate::{
+    data_types::intrusive_list::{IntrusiveList, Link},
+    sync::mutex::SpinMutex,
+};
+
+/// The buffer sizes served from recycling pools: one sector, one page and one 64 KB transfer.
+pub const DMA_SIZE_CLASSES: [usize; 3] = [512, PAGE_SIZE, 64 * 1024];
+
+// The maximum number of idle page-sized or larger buffers kept per pool before they go back to the frame allocator.
+// Sector buffers are carved out of whole frames and always stay in their pool.
+const POOL_LIMIT: usize = 32;
+
+/// A pool of idle DMA buffers of a single size class.
+///
+/// Idle buffers are linked through their first bytes, so a pool needs no memory of its own.
+struct DmaPool {
+    free: IntrusiveList,
+    idle: usize,
+}
+
+static mut DMA_POOLS: SpinMutex<[DmaPool; DMA_SIZE_CLASSES.len()]> = SpinMutex::new(
+    [const {
+        DmaPool {
+            free: IntrusiveList::new(),
+            idle: 0,
+        }
+    }; DMA_SIZE_CLASSES.len()],
+);
+
+/// A physically contiguous buffer that devices can access directly.
+///
+/// The CPU reaches a buffer through the direct physical map with `as_ptr`, while devices are programmed
+/// with its physical address from `phys_addr`.
+/// Every buffer is aligned to its size class (512 B, 4 KB or 64 KB; larger buffers to their
+/// power-of-two block size), which satisfies the alignment required for AHCI command lists,
+/// command tables, received FIS areas and PRD data blocks.
+///
+/// The buffer is returned to its pool when the handle is dropped.
+pub struct DmaBuffer {
+    addr: PhysAddr,
+    size: usize,
+}
+
+impl DmaBuffer {
+    /// Allocates a DMA buffer of at least `size` bytes with undefined contents, for buffers that a
+    /// device or the caller overwrites completely.
+    ///
+    /// # Panics
+    ///
+    /// Panics if physical memory is exhausted.
+    pub fn new(size: usize) -> DmaBuffer {
+        DmaBuffer {
+            addr: alloc(size).expect("Out of DMA memory"),
+            size,
+        }
+    }
+
+    /// Allocates a DMA buffer of at least `size` bytes whose first `size` bytes are zeroed.
+    ///
+    /// # Panics
+    ///
+    /// Panics if physical memory is exhausted.
+    pub fn new_zeroed(size: usize) -> DmaBuffer {
+        DmaBuffer {
+            addr: alloc_zeroed(size).expect("Out of DMA memory"),
+            size,
+        }
+    }
+
+    /// Returns a pointer to the start of the buffer.
+    pub fn as_ptr(&self) -> *mut u8 {
+        self.addr.as_mut_ptr()
+    }
+
+    /// Returns the physical address of the buffer, as programmed into device registers and descriptors.
+    pub fn phys_addr(&self) -> u64 {
+        self.addr.0 as u64
+    }
+
+    /// Returns the requested size of the buffer in bytes.
+    pub fn len(&self) -> usize {
+        self.size
+    }
+}
+
+impl Drop for DmaBuffer {
+    fn drop(&mut self) {
+        unsafe { free(self.addr, self.size) };
+    }
+}
+
+/// Allocates a physically contiguous buffer of at least `size` bytes. Its contents are undefined.
+///
+/// Requests up to 64 KB are rounded up to a size class and served from its pool; an empty pool is
+/// refilled from the frame allocator. Larger requests take a block of frames directly.
+///
+/// # Returns
+///
+/// The physical address of the buffer, or `None` if memory is exhausted.
+pub fn alloc(size: usize) -> Option<PhysAddr> {
+    match size_class(size) {
+        Some(class) => alloc_from_pool(class),
+        None => alloc_block(block_order(size)),
+    }
+}
+
+/// Allocates a buffer like `alloc` and zeroes its first `size` bytes.
+pub fn alloc_zeroed(size: usize) -> Option<PhysAddr> {
+    let addr = alloc(size)?;
+    unsafe { addr.as_mut_ptr::<u8>().write_bytes(0, size) };
+    Some(addr)
+}
+
+/// Returns a buffer obtained from `alloc` to its pool.
+///
+/// # Safety
+///
+/// `addr` must have been returned by `alloc` with the same `size`, and no device may still be accessing it.
+pub unsafe fn free(addr: PhysAddr, size: usize) {
+    let class = match size_class(size) {
+        Some(class) => class,
+        None => return super::free_frames(addr, block_order(size)),
+    };
+
+    let mut pools = DMA_POOLS.lock();
+    let pool = &mut pools[class];
+
+    // Trim page-sized and larger pools so that a burst of large transfers does not pin memory forever.
+    if DMA_SIZE_CLASSES[class] >= PAGE_SIZE && pool.idle >= POOL_LIMIT {
+        drop(pools);
+        super::free_frames(addr, block_order(DMA_SIZE_CLASSES[class]));
+        return;
+    }
+
+    pool.free.push(addr.as_mut_ptr::<Link>());
+    pool.idle += 1;
+}
+
+// Takes an idle buffer from a pool, refilling the pool from the frame allocator when it is empty.
+fn alloc_from_pool(class: usize) -> Option<PhysAddr> {
+    let class_size = DMA_SIZE_CLASSES[class];
+    let mut pools = unsafe { DMA_POOLS.lock() };
+    let pool = &mut pools[class];
+
+    if let Some(buffer) = pool.free.pop() {
+        pool.idle -= 1;
+        return Some(buffer.to_phys_addr());
+    }
+
+    let block = alloc_block(block_order(class_size))?;
+
+    // Sector buffers are carved out of a whole frame; keep the first one and pool the rest.
+    for offset in (class_size..PAGE_SIZE).step_by(class_size) {
+        unsafe { pool.free.push((block + offset).as_mut_ptr::<Link>()) };
+        pool.idle += 1;
+    }
+
+    Some(block)
+}
+
+// Takes a block of 2^order frames from the frame allocator and marks its frames as DMA memory.
+// The mark stays while the block is pooled and is cleared when the block goes back to the frame allocator.
+fn alloc_block(order: usize) -> Option<PhysAddr> {
+    let block = super::alloc_frames(order)?;
+    page_frame::mark_range(block, 1 << order, FrameFlags::DMA);
+    Some(block)
+}
+
+// Returns the index of the smallest size class that holds `size` bytes.
+fn size_class(size: usize) -> Option<usize> {
+    DMA_SIZE_CLASSES.iter().position(|&class| size <= class)
+}
+
+// Returns the frame order of the block that backs a buffer of `size` bytes.
+fn block_order(size: usize) -> usize {
+    BuddyFrameAllocator::order_for((size + PAGE_SIZE - 1) / PAGE_SIZE)
+}
@@ -0,0 +1,134 @@
+use super::{addr::PhysAddr, buddy_frame_allocator::BuddyFrameAllocator};
+use crate::{
+    cpu::percpu::{current_cpu, MAX_CPUS},
+    interrupts::without_interrupts,
+    sync::mutex::SpinMutex,
+};
+
+/// The number of frames moved between a magazine and the global frame allocator at once.
+pub const MAGAZINE_BATCH: usize = 32;
+
+/// The capacity of a magazine. Two batches fit, so a full magazine can drain one batch and keep the other warm.
+pub const MAGAZINE_CAPACITY: usize = 2 * MAGAZINE_BATCH;
+
+/// Per-CPU magazine counters.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct MagazineStats {
+    pub hits: u64,    // Allocations served from the magazine
+    pub misses: u64,  // Allocations that found the magazine empty
+    pub refills: u64, // Batches taken from the global allocator
+    pub drains: u64,  // Batches returned to the global allocator
+}
+
+impl MagazineStats {
+    /// Returns the percentage of allocations that were served without touching the global allocator.
+    pub fn hit_rate(&self) -> u64 {
+        let total = self.hits + self.misses;
+        if total == 0 {
+            0
+        } else {
+            self.hits * 100 / total
+        }
+    }
+}
+
+/// A per-CPU LIFO stack of free single frames in front of the global buddy allocator.
+///
+/// A magazine is only touched by its own CPU with interrupts disabled, so allocating or freeing a frame
+/// takes no lock. The global allocator's lock is taken only when the magazine has to be refilled or drained,
+/// and then for a whole batch of frames at once.
+pub struct Magazine {
+    frames: [PhysAddr; MAGAZINE_CAPACITY],
+    count: usize,
+    stats: MagazineStats,
+}
+
+/// One magazine per CPU, indexed by `current_cpu()`.
+static mut MAGAZINES: [Magazine; MAX_CPUS] = [const { Magazine::new() }; MAX_CPUS];
+
+impl Magazine {
+    pub const fn new() -> Magazine {
+        Magazine {
+            frames: [PhysAddr(0); MAGAZINE_CAPACITY],
+            count: 0,
+            stats: MagazineStats {
+                hits: 0,
+                misses: 0,
+                refills: 0,
+                drains: 0,
+            },
+        }
+    }
+
+    // Pops a frame, refilling the magazine with a batch from the global allocator when it is empty.
+    fn alloc(&mut self, global: &SpinMutex<Option<BuddyFrameAllocator>>) -> Option<PhysAddr> {
+        if self.count == 0 {
+            self.stats.misses += 1;
+            self.refill(global);
+            if self.count == 0 {
+                return None;
+            }
+        } else {
+            self.stats.hits += 1;
+        }
+
+        self.count -= 1;
+        Some(self.frames[self.count])
+    }
+
+    // Pushes a frame, draining a batch to the global allocator when the magazine is full.
+    fn free(&mut self, frame: PhysAddr, global: &SpinMutex<Option<BuddyFrameAllocator>>) {
+        if self.count == MAGAZINE_CAPACITY {
+            self.drain(global);
+        }
+
+        self.frames[self.count] = frame;
+        self.count += 1;
+    }
+
+    // Takes up to one batch of frames from the global allocator under its lock.
+    fn refill(&mut self, global: &SpinMutex<Option<BuddyFrameAllocator>>) {
+        let mut allocator = global.lock();
+        if let Some(ref mut allocator) = *allocator {
+            while self.count < MAGAZINE_BATCH {
+                match allocator.alloc(0) {
+                    Some(frame) => {
+                        self.frames[self.count] = frame;
+                        self.count += 1;
+                    }
+                    None => break,
+                }
+            }
+            self.stats.refills += 1;
+        }
+    }
+
+    // Returns the oldest batch of frames to the global allocator under its lock.
+    fn drain(&mut self, global: &SpinMutex<Option<BuddyFrameAllocator>>) {
+        let mut allocator = global.lock();
+        if let Some(ref mut allocator) = *allocator {
+            for frame in &self.frames[..MAGAZINE_BATCH] {
+                unsafe { allocator.free(*frame, 0) };
+            }
+            // Keep the most recently freed (cache-hot) frames.
+            self.frames.copy_within(MAGAZINE_BATCH..self.count, 0);
+            self.count -= MAGAZINE_BATCH;
+            self.stats.drains += 1;
+        }
+    }
+}
+
+/// Allocates a single frame from the executing CPU's magazine.
+pub fn alloc_frame(global: &SpinMutex<Option<BuddyFrameAllocator>>) -> Option<PhysAddr> {
+    without_interrupts(|| unsafe { MAGAZINES[current_cpu()].alloc(global) })
+}
+
+/// Returns a single frame to the executing CPU's magazine.
+pub fn free_frame(frame: PhysAddr, global: &SpinMutex<Option<BuddyFrameAllocator>>) {
+    without_interrupts(|| unsafe { MAGAZINES[current_cpu()].free(frame, global) })
+}
+
+/// Returns the magazine counters of a CPU.
+pub fn stats(cpu: usize) -> MagazineStats {
+    without_interrupts(|| unsafe { MAGAZINES[cpu].stats })
+}
@@ -1,61 +1,187 @@
-use super::heap::heap::Heap;
+use super::{
+    heap::{
+        self,
+        arena::{Arena, ARENA_SPAN},
+        heap::Heap,
+        large,
+    },
+    HEAP_START,
+};
+use crate::{
+    cpu::percpu::{current_cpu, MAX_CPUS},
+    interrupts::without_interrupts,
+    memory::addr::VirtAddr,
+};
 use core::{
     alloc::{GlobalAlloc, Layout},
     cell::UnsafeCell,
-    ptr::NonNull,
+    ptr::{self, NonNull},
 };
 
-// GlobalAllocator encapsulates a Heap instance to manage memory allocations.
-pub struct GlobalAllocator(UnsafeCell<Heap<32>>);
+// GlobalAllocator manages memory allocations through one heap arena per CPU.
+// Each CPU allocates from and frees into its own arena without taking a lock; interrupts are disabled
+// around arena operations so that an interrupt handler cannot re-enter the arena it interrupted.
+// A block freed by a CPU that does not own it is pushed onto the owner's lock-free remote-free list.
+// Arena heaps are reserved but not mapped; their pages are backed by the page fault handler on first access.
+// Allocations above `large::LARGE_THRESHOLD` skip the arenas and get exactly the pages they need in a separate range.
+pub struct GlobalAllocator {
+    arenas: UnsafeCell<[Arena; MAX_CPUS]>,
+    realloc_stats: UnsafeCell<[ReallocStats; MAX_CPUS]>,
+}
+
+/// Counters of the resizes one CPU did through `GlobalAllocator::realloc`.
+#[derive(Debug, Clone, Copy)]
+pub struct ReallocStats {
+    pub in_place: u64, // Arena blocks that kept their place
+    pub remapped: u64, // Large allocations resized or moved by remapping their pages
+    pub copied: u64, // Resizes that allocated a new block and copied, e.g. between size ranges or for a remote owner
+}
 
 impl GlobalAllocator {
     pub const fn new() -> Self {
-        GlobalAllocator(UnsafeCell::new(Heap::new()))
+        GlobalAllocator {
+            arenas: UnsafeCell::new([const { Arena::new() }; MAX_CPUS]),
+            realloc_stats: UnsafeCell::new(
+                [ReallocStats {
+                    in_place: 0,
+                    remapped: 0,
+                    copied: 0,
+                }; MAX_CPUS],
+            ),
+        }
     }
 
     // Initializes the GlobalAllocator with a given Heap instance.
-    // This function can be used to set up the allocator with a pre-configured Heap.
+    // The heap becomes the arena of the bootstrap processor; it must lie in the first `ARENA_SPAN` bytes after `HEAP_START`.
+    // The arenas of the other CPUs are created when they first allocate.
     pub fn init(&mut self, heap: Heap<32>) {
-        self.0 = UnsafeCell::new(heap);
+        self.arenas.get_mut()[0].init(heap);
     }
 
     pub fn alloc_page(&self) -> *mut u8 {
-        let heap = unsafe { &mut *self.0.get() };
         let layout = Layout::from_size_align(4096, 4096).unwrap();
-        match heap.alloc(layout) {
-            Ok(ptr) => ptr.as_ptr(),
-            Err(_) => panic!("Out of memory"),
-        }
+        unsafe { self.alloc(layout) }
+    }
+
+    // Returns the arena of a CPU, e.g. to read its slab statistics.
+    pub fn arena(&self, cpu: usize) -> &Arena {
+        unsafe { &*self.arena_ptr(cpu) }
+    }
+
+    // Returns the resize counters of a CPU.
+    pub fn realloc_stats(&self, cpu: usize) -> ReallocStats {
+        unsafe { (*self.realloc_stats.get())[cpu] }
+    }
+
+    // Returns the resize counters of the executing CPU, which only it updates, with interrupts disabled.
+    unsafe fn local_realloc_stats(&self) -> &mut ReallocStats {
+        &mut (*self.realloc_stats.get())[current_cpu()]
+    }
+
+    // Returns a pointer to the arena of a CPU. Arenas are only accessed through raw pointers,
+    // since the owner mutates its arena while other CPUs push onto its remote-free list.
+    fn arena_ptr(&self, cpu: usize) -> *mut Arena {
+        unsafe { (self.arenas.get() as *mut Arena).add(cpu) }
+    }
+
+    // Reserves the address range of a CPU's arena and hands it to the arena.
+    unsafe fn init_arena(&self, cpu: usize) {
+        let start = VirtAddr(HEAP_START.0 + cpu * ARENA_SPAN);
+        (*self.arena_ptr(cpu)).init(heap::init(start, ARENA_SPAN));
     }
 }
 
 // Implements the GlobalAlloc trait for GlobalAllocator, allowing it to be used as the allocator for the system.
 unsafe impl GlobalAlloc for GlobalAllocator {
-    // Provides memory allocation using the encapsulated Heap.
+    // Provides memory allocation from the executing CPU's arena, or from the large range for large layouts.
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        // Obtain a mutable reference to the Heap.
-        let heap = &mut *self.0.get();
-
-        // Allocate memory using the Heap, and handle the result.
-        match heap.alloc(layout) {
-            Ok(ptr) => ptr.as_ptr(),
-            Err(_) => panic!("Out of memory"), // Panic if the heap cannot fulfill the allocation request.
+        if large::is_large(layout) {
+            return without_interrupts(|| large::alloc(layout));
         }
+
+        without_interrupts(|| {
+            let cpu = current_cpu();
+            let arena = self.arena_ptr(cpu);
+
+            if !(*arena).is_ready() {
+                self.init_arena(cpu);
+            }
+
+            // Allocate memory from the arena, and handle the result.
+            match (*arena).alloc(layout) {
+                Ok(ptr) => ptr.as_ptr(),
+                Err(_) => panic!("Out of memory"), // Panic if the arena's address range is exhausted.
+            }
+        })
     }
 
-    // Provides memory deallocation using the encapsulated Heap.
+    // Provides memory deallocation, either directly into the executing CPU's arena or
+    // through the remote-free list of the arena that owns the block.
     unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
-        // Obtain a mutable reference to the Heap.
-        let heap = &mut *self.0.get();
+        if large::is_large(layout) {
+            return without_interrupts(|| large::dealloc(ptr, layout));
+        }
 
         // Safely convert the raw pointer to NonNull and deallocate the memory.
         if let Some(non_null_ptr) = NonNull::new(ptr) {
-            heap.dealloc(non_null_ptr, layout);
+            without_interrupts(|| {
+                let owner = Arena::owner_of(ptr);
+                if owner == current_cpu() {
+                    (*self.arena_ptr(owner)).dealloc(non_null_ptr, layout);
+                } else {
+                    Arena::push_remote_free(self.arena_ptr(owner), non_null_ptr, layout);
+                }
+            });
+        }
+    }
+
+    // Resizes large allocations in place or by remapping their pages, and arena blocks in place when
+    // the executing CPU owns them and the arena can resize them. Other resizes allocate, copy and free.
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+        match (large::is_large(layout), large::is_large(new_layout)) {
+            (true, true) => {
+                return without_interrupts(|| {
+                    let new_ptr = large::realloc(ptr, layout, new_size);
+                    if !new_ptr.is_null() {
+                        self.local_realloc_stats().remapped += 1;
+                    }
+                    new_ptr
+                })
+            }
+            (false, false) => {
+                let resized = without_interrupts(|| {
+                    let owner = Arena::owner_of(ptr);
+                    let resized = owner == current_cpu()
+                        && (*self.arena_ptr(owner)).realloc(
+                            NonNull::new_unchecked(ptr),
+                            layout,
+                            new_size,
+                        );
+                    if resized {
+                        self.local_realloc_stats().in_place += 1;
+                    }
+                    resized
+                });
+                if resized {
+                    return ptr;
+                }
+            }
+            _ => {}
+        }
+
+        let new_ptr = self.alloc(new_layout);
+        if !new_ptr.is_null() {
+            ptr::copy_nonoverlapping(ptr, new_ptr, layout.size().min(new_size));
+            self.dealloc(ptr, layout);
+            without_interrupts(|| self.local_realloc_stats().copied += 1);
         }
+        new_ptr
     }
 }
 
-// The Sync trait implementation is marked unsafe because the GlobalAllocator
-// allows mutable static access to the Heap, and it's the developer's responsibility
-// to ensure no data races occur.
+// The Sync trait implementation is marked unsafe because the GlobalAllocator hands out
+// mutable access to its arenas. This is sound because each arena is only mutated by its
+// owning CPU with interrupts disabled, and other CPUs only touch its atomic remote-free list.
+// The resize counters of a CPU are likewise only updated by that CPU with interrupts disabled.
 unsafe impl Sync for GlobalAllocator {}
@@ -0,0 +1,161 @@
+use super::{heap::Heap, slab::SlabAllocator};
+use crate::memory::HEAP_START;
+use core::{
+    alloc::Layout,
+    ptr::{self, NonNull},
+    sync::atomic::{AtomicPtr, Ordering},
+};
+
+/// The virtual address space reserved for each per-CPU arena, starting at `HEAP_START`.
+/// The arena that owns a heap pointer is found by dividing its offset from `HEAP_START` by this span.
+/// The whole span belongs to the arena's heap, and its pages are backed on first access.
+pub const ARENA_SPAN: usize = 1 << 30; // 1 GB
+
+/// A block freed by a CPU other than its owner, waiting in the owner's remote-free list.
+///
+/// The node is stored in the freed block itself, so it must fit into the smallest slab object (16 bytes).
+#[repr(C)]
+struct RemoteFree {
+    next: *mut RemoteFree,
+    layout: usize, // The allocation's size in the low 56 bits and log2 of its alignment in the high 8 bits
+}
+
+/// A per-CPU heap arena: a buddy heap with a slab layer in front of it, owned by a single CPU.
+///
+/// The owner allocates and frees with interrupts disabled and without taking any lock. Blocks freed
+/// by other CPUs are pushed onto `remote_free`, a lock-free multi-producer single-consumer stack,
+/// and the owner returns them to its heap at the start of its next allocation.
+pub struct Arena {
+    heap: Heap<32>,
+    slab: SlabAllocator,
+    remote_free: AtomicPtr<RemoteFree>,
+    ready: bool,
+}
+
+impl Arena {
+    pub const fn new() -> Arena {
+        Arena {
+            heap: Heap::new(),
+            slab: SlabAllocator::new(),
+            remote_free: AtomicPtr::new(ptr::null_mut()),
+            ready: false,
+        }
+    }
+
+    /// Hands the arena its heap and makes it ready for allocations.
+    pub fn init(&mut self, heap: Heap<32>) {
+        self.heap = heap;
+        self.ready = true;
+    }
+
+    pub fn is_ready(&self) -> bool {
+        self.ready
+    }
+
+    /// Returns the index of the arena whose address range contains `ptr`.
+    pub fn owner_of(ptr: *mut u8) -> usize {
+        (ptr as usize - HEAP_START.0) / ARENA_SPAN
+    }
+
+    /// Allocates memory from the slab layer if the layout fits a size class, or from the heap otherwise.
+    ///
+    /// Pending remote frees are returned to the heap first, so memory freed by other CPUs is reused.
+    /// Must only be called by the owning CPU with interrupts disabled.
+    pub fn alloc(&mut self, layout: Layout) -> Result<NonNull<u8>, ()> {
+        self.drain_remote_frees();
+
+        match SlabAllocator::class_for(layout) {
+            Some(class) => self.slab.alloc(class, &mut self.heap),
+            None => self.heap.alloc(layout),
+        }
+    }
+
+    /// Frees a block allocated from this arena.
+    ///
+    /// # Safety
+    ///
+    /// Must only be called by the owning CPU with interrupts disabled; `ptr` must have been allocated
+    /// from this arena with the same `layout`.
+    pub unsafe fn dealloc(&mut self, ptr: NonNull<u8>, layout: Layout) {
+        match SlabAllocator::class_for(layout) {
+            Some(class) => self.slab.dealloc(ptr, class, &mut self.heap),
+            None => self.heap.dealloc(ptr, layout),
+        }
+    }
+
+    /// Resizes a block of this arena in place, if it can stay where it is.
+    ///
+    /// A slab object keeps its place if the new size falls into the same size class; a heap block
+    /// grows into free buddies or shrinks by splitting. Pending remote frees are returned first,
+    /// so that a buddy freed by another CPU can be merged.
+    ///
+    /// # Safety
+    ///
+    /// Must only be called by the owning CPU with interrupts disabled; `ptr` must have been allocated
+    /// from this arena with the same `layout`.
+    ///
+    /// # Returns
+    ///
+    /// `true` if the block now holds `new_size` bytes at `ptr`. Otherwise the block is unchanged,
+    /// and the caller has to move it.
+    pub unsafe fn realloc(&mut self, ptr: NonNull<u8>, layout: Layout, new_size: usize) -> bool {
+        self.drain_remote_frees();
+
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+        match (
+            SlabAllocator::class_for(layout),
+            SlabAllocator::class_for(new_layout),
+        ) {
+            (Some(old_class), Some(new_class)) => old_class == new_class,
+            (None, None) => self.heap.realloc(ptr, layout, new_size).is_ok(),
+            _ => false,
+        }
+    }
+
+    /// Queues a block owned by `arena` for freeing by its owner. May be called from any CPU.
+    ///
+    /// # Safety
+    ///
+    /// `arena` must point to a valid arena, and `ptr` must have been allocated from it with the same `layout`.
+    pub unsafe fn push_remote_free(arena: *const Arena, ptr: NonNull<u8>, layout: Layout) {
+        let node = ptr.as_ptr() as *mut RemoteFree;
+        (*node).layout = layout.size() | (layout.align().trailing_zeros() as usize) << 56;
+
+        // Only the `remote_free` field is touched, since the owner may be using the rest of the arena.
+        let head = &*ptr::addr_of!((*arena).remote_free);
+        let mut current = head.load(Ordering::Relaxed);
+        loop {
+            (*node).next = current;
+            match head.compare_exchange_weak(current, node, Ordering::Release, Ordering::Relaxed) {
+                Ok(_) => break,
+                Err(actual) => current = actual,
+            }
+        }
+    }
+
+    /// Returns the slab layer of the arena, e.g. to read its per-class statistics.
+    pub fn slab(&self) -> &SlabAllocator {
+        &self.slab
+    }
+
+    // Takes the whole remote-free list in one swap and frees every block on it locally.
+    fn drain_remote_frees(&mut self) {
+        if self.remote_free.load(Ordering::Relaxed).is_null() {
+            return;
+        }
+
+        let mut node = self.remote_free.swap(ptr::null_mut(), Ordering::Acquire);
+        while !node.is_null() {
+            unsafe {
+                let next = (*node).next;
+                let packed = (*node).layout;
+                let layout = Layout::from_size_align_unchecked(
+                    packed & ((1 << 56) - 1),
+                    1 << (packed >> 56),
+                );
+                self.dealloc(NonNull::new_unchecked(node as *mut u8), layout);
+                node = next;
+            }
+        }
+    }
+}
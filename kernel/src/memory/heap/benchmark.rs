@@ -0,0 +1,54 @@
+use super::heap::Heap;
+use crate::{
+    memory::{addr::PhysAddr, region::Region},
+    println,
+    registers::rdtsc::Rdtsc,
+};
+use alloc::{
+    alloc::{alloc, dealloc},
+    vec::Vec,
+};
+use core::{alloc::Layout, ptr::NonNull};
+
+/// Measures the latency of `Heap::dealloc` for a growing number of free blocks.
+///
+/// For each round, a scratch heap is filled with `2 * n` minimum-sized blocks and every odd block is freed,
+/// which leaves `n` unmergeable blocks on the smallest free list. Freeing the even blocks then merges
+/// every one of them with its buddy. The cycles per merging dealloc are printed for each `n`; with O(1)
+/// coalescing they stay flat as `n` grows.
+pub fn benchmark_dealloc() {
+    const SCRATCH_SIZE: usize = 512 * 1024;
+    const ROUNDS: [usize; 4] = [64, 256, 1024, 4096];
+
+    let scratch_layout = Layout::from_size_align(SCRATCH_SIZE, SCRATCH_SIZE).unwrap();
+    let block_layout = Layout::from_size_align(32, 8).unwrap();
+    let scratch = unsafe { alloc(scratch_layout) };
+
+    for n in ROUNDS {
+        let mut heap: Heap<32> = Heap::new();
+        unsafe { heap.add_region(Region::new(PhysAddr(scratch as usize), SCRATCH_SIZE)) };
+
+        let blocks: Vec<NonNull<u8>> = (0..2 * n)
+            .map(|_| heap.alloc(block_layout).expect("Scratch heap exhausted"))
+            .collect();
+
+        // Leave `n` free blocks whose buddies are still allocated.
+        for block in blocks.iter().skip(1).step_by(2) {
+            heap.dealloc(*block, block_layout);
+        }
+
+        // Time the deallocations that have to find and unlink their buddy.
+        let start = Rdtsc::read();
+        for block in blocks.iter().step_by(2) {
+            heap.dealloc(*block, block_layout);
+        }
+        let cycles = (Rdtsc::read() - start) / n as u64;
+
+        println!(
+            "Heap dealloc: {} free blocks, {} cycles per dealloc",
+            n, cycles
+        );
+    }
+
+    unsafe { dealloc(scratch, scratch_layout) };
+}
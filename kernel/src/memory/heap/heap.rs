@@ -1,22 +1,49 @@
-use crate::{data_types::linked_list::LinkedList, memory::region::Region};
+use crate::{
+    data_types::intrusive_list::{IntrusiveList, Link},
+    memory::{bitmap::Bitmap, region::Region},
+};
 use core::{
     alloc::Layout,
     cmp::min,
     mem::{size_of, size_of_val},
-    ptr::NonNull,
+    ptr::{self, NonNull},
 };
 
+// The smallest block handed out by the heap. Every free block stores a `FreeBlock` header,
+// and every block is tracked by one bit of the free map.
+const MIN_BLOCK_SIZE: usize = 32;
+
+/// The header stored at the start of every free block.
+///
+/// The intrusive link must stay the first field: a block is found from its `Link` by a plain cast.
+#[repr(C)]
+struct FreeBlock {
+    link: Link,
+    class: usize, // The size class of the free block, valid only while the block's free map bit is set
+}
+
 /// A simple heap allocator implementing a buddy system allocation strategy, with a fixed number of size classes.
 ///
 /// The buddy system allocator divides memory into partitions to minimize fragmentation and simplify merging of adjacent free blocks.
-/// This implementation uses a series of size classes, each represented by a linked list, to manage memory allocations efficiently.
+/// This implementation uses a series of size classes, each represented by a doubly-linked intrusive list, to manage memory allocations efficiently.
+/// A bitmap marks the first granule of every free block, so a block's buddy is checked and unlinked in O(1) during coalescing.
 ///
 /// Generic parameter `N` specifies the number of size classes.
 pub struct Heap<const N: usize> {
-    /// An array of linked lists, where each linked list corresponds to a size class in the buddy system.
-    /// The index in the array represents the size class, and each linked list manages
+    /// An array of intrusive lists, where each list corresponds to a size class in the buddy system.
+    /// The index in the array represents the size class, and each list manages
     /// free memory blocks of a specific size range. Adjacent free blocks can be merged to form a larger block.
-    free_list: [LinkedList; N],
+    free_list: [IntrusiveList; N],
+
+    /// One bit per `MIN_BLOCK_SIZE` granule of the managed address range, set on the first granule of every free block.
+    /// A set bit tells `dealloc` that the block header at that address is valid, so the buddy's size class can be read from it.
+    free_map: Bitmap,
+
+    /// The start of the address range managed by the heap. The free map is stored at this address.
+    base: usize,
+
+    /// The size of the address range covered by the free map.
+    span: usize,
 
     /// The total size of user-allocated memory.
     /// This value represents the sum of the sizes of all blocks allocated by the user,
@@ -37,7 +64,10 @@ pub struct Heap<const N: usize> {
 impl<const N: usize> Heap<N> {
     pub const fn new() -> Self {
         Heap {
-            free_list: [LinkedList::new(); N],
+            free_list: [IntrusiveList::new(); N],
+            free_map: Bitmap::new(ptr::null_mut(), 0),
+            base: 0,
+            span: 0,
             user_size: 0,
             allocated: 0,
             total: 0,
@@ -48,6 +78,8 @@ impl<const N: usize> Heap<N> {
     ///
     /// This function takes a memory region and subdivides it into blocks that are powers of two in size,
     /// which are then added to the corresponding size classes in the buddy system allocator.
+    /// The first region added defines the address range covered by the free map, which is carved out of its start;
+    /// later regions must lie within that range.
     ///
     /// # Safety
     ///
@@ -58,24 +90,66 @@ impl<const N: usize> Heap<N> {
     ///
     /// * `region` - A memory region to be added to the heap.
     pub unsafe fn add_region(&mut self, region: Region) {
-        // Align the start address to the size of usize to ensure proper alignment for allocations.
-        let start = Self::align_up(region.start().0, size_of::<usize>());
+        self.add_region_inner(region, false);
+    }
+
+    /// Adds a memory region whose contents are known to read as zero, such as a reserved range of demand-zero pages.
+    ///
+    /// Works like `add_region`, but the free map is not cleared, so a page of the free map is only backed
+    /// once a bit in it is set. Only the pages holding block headers are touched up front.
+    ///
+    /// # Safety
+    ///
+    /// In addition to the requirements of `add_region`, every byte of the region must read as zero.
+    ///
+    /// # Arguments
+    ///
+    /// * `region` - A zeroed memory region to be added to the heap.
+    pub unsafe fn add_zeroed_region(&mut self, region: Region) {
+        self.add_region_inner(region, true);
+    }
+
+    // Adds a region to the heap, clearing the free map unless the region is known to be zeroed.
+    unsafe fn add_region_inner(&mut self, region: Region, zeroed: bool) {
+        // Align the start address to the minimum block size to ensure proper alignment for allocations.
+        let mut start = Self::align_up(region.start().0, MIN_BLOCK_SIZE);
 
-        // Align the end address down to ensure it's a multiple of the size of usize.
+        // Align the end address down to ensure it's a multiple of the minimum block size.
         // This step avoids partial block allocations at the end of the region.
-        let end = Self::align_down(region.start().0 + region.size(), size_of::<usize>());
+        let end = Self::align_down(region.start().0 + region.size(), MIN_BLOCK_SIZE);
 
         assert!(start <= end, "Invalid heap region");
 
+        if self.span == 0 {
+            // Place the free map at the start of the first region.
+            self.base = start;
+            self.span = end - start;
+            self.free_map = Bitmap::new(start as *mut u8, self.span / MIN_BLOCK_SIZE);
+            if !zeroed {
+                self.free_map.clear();
+            }
+
+            start += Self::align_up(
+                Bitmap::storage_size(self.span / MIN_BLOCK_SIZE),
+                MIN_BLOCK_SIZE,
+            );
+        }
+
+        assert!(
+            start >= self.base && end <= self.base + self.span,
+            "Heap region outside of the free map"
+        );
+
         let mut current = start;
 
         // Iterate over the region, subdividing it into blocks.
-        while current + size_of::<usize>() <= end {
+        while current + MIN_BLOCK_SIZE <= end {
             // Calculate the largest power-of-two block size that can fit in the remaining region
-            let block_size = Self::calculate_block_size(current, end);
+            let block_size = Self::calculate_block_size(current, end).min(1 << (N - 1));
 
-            // Add the block to the appropriate size class in the free list
-            self.free_list[block_size.trailing_zeros() as usize].push(current as *mut usize);
+            // Add the block to the appropriate size class in the free list,
+            // merging it with a free buddy from a previously added region.
+            self.free_block(current, block_size.trailing_zeros() as usize);
 
             current += block_size;
             self.total += block_size;
@@ -98,38 +172,35 @@ impl<const N: usize> Heap<N> {
     pub fn alloc(&mut self, layout: Layout) -> Result<NonNull<u8>, ()> {
         // Calculate the adjusted size, rounding up to the nearest power of two and considering alignment requirements.
         // This adjustment ensures that the allocated memory block meets the requested layout constraints.
-        let size = layout
-            .size()
-            .next_power_of_two()
-            .max(layout.align().max(size_of::<usize>()));
+        let size = Self::block_size(layout);
 
         // Determine the size class index based on the trailing zeros of the adjusted size,
         // which corresponds to the block size in the buddy system.
         let class = size.trailing_zeros() as usize;
 
-        // Iterate through the free list, starting from the determined class, looking for a suitable block.
-        for i in class..N {
-            // Check if there's an available block in the current class.
-            if !self.free_list[i].is_empty() {
-                // Attempt to split larger blocks to match the requested size if necessary.
-                if self.split_blocks(i, class).is_err() {
-                    return Err(());
-                }
+        // Find the smallest non-empty class that can satisfy the request.
+        let start_class = (class..N)
+            .find(|&i| !self.free_list[i].is_empty())
+            .ok_or(())?;
 
-                // Perform the allocation from the now appropriately sized block.
-                return self.allocate_from_class(class, size, layout.size());
-            }
+        // Split the block down to the requested class, returning the upper halves to the free lists.
+        let block = unsafe { self.take_block(start_class) };
+        for i in (class..start_class).rev() {
+            unsafe { self.push_free(block + (1 << i), i) };
         }
 
-        // If no suitable block was found, return an error
-        Err(())
+        // Update the heap's allocation statistics.
+        self.user_size += layout.size();
+        self.allocated += size;
+
+        NonNull::new(block as *mut u8).ok_or(())
     }
 
-    /// Deallocates a memory block, potentially merging it with its buddy block.
+    /// Deallocates a memory block, merging it with its buddy block for as long as the buddy is free.
     ///
-    /// This method frees the memory at the specified pointer and tries to merge the freed block
-    /// with its buddy block if the buddy is also free. This process helps reduce fragmentation
-    /// in the buddy system allocator.
+    /// Whether the buddy is free is answered by the free map, and the buddy is unlinked from its
+    /// intrusive free list directly, so each merge step takes constant time regardless of how many
+    /// blocks are free.
     ///
     /// # Arguments
     ///
@@ -137,24 +208,82 @@ impl<const N: usize> Heap<N> {
     /// * `layout` - The memory layout that was used for the allocation. This includes the size
     ///   and alignment of the memory block.
     pub fn dealloc(&mut self, ptr: NonNull<u8>, layout: Layout) {
-        // Calculate the adjusted size, which is the next power of two greater than
-        // the maximum of the layout's size and alignment, and the size of usize.
-        // This ensures the block size is consistent with how it was allocated.
-        let size = layout
-            .size()
-            .next_power_of_two()
-            .max(layout.align().max(size_of::<usize>()));
+        // Calculate the adjusted size, consistent with how the block was allocated.
+        let size = Self::block_size(layout);
 
-        // Determine the class based on the block size. This is where the block will be
-        // returned to in the free list.
-        let class = size.trailing_zeros() as usize;
+        self.user_size -= layout.size();
+        self.allocated -= size;
+
+        // Return the block to the free list of its class, merging it with free buddies.
+        unsafe { self.free_block(ptr.as_ptr() as usize, size.trailing_zeros() as usize) };
+    }
+
+    /// Resizes an allocated block in place, without moving or copying it.
+    ///
+    /// Growing merges the block with its upper buddies one order at a time, which requires the block to be
+    /// aligned to the new block size and every buddy on the way to be free. Shrinking splits the block and
+    /// returns the upper halves to the free lists. The alignment of the allocation is kept.
+    ///
+    /// # Arguments
+    ///
+    /// * `ptr` - A non-null pointer to the allocated block.
+    /// * `layout` - The memory layout that was used for the allocation.
+    /// * `new_size` - The requested new size of the allocation.
+    ///
+    /// # Returns
+    ///
+    /// * `Result<(), ()>` - `Ok` if the block now holds `new_size` bytes at `ptr`, or an error if it
+    ///   cannot grow in place, in which case the block is left unchanged.
+    pub fn realloc(&mut self, ptr: NonNull<u8>, layout: Layout, new_size: usize) -> Result<(), ()> {
+        let new_layout = Layout::from_size_align(new_size, layout.align()).map_err(|_| ())?;
+        let block = ptr.as_ptr() as usize;
+        let old_block_size = Self::block_size(layout);
+        let new_block_size = Self::block_size(new_layout);
+        let old_class = old_block_size.trailing_zeros() as usize;
+        let new_class = new_block_size.trailing_zeros() as usize;
+
+        if new_class >= N {
+            return Err(());
+        }
+
+        if new_class > old_class {
+            // The block can only grow into its upper buddies, so it must be the lower half at every order.
+            if block & (new_block_size - 1) != 0 {
+                return Err(());
+            }
+            if !(old_class..new_class)
+                .all(|class| unsafe { self.is_free(block + (1 << class), class) })
+            {
+                return Err(());
+            }
+
+            for class in old_class..new_class {
+                let buddy = block + (1 << class);
+                unsafe {
+                    self.free_list[class].remove(buddy as *mut Link);
+                    self.free_map.set(self.granule(buddy), false);
+                }
+            }
+        } else {
+            // Return the upper halves to the free lists, largest first, as `alloc` does when splitting.
+            for class in (new_class..old_class).rev() {
+                unsafe { self.push_free(block + (1 << class), class) };
+            }
+        }
 
-        // Add the block back to the appropriate free list, making it available for future allocations.
-        self.free_list[class].push(ptr.as_ptr() as *mut usize);
+        self.user_size = self.user_size - layout.size() + new_size;
+        self.allocated = self.allocated - old_block_size + new_block_size;
 
-        // Attempt to merge the block with its buddy. If the buddy is also free, the two blocks
-        // will be combined into a larger block and moved to a higher size class, reducing fragmentation.
-        self.merge_buddies(ptr.as_ptr() as usize, class);
+        Ok(())
+    }
+
+    // Returns the size of the block used for an allocation with the given layout.
+    fn block_size(layout: Layout) -> usize {
+        layout
+            .size()
+            .next_power_of_two()
+            .max(layout.align())
+            .max(MIN_BLOCK_SIZE)
     }
 
     // Aligns the given address up to the nearest multiple of the alignment
@@ -178,153 +307,67 @@ impl<const N: usize> Heap<N> {
         1 << (size_of_val(&x) * 8 - x.leading_zeros() as usize - 1)
     }
 
-    /// Splits blocks in the free list to achieve a block of the desired size class.
+    /// Frees a block of the given class, merging it with its buddy for as long as the buddy is free.
     ///
-    /// This function iterates through the free list, starting from a larger block size (start_class)
-    /// and progressively splits blocks until it reaches the target size class (target_class).
+    /// The buddy's address is determined by XORing the block's address with the size of the block.
+    /// The merged block is pushed to the free list of the class that was reached.
     ///
     /// # Arguments
     ///
-    /// * `start_class` - The size class from which to start splitting blocks.
-    /// * `target_class` - The target size class we want to achieve through splitting.
-    ///
-    /// # Returns
-    ///
-    /// * `Result<(), ()>` - Returns `Ok(())` if the splitting was successful, or `Err(())` if it failed.
-    fn split_blocks(&mut self, start_class: usize, target_class: usize) -> Result<(), ()> {
-        // Iterate from the larger block size class down to the target block size class.
-        for j in (target_class + 1..=start_class).rev() {
-            // Attempt to pop a block from the current size class.
-            if let Some(block) = self.free_list[j].pop() {
-                // Calculate the size of the smaller block to be created by splitting.
-                let half_block_size = 1 << (j - 1);
-                // Calculate the address of the new block created as a result of the split.
-                let new_block = (block as usize + half_block_size) as *mut usize;
-
-                // Push the two newly created blocks back into the free list of the smaller size class.
-                self.free_list[j - 1].push(new_block);
-                self.free_list[j - 1].push(block);
-            } else {
-                // If no block is available to split, return an error indicating failure.
-                return Err(());
+    /// * `block` - The starting address of the block to be freed.
+    /// * `class` - The size class of the block.
+    unsafe fn free_block(&mut self, mut block: usize, mut class: usize) {
+        // Continue trying to merge until the largest size class is reached.
+        while class < N - 1 {
+            let buddy = block ^ (1 << class);
+
+            // Stop if the buddy is not a free block of the same class.
+            if !self.is_free(buddy, class) {
+                break;
             }
+
+            // Unlink the buddy and continue with the merged block in the next size class.
+            self.free_list[class].remove(buddy as *mut Link);
+            self.free_map.set(self.granule(buddy), false);
+
+            block = min(block, buddy);
+            class += 1;
         }
 
-        // If splitting was successful down to the target class, return Ok.
-        Ok(())
+        self.push_free(block, class);
     }
 
-    /// Allocates a block of memory from a specified size class within the heap.
-    ///
-    /// This function removes a block from the free list of the given size class and updates the heap's allocation statistics.
-    /// It ensures that the memory allocation is reflected in the heap's bookkeeping, tracking both the user-requested size
-    /// and the actual allocated block size.
-    ///
-    /// # Arguments
-    ///
-    /// * `class` - The size class from which to allocate the block.
-    /// * `size` - The actual size of the block being allocated (including any overhead or alignment adjustments).
-    /// * `user_size` - The size requested by the user, which may be smaller than the `size` due to alignment and metadata.
-    ///
-    /// # Returns
-    ///
-    /// * `Result<NonNull<u8>, ()>` - Returns a pointer to the allocated block on success, or an error if allocation fails.
-    fn allocate_from_class(
-        &mut self,
-        class: usize,
-        size: usize,
-        user_size: usize,
-    ) -> Result<NonNull<u8>, ()> {
-        // Attempt to pop a block from the specified size class's free list.
-        let block = self.free_list[class]
-            .pop()
-            .expect("Block should be available");
-
-        // Attempt to create a NonNull pointer from the block address.
-        let result = NonNull::new(block as *mut u8);
-
-        // If the NonNull pointer is successfully created, update the heap's allocation statistics.
-        if let Some(non_null) = result {
-            // Update the total user-allocated size.
-            self.user_size += user_size;
-            // Update the total size allocated by the heap (including overhead).
-            self.allocated += size;
-            // Return the pointer to the allocated block.
-            Ok(non_null)
-        } else {
-            // If creating the NonNull pointer failed, return an error.
-            Err(())
+    // Returns whether a free block of the given class starts at `block`.
+    unsafe fn is_free(&self, block: usize, class: usize) -> bool {
+        if block < self.base || block + (1 << class) > self.base + self.span {
+            return false;
         }
+
+        self.free_map.get(self.granule(block)) && (*(block as *const FreeBlock)).class == class
     }
 
-    /// Attempts to merge a freed block with its buddy block.
-    ///
-    /// This function is called during deallocation to try and merge the freed block with its corresponding buddy block.
-    /// If the buddy block is also free, the two blocks are merged into a larger block and moved to the next size class.
-    /// This process is repeated recursively until no more merges are possible or the largest size class is reached.
-    ///
-    /// # Arguments
-    ///
-    /// * `current_ptr` - The starting address of the current block to be merged.
-    /// * `current_class` - The size class of the current block.
-    fn merge_buddies(&mut self, mut current_ptr: usize, mut current_class: usize) {
-        // Continue trying to merge until the largest size class is reached.
-        while current_class < self.free_list.len() - 1 {
-            // Calculate the address of the buddy block.
-            // The buddy's address is determined by XORing the current block's address with the size of the block.
-            let buddy = current_ptr ^ (1 << current_class);
-
-            // Check if the buddy block is free and can be merged.
-            if self.find_buddy(current_class, buddy) {
-                // If the buddy is found, remove it from the current size class's free list.
-                self.free_list[current_class].pop();
-
-                // Determine the starting address of the merged block (which is the minimum of the two buddies' addresses).
-                current_ptr = min(current_ptr, buddy);
-
-                // Move to the next size class as the blocks are merged into a larger block.
-                current_class += 1;
-
-                // Add the merged block to the free list of the next size class.
-                self.free_list[current_class].push(current_ptr as *mut usize);
-            } else {
-                // If the buddy is not free, stop trying to merge.
-                break;
-            }
-        }
+    // Pushes a block to the free list of its class and marks it as free.
+    unsafe fn push_free(&mut self, block: usize, class: usize) {
+        let header = block as *mut FreeBlock;
+        (*header).class = class;
+        self.free_list[class].push(header as *mut Link);
+        self.free_map.set(self.granule(block), true);
     }
 
-    /// Checks if the buddy of a block is free and removes it from the free list if it is.
-    ///
-    /// This function iterates over the free list of a given size class to find the buddy block. If the buddy is found,
-    /// it is removed from the free list, indicating that it is available for merging.
-    ///
-    /// # Arguments
-    ///
-    /// * `class` - The size class of the block for which the buddy is being searched.
-    /// * `buddy` - The address of the buddy block to find.
-    ///
-    /// # Returns
-    ///
-    /// * `bool` - Returns `true` if the buddy block was found and removed from the free list; otherwise, `false`.
-    fn find_buddy(&mut self, class: usize, buddy: usize) -> bool {
-        // Assume the buddy is not found initially.
-        let mut found_buddy = false;
-
-        // Iterate over the blocks in the free list of the given size class.
-        for block in self.free_list[class].iter_mut() {
-            // Check if the current block is the buddy we're looking for.
-            if block.value() as usize == buddy {
-                // If so, remove the buddy from the free list.
-                block.pop();
-                // Mark that we've found the buddy.
-                found_buddy = true;
-                // Exit the loop since we've found what we were looking for.
-                break;
-            }
-        }
+    // Pops a block from the free list of a class and marks it as allocated.
+    unsafe fn take_block(&mut self, class: usize) -> usize {
+        let block = self.free_list[class]
+            .pop()
+            .expect("Block should be available") as usize;
+        self.free_map.set(self.granule(block), false);
+        block
+    }
 
-        // Return whether the buddy was found (and thus removed from the free list).
-        found_buddy
+    // Returns the free map bit of the granule starting at `address`.
+    fn granule(&self, address: usize) -> usize {
+        (address - self.base) / MIN_BLOCK_SIZE
     }
 }
+
+// A free block header must fit into the smallest block.
+const _: () = assert!(size_of::<FreeBlock>() <= MIN_BLOCK_SIZE);
@@ -0,0 +1,330 @@
+use super::{arena::ARENA_SPAN, HEAP_FAULT_LOCK};
+use crate::{
+    cpu::percpu::MAX_CPUS,
+    memory::{
+        self,
+        addr::{PhysAddr, VirtAddr},
+        bitmap::Bitmap,
+        buddy_frame_allocator::BuddyFrameAllocator,
+        paging::{
+            page_table_manager::PageTableManager,
+            table::{PageEntryFlags, PageTable},
+            tlb::TlbBatch,
+            PAGE_TABLE_MANAGER,
+        },
+        HEAP_START, PAGE_SIZE,
+    },
+    sync::mutex::SpinMutex,
+};
+use core::{alloc::Layout, ptr};
+
+/// Allocations larger than this bypass the arenas and get whole pages of their own.
+pub const LARGE_THRESHOLD: usize = 2 * PAGE_SIZE;
+
+/// The start of the virtual range for large allocations, right after the arenas.
+pub const LARGE_START: VirtAddr = VirtAddr(HEAP_START.0 + MAX_CPUS * ARENA_SPAN);
+
+// The large range is split into one region per slot order: region `i` holds naturally aligned slots
+// of 2^(MIN_ORDER + i) pages. Only the pages an allocation actually uses are mapped, so the rounding
+// to a slot costs virtual address space but no memory.
+const REGION_SPAN: usize = 1 << 32; // 4 GB
+const MIN_ORDER: usize = 2; // 16 KB, the smallest slot that holds an allocation above the threshold
+const MAX_ORDER: usize = 20; // 4 GB, a single slot per region
+const REGIONS: usize = MAX_ORDER - MIN_ORDER + 1;
+
+// The number of pages unmapped per TLB shootdown when an allocation shrinks or is freed.
+const FREE_BATCH: usize = 64;
+
+/// The slots of one region, with one bit per slot that is set while the slot is in use.
+/// The bitmap is allocated from the frame allocator when the region is first used.
+struct SlotMap {
+    used: Bitmap,
+    hint: usize, // The slot after the one handed out last, where the next search starts
+    ready: bool,
+}
+
+static mut SLOT_MAPS: SpinMutex<[SlotMap; REGIONS]> = SpinMutex::new(
+    [const {
+        SlotMap {
+            used: Bitmap::new(ptr::null_mut(), 0),
+            hint: 0,
+            ready: false,
+        }
+    }; REGIONS],
+);
+
+/// Returns whether an allocation with the given layout takes the large-object path.
+pub fn is_large(layout: Layout) -> bool {
+    layout.size() > LARGE_THRESHOLD
+}
+
+/// Allocates exactly as many pages as `layout` needs and maps them into a free slot of the large range.
+///
+/// # Safety
+///
+/// Must be called with interrupts disabled, after the buddy frame allocator and the kernel page table are initialized.
+///
+/// # Returns
+///
+/// A pointer to the allocation, or a null pointer if the large range has no slot for it or physical
+/// memory is exhausted.
+pub unsafe fn alloc(layout: Layout) -> *mut u8 {
+    let Some(order) = slot_order(layout.size(), layout.align()) else {
+        return ptr::null_mut();
+    };
+    let Some(start) = take_slot(order) else {
+        return ptr::null_mut();
+    };
+
+    if !map_pages(start, 0, pages(layout.size())) {
+        release_slot(start);
+        return ptr::null_mut();
+    }
+    start as *mut u8
+}
+
+/// Unmaps a large allocation, returns its frames to the frame allocator and releases its slot.
+///
+/// # Safety
+///
+/// Must be called with interrupts disabled; `ptr` must have been returned by `alloc` or `realloc`
+/// with the same `layout`, and must not be used afterwards.
+pub unsafe fn dealloc(ptr: *mut u8, layout: Layout) {
+    let start = ptr as usize;
+    unmap_pages(start, 0, pages(layout.size()));
+    release_slot(start);
+}
+
+/// Resizes a large allocation to another large size without copying its contents.
+///
+/// Within the slot of the allocation, growing maps the following pages and shrinking unmaps the
+/// tail, so the pointer stays the same. An allocation that outgrows its slot is moved to a larger one
+/// by remapping its frames at the new address.
+///
+/// # Safety
+///
+/// Same as `dealloc`. `new_size` must be above `LARGE_THRESHOLD`.
+///
+/// # Returns
+///
+/// A pointer to the resized allocation, or a null pointer if no larger slot is free or physical memory
+/// is exhausted, in which case the allocation is left unchanged.
+pub unsafe fn realloc(ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+    let start = ptr as usize;
+    let (old_pages, new_pages) = (pages(layout.size()), pages(new_size));
+
+    if new_pages <= 1 << slot_of(start).0 {
+        if new_pages > old_pages {
+            if !map_pages(start, old_pages, new_pages) {
+                return ptr::null_mut();
+            }
+        } else if new_pages < old_pages {
+            unmap_pages(start, new_pages, old_pages);
+        }
+        return ptr;
+    }
+
+    let Some(order) = slot_order(new_size, layout.align()) else {
+        return ptr::null_mut();
+    };
+    let Some(new_start) = take_slot(order) else {
+        return ptr::null_mut();
+    };
+
+    // Back the grown part first, so that running out of memory leaves the old allocation untouched.
+    if !map_pages(new_start, old_pages, new_pages) {
+        release_slot(new_start);
+        return ptr::null_mut();
+    }
+    move_pages(start, new_start, old_pages);
+    release_slot(start);
+
+    new_start as *mut u8
+}
+
+// Returns the number of pages needed for `size` bytes.
+fn pages(size: usize) -> usize {
+    (size + PAGE_SIZE - 1) / PAGE_SIZE
+}
+
+// Returns the order of the smallest slot that holds `size` bytes at the given alignment,
+// or `None` if the allocation does not fit into the largest slot.
+fn slot_order(size: usize, align: usize) -> Option<usize> {
+    let order = BuddyFrameAllocator::order_for(pages(size).max(align / PAGE_SIZE)).max(MIN_ORDER);
+    if order <= MAX_ORDER {
+        Some(order)
+    } else {
+        None
+    }
+}
+
+// Returns the order and index of the slot that starts at `start`.
+fn slot_of(start: usize) -> (usize, usize) {
+    let offset = start - LARGE_START.0;
+    let order = MIN_ORDER + offset / REGION_SPAN;
+    (order, offset % REGION_SPAN / (PAGE_SIZE << order))
+}
+
+// Takes a free slot of the given order and returns its start address.
+unsafe fn take_slot(order: usize) -> Option<usize> {
+    let mut maps = SLOT_MAPS.lock();
+    let map = &mut maps[order - MIN_ORDER];
+
+    if !map.ready {
+        let slots = REGION_SPAN / (PAGE_SIZE << order);
+        let storage_pages = pages(Bitmap::storage_size(slots));
+        let storage = memory::alloc_frames(BuddyFrameAllocator::order_for(storage_pages))?;
+
+        map.used = Bitmap::new(storage.as_mut_ptr(), slots);
+        map.used.clear();
+        map.ready = true;
+    }
+
+    let index = map
+        .used
+        .find_first_zero(map.hint)
+        .or_else(|| map.used.find_first_zero(0))?;
+    map.used.set(index, true);
+    map.hint = index + 1;
+
+    Some(LARGE_START.0 + (order - MIN_ORDER) * REGION_SPAN + index * (PAGE_SIZE << order))
+}
+
+// Returns a slot to its region.
+unsafe fn release_slot(start: usize) {
+    let (order, index) = slot_of(start);
+    SLOT_MAPS.lock()[order - MIN_ORDER].used.set(index, false);
+}
+
+// Backs the pages `from..to` of the allocation at `start` with new frames.
+// Frames that happen to be physically contiguous are mapped together by `map_range_4k`.
+// Returns `false`, with none of the pages mapped, if physical memory runs out.
+unsafe fn map_pages(start: usize, from: usize, to: usize) -> bool {
+    let mut frame_alloc = || {
+        memory::alloc_frames(0)
+            .expect("Out of physical memory")
+            .as_mut_ptr()
+    };
+    // The pages are not mapped yet, so nothing is recorded to invalidate.
+    let mut tlb = TlbBatch::kernel();
+
+    // The pages mapped so far, and the run of contiguous frames allocated after them.
+    let mut mapped = from;
+    let (mut run_start, mut run_len) = (PhysAddr(0), 0);
+    let complete = {
+        // The large range shares its page tables with the arenas, which the page fault handler extends.
+        let _guard = HEAP_FAULT_LOCK.lock();
+        let kernel = PAGE_TABLE_MANAGER.as_mut().unwrap();
+
+        loop {
+            let frame = match mapped + run_len < to {
+                true => memory::alloc_frames(0),
+                false => None,
+            };
+            if let Some(frame) = frame {
+                if run_len > 0 && frame.0 == run_start.0 + run_len * PAGE_SIZE {
+                    run_len += 1;
+                    continue;
+                }
+            }
+
+            if run_len > 0 {
+                let virt = start + mapped * PAGE_SIZE;
+                map_run(kernel, virt, run_start, run_len, &mut frame_alloc, &mut tlb);
+                mapped += run_len;
+            }
+            match frame {
+                Some(frame) => (run_start, run_len) = (frame, 1),
+                None => break mapped == to,
+            }
+        }
+    };
+
+    if !complete {
+        unmap_pages(start, from, mapped);
+    }
+    complete
+}
+
+// Maps `pages` physically contiguous frames starting at `phys` to the kernel memory at `virt`.
+// Only 4 KiB pages are used, so that shrinking or freeing an allocation in batches never has to split
+// a huge page.
+unsafe fn map_run<F: FnMut() -> *mut PageTable>(
+    kernel: &mut PageTableManager,
+    virt: usize,
+    phys: PhysAddr,
+    pages: usize,
+    frame_alloc: &mut F,
+    tlb: &mut TlbBatch,
+) {
+    kernel.map_range_4k(
+        VirtAddr(virt),
+        phys,
+        pages * PAGE_SIZE,
+        PageEntryFlags::WRITABLE,
+        frame_alloc,
+        tlb,
+    );
+}
+
+// Unmaps the pages `from..to` of the allocation at `start` and frees their frames.
+unsafe fn unmap_pages(start: usize, from: usize, to: usize) {
+    let mut page = from;
+
+    while page < to {
+        let count = (to - page).min(FREE_BATCH);
+        let virt = VirtAddr(start + page * PAGE_SIZE);
+        let mut frames = [PhysAddr(0); FREE_BATCH];
+        let mut tlb = TlbBatch::kernel();
+
+        {
+            let _guard = HEAP_FAULT_LOCK.lock();
+            let kernel = PAGE_TABLE_MANAGER.as_mut().unwrap();
+            for (i, frame) in frames[..count].iter_mut().enumerate() {
+                *frame = kernel.phys_addr(virt + i * PAGE_SIZE);
+            }
+            kernel.unmap_range(virt, count * PAGE_SIZE, &mut tlb);
+        }
+
+        // Shoot down outside the lock, since a CPU spinning on it in the page fault handler cannot
+        // answer the IPI. The frames are only reused once no CPU can reach them anymore.
+        tlb.flush();
+        for frame in &frames[..count] {
+            memory::free_frames(*frame, 0);
+        }
+
+        page += count;
+    }
+}
+
+// Moves the frames of the first `pages` pages of the allocation at `from` to the slot at `to`.
+unsafe fn move_pages(from: usize, to: usize, pages: usize) {
+    let mut frame_alloc = || {
+        memory::alloc_frames(0)
+            .expect("Out of physical memory")
+            .as_mut_ptr()
+    };
+    let mut tlb = TlbBatch::kernel();
+
+    {
+        let _guard = HEAP_FAULT_LOCK.lock();
+        let kernel = PAGE_TABLE_MANAGER.as_mut().unwrap();
+
+        // Remap runs of physically contiguous frames together.
+        let mut page = 0;
+        while page < pages {
+            let phys = |page: usize| kernel.phys_addr(VirtAddr(from + page * PAGE_SIZE));
+            let first = phys(page);
+            let mut len = 1;
+            while page + len < pages && phys(page + len).0 == first.0 + len * PAGE_SIZE {
+                len += 1;
+            }
+            let virt = to + page * PAGE_SIZE;
+            map_run(kernel, virt, first, len, &mut frame_alloc, &mut tlb);
+            page += len;
+        }
+        kernel.unmap_range(VirtAddr(from), pages * PAGE_SIZE, &mut tlb);
+    }
+
+    tlb.flush();
+}
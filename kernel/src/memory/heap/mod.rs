@@ -1,68 +1,89 @@
-use self::heap::Heap;
-use super::{
-    addr::{PhysAddr, VirtAddr},
-    paging::{table::PageTable, PAGE_TABLE_MANAGER},
-    physical_page_allocator::PhysicalPageAllocator,
-    region::Region,
-    PAGE_SIZE,
+use self::{arena::ARENA_SPAN, heap::Heap};
+use super::{addr::VirtAddr, paging::PAGE_TABLE_MANAGER, region::Region, HEAP_START, PAGE_SIZE};
+use crate::{
+    cpu::percpu::MAX_CPUS,
+    memory::{self, addr::ToPhysAddr, zero_pool},
+    sync::mutex::SpinMutex,
 };
-use crate::{memory::addr::ToPhysAddr, println};
+use core::ptr::null_mut;
 
+pub mod arena;
+#[cfg(feature = "benchmarks")]
+pub mod benchmark;
 pub mod heap;
+pub mod large;
+pub mod slab;
 
-/// Initializes the heap by allocating and mapping a specified number of pages.
+// Serializes demand paging of the heap range.
+static HEAP_FAULT_LOCK: SpinMutex<()> = SpinMutex::new(());
+
+/// Initializes a heap over a reserved range of virtual memory without mapping any of it.
 ///
-/// This function allocates physical pages and maps them to virtual addresses,
-/// starting from `start_addr`, to create a heap region. It then adds this region
-/// to the heap manager for future allocations.
+/// The range is backed on demand: the first access to each page raises a page fault, and
+/// `handle_page_fault` maps a zeroed frame there. Since unbacked memory reads as zero, the heap
+/// does not clear its free map, so only the pages that hold block headers are backed at boot.
 ///
 /// # Safety
 ///
-/// This function is unsafe because it directly manipulates memory and relies on
-/// the caller to ensure that the `start_addr` and `page_frame_allocator` are valid
-/// and that the memory region is not already in use or reserved.
+/// The caller must ensure that the virtual range starting at `start_addr` lies within the heap range,
+/// is not in use, and that the buddy frame allocator is initialized, since page faults take frames from it.
 ///
 /// # Parameters
 ///
 /// - `start_addr`: The starting virtual address where the heap region will begin.
-/// - `pages`: The number of pages to allocate and map for the heap.
-/// - `page_frame_allocator`: A mutable reference to the physical page allocator.
-pub unsafe fn init(
-    start_addr: VirtAddr,
-    pages: usize,
-    page_frame_allocator: &mut PhysicalPageAllocator,
-) -> Heap<32> {
-    // Calculate the total size of the region to be allocated for the heap
-    let region_size = pages * PAGE_SIZE;
-    // Map the allocated pages to the starting virtual address
-    map_pages(start_addr, pages, page_frame_allocator);
-    // Create a new region representing the heap space
-    let region = Region::new(start_addr.to_phys_addr(), region_size);
-
-    // Initialize the heap manager and add the region to it
+/// - `size`: The size of the virtual range reserved for the heap.
+pub unsafe fn init(start_addr: VirtAddr, size: usize) -> Heap<32> {
     let mut heap: Heap<32> = Heap::new();
-    heap.add_region(region);
-
-    println!("Heap initialized");
+    heap.add_zeroed_region(Region::new(start_addr.to_phys_addr(), size));
 
     heap
 }
 
-// Maps the allocated pages to the starting virtual address.
-unsafe fn map_pages(
-    mut start_addr: VirtAddr,
-    pages: usize,
-    page_frame_allocator: &mut PhysicalPageAllocator,
-) {
-    let mut frame_alloc = || page_frame_allocator.alloc_page().unwrap().0 as *mut PageTable;
-    for _ in 0..pages {
-        let page = frame_alloc();
-        PAGE_TABLE_MANAGER.as_mut().unwrap().map_memory(
-            start_addr,
-            PhysAddr(page as usize),
-            &mut frame_alloc,
-            true,
-        );
-        start_addr += PAGE_SIZE;
+/// Returns whether `addr` lies in the virtual range reserved for the heap arenas.
+pub fn is_heap_addr(addr: VirtAddr) -> bool {
+    addr.0 >= HEAP_START.0 && addr.0 < HEAP_START.0 + MAX_CPUS * ARENA_SPAN
+}
+
+/// Backs the page containing a faulting heap address with a zeroed frame (demand-zero paging).
+///
+/// The frame is mapped into the kernel page table, whose heap tables are shared by every address space.
+/// The page is mapped for supervisor access only, so user code cannot reach the kernel heap.
+///
+/// # Safety
+///
+/// Must only be called from the page fault handler, for a fault on a page that is not present.
+///
+/// # Returns
+///
+/// `true` if the fault was resolved, or `false` if the address is not a heap address or physical memory
+/// is exhausted, either for the page itself or for a page table that maps it.
+pub unsafe fn handle_page_fault(addr: VirtAddr) -> bool {
+    if !is_heap_addr(addr) {
+        return false;
+    }
+
+    let page = VirtAddr(addr.0 & !(PAGE_SIZE - 1));
+    let mut frame_alloc = || match memory::alloc_frames(0) {
+        Some(frame) => frame.as_mut_ptr(),
+        None => null_mut(),
+    };
+
+    // Serialize faults from different CPUs, which may hit the same page or page table.
+    let _guard = HEAP_FAULT_LOCK.lock();
+
+    // Another CPU may have backed the page while this one waited for the lock.
+    let kernel = PAGE_TABLE_MANAGER.as_mut().unwrap();
+    if kernel.translate(page).is_some() {
+        return true;
+    }
+
+    let Some(frame) = zero_pool::alloc_zeroed_frame() else {
+        return false;
+    };
+    if !kernel.map_memory(page, frame, &mut frame_alloc, false) {
+        memory::free_frames(frame, 0);
+        return false;
     }
+
+    true
 }
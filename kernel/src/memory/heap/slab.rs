@@ -0,0 +1,216 @@
+use super::heap::Heap;
+use crate::{
+    data_types::intrusive_list::{IntrusiveList, Link},
+    memory::PAGE_SIZE,
+};
+use core::{alloc::Layout, ptr, ptr::NonNull};
+
+/// The object sizes served by the slab allocator. Larger requests go straight to the buddy heap.
+pub const SLAB_SIZE_CLASSES: [usize; 11] = [16, 32, 48, 64, 96, 128, 192, 256, 512, 1024, 2048];
+
+// The space reserved for the slab header at the start of every slab (one cache line).
+const SLAB_HEADER_SIZE: usize = 64;
+
+// Classes up to this size use single-page slabs; larger classes use `LARGE_SLAB_SIZE` slabs,
+// so that the header does not cost half of a page.
+const SMALL_SLAB_LIMIT: usize = 256;
+const LARGE_SLAB_SIZE: usize = 4 * PAGE_SIZE;
+
+/// Per-class slab counters.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SlabStats {
+    pub allocations: u64, // Objects handed out
+    pub frees: u64,       // Objects returned
+    pub active: usize,    // Objects currently in use
+    pub slabs: usize,     // Slabs currently owned by the class
+}
+
+/// The header at the start of every slab.
+///
+/// The intrusive link must stay the first field: a slab is found from its `Link` by a plain cast.
+#[repr(C)]
+struct SlabHeader {
+    link: Link,
+    free: *mut usize, // Singly-linked list of free objects, threaded through the objects themselves
+    in_use: usize,    // Number of allocated objects
+}
+
+/// The slabs and statistics of one size class.
+///
+/// Fields:
+/// - partial: The slabs that have at least one free object. Full slabs are on no list and are
+///   linked back in when one of their objects is freed.
+/// - partial_count: The number of slabs on the partial list.
+/// - stats: The counters reported by `SlabAllocator::stats`.
+#[derive(Clone, Copy)]
+struct SlabCache {
+    partial: IntrusiveList,
+    partial_count: usize,
+    stats: SlabStats,
+}
+
+/// SlabAllocator serves small allocations from slabs carved out of the buddy heap.
+///
+/// Each size class owns a set of slabs: naturally aligned heap blocks that start with a `SlabHeader`
+/// followed by equally sized objects. Objects are packed at their class size instead of the next power
+/// of two, and both allocation and free are O(1): the header of an object's slab is found by masking
+/// the object address with the slab size, so freeing needs no search.
+///
+/// An empty slab is kept as long as it is the only partial slab of its class, so that an alloc/free
+/// pattern around a slab boundary does not repeatedly go back to the heap.
+pub struct SlabAllocator {
+    caches: [SlabCache; SLAB_SIZE_CLASSES.len()],
+}
+
+impl SlabAllocator {
+    pub const fn new() -> SlabAllocator {
+        SlabAllocator {
+            caches: [SlabCache {
+                partial: IntrusiveList::new(),
+                partial_count: 0,
+                stats: SlabStats {
+                    allocations: 0,
+                    frees: 0,
+                    active: 0,
+                    slabs: 0,
+                },
+            }; SLAB_SIZE_CLASSES.len()],
+        }
+    }
+
+    /// Returns the size class that serves `layout`, or `None` if the allocation is too large for a slab.
+    ///
+    /// A class can serve a layout if its objects are large enough and are aligned at least as strictly as requested.
+    pub fn class_for(layout: Layout) -> Option<usize> {
+        SLAB_SIZE_CLASSES
+            .iter()
+            .position(|&size| size >= layout.size() && Self::object_align(size) >= layout.align())
+    }
+
+    /// Allocates an object of the given size class, taking a new slab from `heap` if the class has no free object.
+    ///
+    /// # Returns
+    ///
+    /// A pointer to the object, or an error if the heap cannot provide a new slab.
+    pub fn alloc(&mut self, class: usize, heap: &mut Heap<32>) -> Result<NonNull<u8>, ()> {
+        let slab = match self.caches[class].partial.front() {
+            Some(link) => link as *mut SlabHeader,
+            None => unsafe { self.new_slab(class, heap)? },
+        };
+
+        let cache = &mut self.caches[class];
+        unsafe {
+            let object = (*slab).free;
+            (*slab).free = *object as *mut usize;
+            (*slab).in_use += 1;
+
+            // A slab without free objects leaves the partial list until one of its objects is freed.
+            if (*slab).free.is_null() {
+                cache.partial.remove(slab as *mut Link);
+                cache.partial_count -= 1;
+            }
+
+            cache.stats.allocations += 1;
+            cache.stats.active += 1;
+            NonNull::new(object as *mut u8).ok_or(())
+        }
+    }
+
+    /// Returns an object to its slab, handing the slab back to `heap` once it is empty.
+    ///
+    /// # Safety
+    ///
+    /// `ptr` must have been returned by `alloc` for the same `class` and must not be used afterwards.
+    pub unsafe fn dealloc(&mut self, ptr: NonNull<u8>, class: usize, heap: &mut Heap<32>) {
+        let slab_size = Self::slab_size(SLAB_SIZE_CLASSES[class]);
+        let slab = (ptr.as_ptr() as usize & !(slab_size - 1)) as *mut SlabHeader;
+        let cache = &mut self.caches[class];
+
+        let object = ptr.as_ptr() as *mut usize;
+        let was_full = (*slab).free.is_null();
+        *object = (*slab).free as usize;
+        (*slab).free = object;
+        (*slab).in_use -= 1;
+
+        cache.stats.frees += 1;
+        cache.stats.active -= 1;
+
+        if was_full {
+            cache.partial.push(slab as *mut Link);
+            cache.partial_count += 1;
+        }
+
+        // Release an empty slab unless it is the last partial slab of the class.
+        if (*slab).in_use == 0 && cache.partial_count > 1 {
+            cache.partial.remove(slab as *mut Link);
+            cache.partial_count -= 1;
+            cache.stats.slabs -= 1;
+            heap.dealloc(
+                NonNull::new_unchecked(slab as *mut u8),
+                Self::slab_layout(slab_size),
+            );
+        }
+    }
+
+    /// Returns the counters of a size class.
+    pub fn stats(&self, class: usize) -> SlabStats {
+        self.caches[class].stats
+    }
+
+    // Takes a slab from the heap, builds its free list and adds it to the partial list of the class.
+    unsafe fn new_slab(
+        &mut self,
+        class: usize,
+        heap: &mut Heap<32>,
+    ) -> Result<*mut SlabHeader, ()> {
+        let size = SLAB_SIZE_CLASSES[class];
+        let slab_size = Self::slab_size(size);
+        let slab = heap.alloc(Self::slab_layout(slab_size))?.as_ptr() as *mut SlabHeader;
+
+        // Thread the free list through the objects, lowest address first.
+        let first = Self::first_object(size);
+        let mut free = ptr::null_mut::<usize>();
+        let mut offset = first + (slab_size - first) / size * size;
+        while offset > first {
+            offset -= size;
+            let object = (slab as usize + offset) as *mut usize;
+            *object = free as usize;
+            free = object;
+        }
+
+        // The link is initialized when the slab is pushed to the partial list.
+        (*slab).free = free;
+        (*slab).in_use = 0;
+
+        let cache = &mut self.caches[class];
+        cache.partial.push(slab as *mut Link);
+        cache.partial_count += 1;
+        cache.stats.slabs += 1;
+
+        Ok(slab)
+    }
+
+    // Returns the alignment every object of a class is guaranteed to have: the largest power of two
+    // dividing the object size, since the first object is placed at a multiple of it.
+    fn object_align(size: usize) -> usize {
+        1 << size.trailing_zeros()
+    }
+
+    // Returns the offset of the first object in a slab, past the header and aligned to the object alignment.
+    fn first_object(size: usize) -> usize {
+        SLAB_HEADER_SIZE.max(Self::object_align(size))
+    }
+
+    fn slab_size(size: usize) -> usize {
+        if size <= SMALL_SLAB_LIMIT {
+            PAGE_SIZE
+        } else {
+            LARGE_SLAB_SIZE
+        }
+    }
+
+    // Slabs are naturally aligned buddy blocks, which lets `dealloc` find the header by masking.
+    fn slab_layout(slab_size: usize) -> Layout {
+        Layout::from_size_align(slab_size, slab_size).unwrap()
+    }
+}
@@ -1,34 +1,52 @@
 use self::{
     addr::{PhysAddr, VirtAddr},
+    buddy_frame_allocator::BuddyFrameAllocator,
     memory_descriptor::EFIMemoryDescriptor,
+    page_frame::FrameFlags,
     physical_page_allocator::PhysicalPageAllocator,
     region::Region,
 };
-use crate::{println, structures::BootInfo, ALLOCATOR};
+use crate::{
+    cpu::percpu::MAX_CPUS, interrupts::without_interrupts, memory::heap::arena::ARENA_SPAN,
+    println, structures::BootInfo, sync::mutex::SpinMutex, ALLOCATOR,
+};
 use alloc::boxed::Box;
 use paging::{page_table_manager::PageTableManager, table::PageTable};
 
 pub(crate) mod addr;
 pub(crate) mod bitmap;
+pub(crate) mod buddy_frame_allocator;
+pub(crate) mod dma;
+pub(crate) mod frame_cache;
 pub(crate) mod global_allocator;
 pub(crate) mod heap;
 pub(crate) mod memory_descriptor;
+pub(crate) mod page_frame;
 pub(crate) mod paging;
 pub(crate) mod physical_page_allocator;
 pub(crate) mod region;
+pub(crate) mod zero_pool;
 
 pub const PAGE_SIZE: usize = 4096; // 4 KB
 pub const KERNEL_PHYS_START: PhysAddr = PhysAddr(0x100000); // 1 MB
 pub const HEAP_START: VirtAddr = VirtAddr(0x0000100000000000); // 1 TB
-pub const HEAP_PAGES: usize = 1024 * 16; // 64 MB
 
-pub static mut PAGE_FRAME_ALLOCATOR: Option<PhysicalPageAllocator> = None;
+/// The start of the direct physical map: all physical memory, mapped at this fixed offset with huge pages
+/// (PML4 slot 256 onwards). A physical address is translated to and from it by a single add.
+///
+/// Once `paging::init` has loaded it, `PhysAddr::as_mut_ptr` returns addresses in it, so page tables, frames
+/// from the frame allocators, DMA buffers and thread stacks are all reached through it. The low identity map
+/// stays for the kernel image, the firmware's tables and device registers.
+pub const PHYS_MAP_START: VirtAddr = VirtAddr(0xFFFF_8000_0000_0000);
+
+pub static mut PAGE_FRAME_ALLOCATOR: SpinMutex<Option<BuddyFrameAllocator>> = SpinMutex::new(None);
 
 /// Initializes the system's memory management unit, setting up the allocator and paging.
 ///
 /// This function sets up the physical page frame allocator, reads the EFI memory map,
-/// locks the memory pages used by the kernel, initializes paging, and sets up the heap
-/// for dynamic memory allocation. After setting up the heap, it initializes the global allocator
+/// locks the memory pages used by the kernel, initializes paging, and hands all remaining
+/// free memory over to the buddy frame allocator. It then reserves the heap, whose pages are
+/// taken from the buddy frame allocator on first access, and initializes the global allocator
 /// which allows for dynamic memory allocation throughout the system.
 ///
 /// # Safety
@@ -56,21 +74,44 @@ pub unsafe fn init(boot_info: &'static crate::structures::BootInfo) {
     // Lock the memory pages occupied by the kernel to prevent their use by other processes.
     page_frame_allocator.lock_pages(KERNEL_PHYS_START, kernel_pages);
 
+    // Keep the page the application processors start in free of other data.
+    page_frame_allocator.lock_pages(crate::cpu::smp::AP_TRAMPOLINE_ADDR, 1);
+
     // Initialize paging, setting up the necessary page tables and entries.
     paging::init(boot_info, &mut page_frame_allocator);
 
-    // Initialize the heap by allocating and mapping a specified number of pages.
-    let heap = heap::init(HEAP_START, HEAP_PAGES, &mut page_frame_allocator);
+    // Allocate the per-frame metadata, and mark the kernel image's frames as pinned kernel memory.
+    page_frame::init(boot_info, &mut page_frame_allocator);
+    page_frame::mark_range(
+        KERNEL_PHYS_START,
+        kernel_pages,
+        FrameFlags::KERNEL | FrameFlags::PINNED,
+    );
+
+    // Move the remaining free memory from the boot-time bitmap allocator to the buddy frame allocator,
+    // and store it in a global static variable for future use.
+    let mut buddy_allocator = BuddyFrameAllocator::new();
+    buddy_allocator.init(boot_info, &mut page_frame_allocator);
+    *PAGE_FRAME_ALLOCATOR.lock() = Some(buddy_allocator);
+
+    // Reserve the heap of the bootstrap processor's arena. Its pages are backed on demand by the
+    // page fault handler, which takes frames from the buddy frame allocator.
+    let heap = heap::init(HEAP_START, ARENA_SPAN);
+    println!(
+        "Heap initialized: {} MB reserved",
+        ARENA_SPAN / (1024 * 1024)
+    );
 
     // Initialize the global allocator with the heap to enable dynamic memory allocations.
     ALLOCATOR.init(heap);
 
-    // Store the physical page frame allocator in a global static variable for future use.
-    PAGE_FRAME_ALLOCATOR = Some(page_frame_allocator);
-
     // Optionally test heap allocation and modification to verify the allocator's functionality.
     test_heap_allocation();
 
+    // Report the heap's dealloc latency for growing free lists.
+    #[cfg(feature = "benchmarks")]
+    heap::benchmark::benchmark_dealloc();
+
     println!("Memory initialized");
 }
 
@@ -140,9 +181,90 @@ fn test_heap_allocation() {
     println!("Heap value: {}", *v);
 }
 
+/// Allocates a block of 2^order physically contiguous frames, reached through the direct physical map.
+///
+/// Single frames are served from the executing CPU's magazine without taking the global lock;
+/// larger blocks go straight to the buddy frame allocator. The global lock is only held with interrupts
+/// disabled, since a heap page fault taken while holding it would refill a magazine under the same lock.
+/// The first frame of the block starts with one reference in the page frame database.
+pub fn alloc_frames(order: usize) -> Option<PhysAddr> {
+    let block = unsafe {
+        if order == 0 {
+            frame_cache::alloc_frame(&PAGE_FRAME_ALLOCATOR)?
+        } else {
+            without_interrupts(|| PAGE_FRAME_ALLOCATOR.lock().as_mut()?.alloc(order))?
+        }
+    };
+
+    if let Some(frame) = page_frame::frame(block) {
+        frame.reset_allocated();
+    }
+    Some(block)
+}
+
+/// Returns a block obtained from `alloc_frames` to the frame allocator.
+///
+/// # Safety
+///
+/// The block must have been allocated with the same `order` and must no longer be in use.
+pub unsafe fn free_frames(addr: PhysAddr, order: usize) {
+    if let Some(frame) = page_frame::frame(addr) {
+        debug_assert_eq!(frame.refcount(), 1, "Frame freed twice");
+        // DMA blocks are flagged on every frame, not only on the first one.
+        if order > 0 && frame.flags().contains(FrameFlags::DMA) {
+            page_frame::clear_range(addr, 1 << order, FrameFlags::DMA);
+        }
+        frame.reset_free();
+    }
+
+    if order == 0 {
+        frame_cache::free_frame(addr, &PAGE_FRAME_ALLOCATOR);
+        return;
+    }
+    without_interrupts(|| {
+        if let Some(allocator) = PAGE_FRAME_ALLOCATOR.lock().as_mut() {
+            allocator.free(addr, order);
+        }
+    });
+}
+
+/// Prints the zero pool counters, and the frame magazine and resize counters of every CPU that has used them.
+pub fn print_stats() {
+    let zero_pool = zero_pool::stats();
+    println!(
+        "Zero pool: {} hits, {} misses, {} frames zeroed in the background",
+        zero_pool.hits, zero_pool.misses, zero_pool.zeroed
+    );
+
+    for cpu in 0..MAX_CPUS {
+        let stats = frame_cache::stats(cpu);
+        if stats.hits + stats.misses == 0 {
+            continue;
+        }
+        println!(
+            "CPU {} frame magazine: {}% hits, {} refills, {} drains",
+            cpu,
+            stats.hit_rate(),
+            stats.refills,
+            stats.drains
+        );
+    }
+
+    for cpu in 0..MAX_CPUS {
+        let stats = unsafe { ALLOCATOR.realloc_stats(cpu) };
+        if stats.in_place + stats.remapped + stats.copied == 0 {
+            continue;
+        }
+        println!(
+            "CPU {} realloc: {} in place, {} remapped, {} copied",
+            cpu, stats.in_place, stats.remapped, stats.copied
+        );
+    }
+}
+
+/// Returns a pointer to the kernel PML4 table in the direct physical map.
 pub fn active_level_4_table() -> *mut PageTable {
-    let root_page_table = unsafe { &mut *(paging::ROOT_PAGE_TABLE as *mut PageTable) };
-    root_page_table
+    unsafe { PhysAddr(paging::ROOT_PAGE_TABLE).as_mut_ptr() }
 }
 
 pub fn map_io(addr: u64) {
@@ -155,27 +277,14 @@ pub fn map_io(addr: u64) {
     unsafe { page_table_manager.map_io(virt_addr, phys_addr) };
 }
 
-pub fn map_io_pages(pages: usize) -> usize {
-    let root_page_table = active_level_4_table();
-    let mut page_table_manager = PageTableManager::new(root_page_table);
-    let mut start_addr = None;
-
-    for _ in 0..pages {
-        let phys_addr = unsafe { page_table_manager.alloc_zeroed_page() };
-        if start_addr.is_none() {
-            start_addr = Some(phys_addr);
-        }
-        unsafe { page_table_manager.map_io(VirtAddr(phys_addr.0), phys_addr) };
-    }
-
-    start_addr.unwrap().0
-}
-
+/// Allocates a zeroed, physically contiguous DMA buffer and returns its physical address.
+///
+/// Prefer `dma::DmaBuffer`, which returns the buffer to its pool when dropped.
 pub fn allocate_dma_buffer(size: usize) -> u64 {
-    let pages = (size / PAGE_SIZE) + 1;
-    map_io_pages(pages) as u64
+    dma::alloc_zeroed(size).expect("Out of DMA memory").0 as u64
 }
 
+/// Returns a buffer obtained from `allocate_dma_buffer` with the same `size` to the DMA pools.
 pub fn deallocate_dma_buffer(phys_addr: u64, size: usize) {
-    todo!("Implement deallocate_dma_buffer");
+    unsafe { dma::free(PhysAddr(phys_addr as usize), size) };
 }
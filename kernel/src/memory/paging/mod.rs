@@ -1,26 +1,60 @@
 use super::physical_page_allocator::PhysicalPageAllocator;
 use crate::{
     memory::{
-        addr::{PhysAddr, ToPhysAddr, VirtAddr},
+        self,
+        addr::{self, PhysAddr, ToPhysAddr, VirtAddr},
         get_memory_size,
-        paging::{page_table_manager::PageTableManager, table::PageTable},
-        PAGE_SIZE,
+        paging::{
+            page_table_manager::PageTableManager,
+            table::{PageEntryFlags, PageTable},
+            tlb::TlbBatch,
+        },
+        PAGE_SIZE, PHYS_MAP_START,
     },
     println,
-    registers::cr3::Cr3,
+    registers::{cr3::Cr3, cr4::Cr4, rdtsc::Rdtsc},
     structures::BootInfo,
 };
 
 pub(crate) mod page_table_manager;
+pub(crate) mod pat;
+pub(crate) mod pcid;
 pub(crate) mod table;
+pub(crate) mod tlb;
 
 pub static mut PAGE_TABLE_MANAGER: Option<PageTableManager> = None;
+/// The physical address of the kernel PML4 table, as loaded into CR3.
 pub static mut ROOT_PAGE_TABLE: usize = 0;
 
+/// The virtual address range reserved for user mappings (PML4 slots 128 to 191).
+/// The kernel maps nothing here, so the page tables of this range are private to each address space,
+/// while the tables of every other PML4 slot are shared with the kernel page table.
+pub const USER_SPACE_START: VirtAddr = VirtAddr(0x0000_4000_0000_0000); // 64 TB
+pub const USER_SPACE_END: VirtAddr = VirtAddr(0x0000_6000_0000_0000); // 96 TB
+
+/// Returns whether `addr` lies in the user space range.
+pub fn is_user_addr(addr: VirtAddr) -> bool {
+    addr.0 >= USER_SPACE_START.0 && addr.0 < USER_SPACE_END.0
+}
+
+/// Resolves a page fault on a kernel address whose PML4 entry was created after the active address space.
+///
+/// # Safety
+///
+/// Must only be called from the page fault handler.
+///
+/// # Returns
+///
+/// `true` if the missing kernel PML4 entry was copied into the active page table.
+pub unsafe fn handle_page_fault(addr: VirtAddr) -> bool {
+    let active = PhysAddr(Cr3::read() & !(PAGE_SIZE - 1));
+    PageTableManager::sync_kernel_entry(active.as_mut_ptr(), memory::active_level_4_table(), addr)
+}
+
 /// Initializes the page table manager with the boot information and a page frame allocator.
 ///
-/// This function sets up the initial PML4 table, maps all system memory, and ensures that the framebuffer
-/// memory is also correctly mapped. Finally, it updates the CR3 register to use the new page table.
+/// This function sets up the initial PML4 table, identity-maps all system memory and maps it again at
+/// `PHYS_MAP_START`, both with the largest page size the alignment allows (1 GiB or 2 MiB pages), and ensures that the framebuffer memory is also correctly mapped. Finally, it updates the CR3 register to use the new page table.
 ///
 /// # Safety
 ///
@@ -35,45 +69,97 @@ pub static mut ROOT_PAGE_TABLE: usize = 0;
 /// * `page_frame_alloc` - A reference to a physical page frame allocator.
 pub unsafe fn init(boot_info: &'static BootInfo, page_frame_alloc: &mut PhysicalPageAllocator) {
     // Allocate and zero-initialize a new PML4 table.
-    let pml4 = page_frame_alloc.alloc_page().unwrap().0 as *mut PageTable;
+    let pml4_frame = page_frame_alloc.alloc_page().unwrap();
+    let pml4 = pml4_frame.as_mut_ptr::<PageTable>();
     (pml4 as *mut u8).write_bytes(0, PAGE_SIZE);
 
-    println!("PML4 allocated at: {:#x}", pml4 as usize);
+    println!("PML4 allocated at: {:#x}", pml4_frame.0);
 
     let mut pt_manager = PageTableManager::new(pml4);
     let total_memory = get_memory_size(boot_info);
 
-    let mut frame_alloc = || page_frame_alloc.alloc_page().unwrap().0 as *mut PageTable;
-    for i in (0..total_memory).step_by(PAGE_SIZE) {
-        unsafe { pt_manager.map_memory(VirtAddr(i), PhysAddr(i), &mut frame_alloc, false) };
-    }
+    let mut table_count = 0;
+    let mut frame_alloc = || {
+        table_count += 1;
+        page_frame_alloc.alloc_page().unwrap().as_mut_ptr()
+    };
+
+    let start = Rdtsc::read();
+    let mut tlb = TlbBatch::kernel();
+    pt_manager.map_range(
+        VirtAddr(0),
+        PhysAddr(0),
+        total_memory,
+        PageEntryFlags::WRITABLE,
+        &mut frame_alloc,
+        &mut tlb,
+    );
+
+    // Map all physical memory again in the direct map, which the kernel shares with every address space.
+    pt_manager.map_range(
+        PHYS_MAP_START,
+        PhysAddr(0),
+        total_memory,
+        PageEntryFlags::WRITABLE,
+        &mut frame_alloc,
+        &mut tlb,
+    );
 
     // Remap the framebuffer memory.
-    remap_frame_buffer(boot_info, &mut pt_manager, &mut frame_alloc);
+    remap_frame_buffer(boot_info, &mut pt_manager, &mut frame_alloc, &mut tlb);
+    let cycles = Rdtsc::read() - start;
+    println!(
+        "Mapped {} MB in {} cycles using {} page tables",
+        total_memory / (1024 * 1024),
+        cycles,
+        table_count
+    );
 
-    // Update the CR3 register to use the new page table.
-    Cr3::write(pml4 as u64);
+    // Update the CR3 register to use the new page table, then invalidate any replaced global translations.
+    // From here on, page tables and frames are reached through the direct map.
+    Cr3::write(pml4_frame.0 as u64);
+    addr::enable_direct_map();
+    init_cpu();
+    tlb.flush();
 
     // Store the page table manager in a global static variable.
     unsafe {
-        PAGE_TABLE_MANAGER = Some(pt_manager);
-        ROOT_PAGE_TABLE = pml4 as usize;
+        PAGE_TABLE_MANAGER = Some(PageTableManager::new(pml4_frame.as_mut_ptr()));
+        ROOT_PAGE_TABLE = pml4_frame.0;
     }
 
     println!("Page table initialized");
 }
 
-// Remaps the framebuffer memory to ensure it is accessible.
+/// Programs the page attribute table and enables global pages and PCIDs on the executing CPU.
+///
+/// Kernel mappings are marked GLOBAL, so their TLB entries survive address space switches, and each
+/// process's TLB entries are tagged with its PCID, so they survive switches to other address spaces.
+/// Must be called on every CPU after the kernel page table has been loaded.
+pub fn init_cpu() {
+    // Setting PGE flushes the whole TLB, including translations cached with the old memory types.
+    pat::init();
+    Cr4::write(Cr4::read() | Cr4::PGE);
+    pcid::init();
+}
+
+// Remaps the framebuffer memory write-combining, so that pixel stores are merged into bursts.
 unsafe fn remap_frame_buffer<F: FnMut() -> *mut PageTable>(
     boot_info: &'static BootInfo,
     pt_manager: &mut PageTableManager,
     frame_alloc: &mut F,
+    tlb: &mut TlbBatch,
 ) {
     let fb_start = boot_info.framebuffer.pointer.as_ptr() as usize;
     let fb_size =
         (boot_info.framebuffer.height * boot_info.framebuffer.width * 4) as usize + PAGE_SIZE;
     // page_frame_alloc.lock_pages(fb_start, fb_size / PAGE_SIZE + 1);
-    for i in (fb_start..fb_start + fb_size).step_by(PAGE_SIZE) {
-        pt_manager.map_memory(VirtAddr(i), PhysAddr(i), frame_alloc, true);
-    }
+    pt_manager.map_range(
+        VirtAddr(fb_start),
+        PhysAddr(fb_start),
+        fb_size,
+        PageEntryFlags::WRITABLE | PageEntryFlags::USER_ACCESSIBLE | pat::WRITE_COMBINING,
+        frame_alloc,
+        tlb,
+    );
 }
@@ -1,10 +1,16 @@
-use super::table::{PageEntryFlags, PageTable, PageTablePtr, TableLevel};
+use super::{
+    is_user_addr, pat,
+    table::{PageEntry, PageEntryFlags, PageSize, PageTable, PageTablePtr, TableLevel},
+    tlb::{self, TlbBatch},
+    USER_SPACE_END, USER_SPACE_START,
+};
 use crate::{
     memory::{
+        self,
         addr::{PhysAddr, VirtAddr},
-        PAGE_SIZE,
+        zero_pool, PAGE_SIZE,
     },
-    ALLOCATOR,
+    registers::cpuid::CpuId,
 };
 
 #[derive(Clone)]
@@ -23,7 +29,9 @@ impl PageTableManager {
     ///
     /// This function traverses the page table hierarchy, creating new tables as necessary,
     /// and sets the final entry to point to the provided physical address.
-    /// It sets the page as writable.
+    /// It sets the page as writable. If the address lies inside a huge page, the huge page
+    /// is split so that only this 4 KiB page changes its translation.
+    /// Pages outside the user space range are shared by every address space and are marked global.
     ///
     /// # Safety
     ///
@@ -39,21 +47,28 @@ impl PageTableManager {
     ///
     /// * `virt`: The virtual address to map.
     /// * `phys`: The physical address to map to.
-    /// * `page_frame_alloc`: A reference to a physical page frame allocator.
+    /// * `page_frame_alloc`: A reference to a physical page frame allocator. It may return a null pointer
+    ///   when no frame is left, in which case nothing is mapped.
+    ///
+    /// # Returns
+    ///
+    /// `true` if the page was mapped, or `false` if a page table could not be allocated.
     pub unsafe fn map_memory<F: FnMut() -> *mut PageTable>(
         &mut self,
         virt: VirtAddr,
         phys: PhysAddr,
         frame_alloc: &mut F,
         user: bool,
-    ) {
+    ) -> bool {
         // Traverse the page table hierarchy, creating tables as needed, and chain the calls.
-        let mut pt = self
+        let Some(mut pt) = self
             .pml4
             .next_or_create(virt, frame_alloc)
             .and_then(|mut pdp| pdp.next_or_create(virt, frame_alloc))
             .and_then(|mut pd| pd.next_or_create(virt, frame_alloc))
-            .unwrap();
+        else {
+            return false;
+        };
 
         // Calculate the index for the final level based on the virtual address.
         let index = pt.level.index(virt);
@@ -61,6 +76,8 @@ impl PageTableManager {
         // Obtain a mutable reference to the final page table entry.
         let entry = &mut pt[index];
 
+        let was_present = entry.is_present();
+
         // Set the frame address to the provided physical address and mark it as writable.
         entry.set_frame_addr(phys.0 as usize);
 
@@ -68,12 +85,269 @@ impl PageTableManager {
         if user {
             flags |= PageEntryFlags::USER_ACCESSIBLE;
         }
+        if !is_user_addr(virt) {
+            flags |= PageEntryFlags::GLOBAL;
+        }
         entry.set_flags(flags);
+
+        // Drop a stale translation, including the one of a huge page that was just split.
+        // Kernel mappings are shared, so every CPU may cache them.
+        if was_present {
+            if is_user_addr(virt) {
+                tlb::flush(virt);
+            } else {
+                tlb::shootdown_kernel(virt, 1);
+            }
+        }
+
+        true
+    }
+
+    /// Maps a range of virtual memory to a contiguous range of physical memory,
+    /// using the largest page size that the alignment of each part of the range allows.
+    ///
+    /// 1 GiB pages are used where both addresses are 1 GiB aligned, at least 1 GiB remains
+    /// and the processor supports them; 2 MiB pages are used likewise, and 4 KiB pages for the rest.
+    /// Part of a huge page can later be remapped with `map_memory`, which splits it.
+    ///
+    /// The page tables are walked once per table rather than once per page: after reaching the table
+    /// that holds the entries for the current page size, consecutive entries are filled until the end
+    /// of the table or the range, and intermediate tables are only looked up or created at table boundaries.
+    ///
+    /// # Safety
+    ///
+    /// This function is unsafe for the same reasons as `map_memory`.
+    ///
+    /// # Arguments
+    ///
+    /// * `virt`: The start of the virtual range, 4 KiB aligned.
+    /// * `phys`: The start of the physical range, 4 KiB aligned.
+    /// * `size`: The size of the range in bytes, rounded up to whole 4 KiB pages.
+    /// * `flags`: The flags of the mappings, such as `WRITABLE` or `USER_ACCESSIBLE`. `PRESENT` is always set,
+    ///   and mappings outside the user space range are marked `GLOBAL`.
+    /// * `frame_alloc`: Allocates frames for new page tables.
+    /// * `tlb`: Collects the pages whose previous mapping was replaced and must be invalidated.
+    pub unsafe fn map_range<F: FnMut() -> *mut PageTable>(
+        &mut self,
+        virt: VirtAddr,
+        phys: PhysAddr,
+        size: usize,
+        flags: PageEntryFlags,
+        frame_alloc: &mut F,
+        tlb: &mut TlbBatch,
+    ) {
+        self.map_range_up_to(PageSize::Size1G, virt, phys, size, flags, frame_alloc, tlb);
+    }
+
+    /// Maps a range of virtual memory to a contiguous range of physical memory like `map_range`,
+    /// but with 4 KiB pages only.
+    ///
+    /// Meant for ranges that are later unmapped piecemeal, where a huge page would have to be split
+    /// before each partial unmap.
+    ///
+    /// # Safety
+    ///
+    /// This function is unsafe for the same reasons as `map_memory`.
+    ///
+    /// # Arguments
+    ///
+    /// Same as `map_range`.
+    pub unsafe fn map_range_4k<F: FnMut() -> *mut PageTable>(
+        &mut self,
+        virt: VirtAddr,
+        phys: PhysAddr,
+        size: usize,
+        flags: PageEntryFlags,
+        frame_alloc: &mut F,
+        tlb: &mut TlbBatch,
+    ) {
+        self.map_range_up_to(PageSize::Size4K, virt, phys, size, flags, frame_alloc, tlb);
+    }
+
+    // Maps a range as described for `map_range`, with pages no larger than `largest`.
+    unsafe fn map_range_up_to<F: FnMut() -> *mut PageTable>(
+        &mut self,
+        largest: PageSize,
+        virt: VirtAddr,
+        phys: PhysAddr,
+        size: usize,
+        flags: PageEntryFlags,
+        frame_alloc: &mut F,
+        tlb: &mut TlbBatch,
+    ) {
+        let huge_1g = CpuId::has_1gb_pages();
+        let size = (size + PAGE_SIZE - 1) & !(PAGE_SIZE - 1);
+        let mut offset = 0;
+
+        while offset < size {
+            let (v, p, remaining) = (virt.0 + offset, phys.0 + offset, size - offset);
+            let fits =
+                |page: PageSize| (v | p) & (page.bytes() - 1) == 0 && remaining >= page.bytes();
+
+            // Try the largest page size first. A huge page cannot replace an entry that already
+            // points to a table of smaller pages, in which case the next smaller size is used.
+            let mut mapped = 0;
+            for page_size in [PageSize::Size1G, PageSize::Size2M, PageSize::Size4K] {
+                if page_size.bytes() > largest.bytes()
+                    || page_size == PageSize::Size1G && !huge_1g
+                    || page_size != PageSize::Size4K && !fits(page_size)
+                {
+                    continue;
+                }
+
+                let mut table = self.walk(VirtAddr(v), page_size.level(), frame_alloc);
+                mapped = Self::fill_entries(&mut table, v, p, remaining, page_size, flags, tlb);
+                if mapped > 0 {
+                    break;
+                }
+            }
+
+            offset += mapped;
+        }
+    }
+
+    /// Removes the mappings of a range of virtual memory.
+    ///
+    /// Huge pages that lie entirely within the range are removed whole; a huge page that the range
+    /// only partly covers is split first. Like `map_range`, each page table is walked once and its
+    /// consecutive entries are cleared in one pass. The frames and page tables themselves are not freed.
+    ///
+    /// # Safety
+    ///
+    /// The caller must ensure that nothing accesses the range anymore and that the removed
+    /// translations are invalidated by flushing `tlb` before the memory is reused.
+    ///
+    /// # Arguments
+    ///
+    /// * `virt`: The start of the virtual range, 4 KiB aligned.
+    /// * `size`: The size of the range in bytes, rounded up to whole 4 KiB pages.
+    /// * `tlb`: Collects the pages whose mapping was removed and must be invalidated.
+    pub unsafe fn unmap_range(&mut self, virt: VirtAddr, size: usize, tlb: &mut TlbBatch) {
+        let mut frame_alloc = || {
+            memory::alloc_frames(0)
+                .expect("Out of physical memory")
+                .as_mut_ptr()
+        };
+        let size = (size + PAGE_SIZE - 1) & !(PAGE_SIZE - 1);
+        let mut offset = 0;
+
+        while offset < size {
+            let (v, remaining) = (virt.0 + offset, size - offset);
+
+            // Walk down to the table that holds the leaf entry for `v`.
+            let mut table = self.pml4.clone();
+            let unmapped = loop {
+                let entry = table[table.level.index(VirtAddr(v))];
+                let entry_size = table.level.entry_size();
+
+                // Nothing is mapped up to the end of this entry.
+                if !entry.is_present() {
+                    break entry_size - (v & (entry_size - 1));
+                }
+
+                if table.level == TableLevel::PT || entry.is_huge() {
+                    if entry.is_huge() && (v & (entry_size - 1) != 0 || remaining < entry_size) {
+                        // Split a huge page that is only partly unmapped and continue in the new table.
+                        table = table.next_or_create(VirtAddr(v), &mut frame_alloc).unwrap();
+                        continue;
+                    }
+                    break Self::clear_entries(&mut table, v, remaining, tlb);
+                }
+
+                table = table.next(VirtAddr(v));
+            };
+
+            offset += unmapped;
+        }
+    }
+
+    // Walks from the PML4 table to the table at `level` for `virt`, creating or splitting tables as needed.
+    unsafe fn walk<F: FnMut() -> *mut PageTable>(
+        &mut self,
+        virt: VirtAddr,
+        level: TableLevel,
+        frame_alloc: &mut F,
+    ) -> PageTablePtr {
+        let mut table = self.pml4.clone();
+        while table.level != level {
+            table = table.next_or_create(virt, frame_alloc).unwrap();
+        }
+        table
+    }
+
+    // Fills consecutive entries of `table`, starting with the entry for `virt`, with pages of the given size.
+    // Stops at the end of the table or the range, or at an entry that points to a table of smaller pages.
+    // Returns the number of bytes mapped.
+    unsafe fn fill_entries(
+        table: &mut PageTablePtr,
+        virt: usize,
+        phys: usize,
+        size: usize,
+        page_size: PageSize,
+        flags: PageEntryFlags,
+        tlb: &mut TlbBatch,
+    ) -> usize {
+        let step = page_size.bytes();
+
+        let mut leaf_flags = flags | PageEntryFlags::PRESENT;
+        if page_size != PageSize::Size4K {
+            leaf_flags |= PageEntryFlags::HUGE_PAGE;
+        }
+        if !is_user_addr(VirtAddr(virt)) {
+            leaf_flags |= PageEntryFlags::GLOBAL;
+        }
+
+        let mut index = table.level.index(VirtAddr(virt));
+        let mut mapped = 0;
+        while index < 512 && size - mapped >= step {
+            let entry = table[index];
+            if page_size != PageSize::Size4K && entry.is_present() && !entry.is_huge() {
+                break;
+            }
+
+            table[index] = PageEntry((phys + mapped) | leaf_flags.bits());
+            if entry.is_present() {
+                tlb.add(VirtAddr(virt + mapped), step / PAGE_SIZE);
+            }
+
+            index += 1;
+            mapped += step;
+        }
+        mapped
+    }
+
+    // Clears consecutive leaf entries of `table`, starting with the entry for `virt`.
+    // Stops at the end of the table or the range, or at an entry that points to a table of smaller pages.
+    // Returns the number of bytes unmapped.
+    unsafe fn clear_entries(
+        table: &mut PageTablePtr,
+        virt: usize,
+        size: usize,
+        tlb: &mut TlbBatch,
+    ) -> usize {
+        let step = table.level.entry_size();
+
+        let mut index = table.level.index(VirtAddr(virt));
+        let mut unmapped = 0;
+        while index < 512 && size - unmapped >= step {
+            let entry = table[index];
+            if entry.is_present() {
+                if table.level != TableLevel::PT && !entry.is_huge() {
+                    break;
+                }
+                table[index] = PageEntry(0);
+                tlb.add(VirtAddr(virt + unmapped), step / PAGE_SIZE);
+            }
+
+            index += 1;
+            unmapped += step;
+        }
+        unmapped
     }
 
     /// Maps a user-accessible page table entry.
     ///
-    /// This function navigates through the page tables (PML4, PDPT, PDT) to set a specific
+    /// This function navigates through the page tables (PML4, PDPT, PDT), creating them as needed, to set a specific
     /// page table entry as user accessible. It updates the page table entries along the way
     /// and finally sets the physical address for the given virtual address with the desired flags.
     ///
@@ -84,23 +358,36 @@ impl PageTableManager {
     ///
     /// # Security
     /// This function ensures that kernel pages are not modified. It operates only on the
-    /// user-accessible portion of the address space. Kernel pages reside in the higher half
-    /// of the address space in a typical x86_64 paging scheme, and this function assumes
-    /// that `virt_addr` provided is a user-space address.
+    /// user space range (`USER_SPACE_START..USER_SPACE_END`), whose page tables are private to each
+    /// address space, and panics for any other address, since the tables of all other PML4 slots
+    /// are shared with the kernel.
     pub fn map_user_page(page_table: *mut PageTable, virt_addr: VirtAddr, phys_addr: PhysAddr) {
+        assert!(
+            is_user_addr(virt_addr),
+            "User page outside of the user space range"
+        );
+
+        let mut frame_alloc = || {
+            memory::alloc_frames(0)
+                .expect("Out of physical memory")
+                .as_mut_ptr()
+        };
+
         // Initialize the current page table pointer to the PML4 table
         let mut current_table_ptr = PageTablePtr::new(page_table, TableLevel::PML4);
 
         // Traverse through the PML4, PDPT, and PDT levels
         for _ in (1..4).rev() {
-            let index = current_table_ptr.level.index(virt_addr);
-            let entry = unsafe { &mut (*current_table_ptr.ptr)[index] };
+            // Move to the next level page table, creating it if necessary
+            let next_table_ptr =
+                unsafe { current_table_ptr.next_or_create(virt_addr, &mut frame_alloc) }.unwrap();
 
             // Set the entry to be user accessible
+            let index = current_table_ptr.level.index(virt_addr);
+            let entry = unsafe { &mut (*current_table_ptr.ptr)[index] };
             entry.set_flags(entry.flags() | PageEntryFlags::USER_ACCESSIBLE);
 
-            // Move to the next level page table
-            current_table_ptr = unsafe { current_table_ptr.next(virt_addr) };
+            current_table_ptr = next_table_ptr;
         }
 
         // Set the final page table entry
@@ -112,180 +399,163 @@ impl PageTableManager {
         );
     }
 
-    /// Clones the PML4 table, including all its lower-level tables.
+    /// Creates the root table of a new address space that shares the kernel mappings.
+    ///
+    /// Every present entry of the kernel PML4 is copied by pointer, so the kernel's PDP, PD and PT tables
+    /// are shared with the new address space instead of being cloned, and later changes to kernel mappings
+    /// below those entries are visible in every address space. The slots of the user space range are left
+    /// empty; their tables are created per address space by `map_user_page`.
     ///
     /// # Arguments
-    /// * `src` - A pointer to the source PML4 table to be cloned.
+    /// * `kernel_pml4` - A pointer to the kernel PML4 table.
     ///
     /// # Safety
     /// This function is unsafe because it performs raw pointer dereferencing.
     ///
     /// # Returns
-    /// A pointer to the newly cloned PML4 table.
-    pub unsafe fn clone_pml4(src: *mut PageTable) -> *mut PageTable {
-        let page_table_manager = PageTableManager::new(src);
-        let new_pml4 = page_table_manager.alloc_zeroed_page().0 as *mut PageTable;
+    /// A pointer to the new PML4 table, which costs a single page.
+    pub unsafe fn new_address_space(kernel_pml4: *mut PageTable) -> *mut PageTable {
+        let page_table_manager = PageTableManager::new(kernel_pml4);
+        let new_pml4 = page_table_manager
+            .alloc_zeroed_page()
+            .as_mut_ptr::<PageTable>();
 
         for i in 0..512 {
-            let src_entry = &(*src)[i];
-            if src_entry.get_frame_addr().is_none() {
-                continue;
+            if (*kernel_pml4)[i].is_present() && !Self::is_user_slot(i) {
+                (*new_pml4)[i] = (*kernel_pml4)[i];
             }
-
-            let origin = src_entry.get_frame_addr().unwrap() as *mut PageTable;
-            let cloned_pdp = Self::clone_pdp(origin, &page_table_manager);
-            (*new_pml4)[i].set_frame_addr(cloned_pdp as usize);
-            (*new_pml4)[i].set_flags(PageEntryFlags::PRESENT | PageEntryFlags::WRITABLE);
         }
 
         new_pml4
     }
 
-    /// Converts a virtual address to a physical address.
+    /// Copies the kernel PML4 entry covering `virt` into another PML4 table if it is missing there.
     ///
-    /// This function navigates through the page tables to find the physical address
-    /// corresponding to a given virtual address.
+    /// Kernel PML4 entries created after an address space was set up are not part of it yet;
+    /// this brings them in lazily when the address space first touches them.
     ///
     /// # Arguments
-    /// * `virt` - The virtual address to be translated.
+    /// * `pml4` - A pointer to the PML4 table of the address space.
+    /// * `kernel_pml4` - A pointer to the kernel PML4 table.
+    /// * `virt` - The virtual address that was accessed.
     ///
     /// # Safety
     /// This function is unsafe because it performs raw pointer dereferencing.
     ///
     /// # Returns
-    /// The physical address corresponding to the given virtual address.
-    pub unsafe fn phys_addr(&self, virt: VirtAddr) -> PhysAddr {
-        let plm4_entry = &self.pml4[TableLevel::PML4.index(virt)];
-        let pdp = plm4_entry.get_frame_addr().unwrap() as *mut PageTable;
-
-        let pdp_entry = &(*pdp)[TableLevel::PDP.index(virt)];
-        let pd = pdp_entry.get_frame_addr().unwrap() as *mut PageTable;
-
-        let pd_entry = &(*pd)[TableLevel::PD.index(virt)];
-        let pt = pd_entry.get_frame_addr().unwrap() as *mut PageTable;
+    /// `true` if an entry was copied.
+    pub unsafe fn sync_kernel_entry(
+        pml4: *mut PageTable,
+        kernel_pml4: *mut PageTable,
+        virt: VirtAddr,
+    ) -> bool {
+        let index = TableLevel::PML4.index(virt);
+        if pml4 == kernel_pml4
+            || Self::is_user_slot(index)
+            || (*pml4)[index].is_present()
+            || !(*kernel_pml4)[index].is_present()
+        {
+            return false;
+        }
 
-        let pt_entry = &(*pt)[TableLevel::PT.index(virt)];
-        PhysAddr(pt_entry.get_frame_addr().unwrap())
+        (*pml4)[index] = (*kernel_pml4)[index];
+        true
     }
 
-    /// Maps an I/O address to the virtual address space.
-    pub unsafe fn map_io(&mut self, virt: VirtAddr, phys: PhysAddr) {
-        let page_table_ptr = self.alloc_zeroed_page().0 as *mut PageTable;
-        let mut frame_alloc = || page_table_ptr;
-        self.map_memory(virt, phys, &mut frame_alloc, false);
+    // Returns whether a PML4 slot lies in the user space range, whose tables are private to each address space.
+    fn is_user_slot(index: usize) -> bool {
+        let start = TableLevel::PML4.index(USER_SPACE_START);
+        let end = TableLevel::PML4.index(VirtAddr(USER_SPACE_END.0 - 1));
+        (start..=end).contains(&index)
     }
 
-    /// Allocates a zeroed page.
-    ///
-    /// This function allocates a new page using the heap allocator and zeroes it out.
-    ///
-    /// # Safety
-    /// This function is unsafe because it performs raw pointer dereferencing and assumes
-    /// the heap allocator is correctly implemented.
+    /// Converts a virtual address to a physical address.
     ///
-    /// # Returns
-    /// The physical address of the newly allocated zeroed page.
-    pub unsafe fn alloc_zeroed_page(&self) -> PhysAddr {
-        // Allocate a new page using the heap allocator
-        let virtual_address = ALLOCATOR.alloc_page();
-
-        // Zero out the allocated page
-        virtual_address.write_bytes(0, PAGE_SIZE);
-
-        // Convert the virtual address to a physical address
-        self.phys_addr(VirtAddr(virtual_address as usize))
-    }
-
-    /// Clones the PDPT (Page Directory Pointer Table), including all its lower-level tables.
+    /// This function navigates through the page tables to find the physical address
+    /// corresponding to a given virtual address.
     ///
     /// # Arguments
-    /// * `src` - A pointer to the source PDPT to be cloned.
-    /// * `page_table_manager` - A reference to the page table manager.
+    /// * `virt` - The virtual address to be translated.
     ///
     /// # Safety
     /// This function is unsafe because it performs raw pointer dereferencing.
     ///
     /// # Returns
-    /// A pointer to the newly cloned PDPT.
-    unsafe fn clone_pdp(
-        src: *mut PageTable,
-        page_table_manager: &PageTableManager,
-    ) -> *mut PageTable {
-        let new_pdp = page_table_manager.alloc_zeroed_page().0 as *mut PageTable;
-
-        for i in 0..512 {
-            let src_entry = &(*src)[i];
-            if src_entry.get_frame_addr().is_none() {
-                continue;
-            }
-
-            let origin = src_entry.get_frame_addr().unwrap() as *mut PageTable;
-            let cloned_pd = Self::clone_pd(origin, page_table_manager);
-            (*new_pdp)[i].set_frame_addr(cloned_pd as usize);
-            (*new_pdp)[i].set_flags(PageEntryFlags::PRESENT | PageEntryFlags::WRITABLE);
-        }
-
-        new_pdp
+    /// The physical address corresponding to the given virtual address.
+    ///
+    /// # Panics
+    /// Panics if the address is not mapped.
+    pub unsafe fn phys_addr(&self, virt: VirtAddr) -> PhysAddr {
+        self.translate(virt).unwrap()
     }
 
-    /// Clones the PD (Page Directory), including all its lower-level tables.
+    /// Converts a virtual address to a physical address, or returns `None` if the address is not mapped.
     ///
     /// # Arguments
-    /// * `src` - A pointer to the source PD to be cloned.
-    /// * `page_table_manager` - A reference to the page table manager.
+    /// * `virt` - The virtual address to be translated.
     ///
     /// # Safety
     /// This function is unsafe because it performs raw pointer dereferencing.
-    ///
-    /// # Returns
-    /// A pointer to the newly cloned PD.
-    unsafe fn clone_pd(
-        src: *mut PageTable,
-        page_table_manager: &PageTableManager,
-    ) -> *mut PageTable {
-        let new_pd = page_table_manager.alloc_zeroed_page().0 as *mut PageTable;
+    pub unsafe fn translate(&self, virt: VirtAddr) -> Option<PhysAddr> {
+        let plm4_entry = &self.pml4[TableLevel::PML4.index(virt)];
+        let pdp = PhysAddr(plm4_entry.get_frame_addr()?).as_mut_ptr::<PageTable>();
 
-        for i in 0..512 {
-            let src_entry = &(*src)[i];
-            if src_entry.get_frame_addr().is_none() {
-                continue;
-            }
+        let pdp_entry = &(*pdp)[TableLevel::PDP.index(virt)];
+        if pdp_entry.is_huge() {
+            let offset = virt.0 & (PageSize::Size1G.bytes() - 1);
+            return Some(PhysAddr(pdp_entry.get_frame_addr()? + offset));
+        }
+        let pd = PhysAddr(pdp_entry.get_frame_addr()?).as_mut_ptr::<PageTable>();
 
-            let origin = src_entry.get_frame_addr().unwrap() as *mut PageTable;
-            let cloned_pt = Self::clone_pt(origin, page_table_manager);
-            (*new_pd)[i].set_frame_addr(cloned_pt as usize);
-            (*new_pd)[i].set_flags(PageEntryFlags::PRESENT | PageEntryFlags::WRITABLE);
+        let pd_entry = &(*pd)[TableLevel::PD.index(virt)];
+        if pd_entry.is_huge() {
+            let offset = virt.0 & (PageSize::Size2M.bytes() - 1);
+            return Some(PhysAddr(pd_entry.get_frame_addr()? + offset));
         }
+        let pt = PhysAddr(pd_entry.get_frame_addr()?).as_mut_ptr::<PageTable>();
 
-        new_pd
+        let pt_entry = &(*pt)[TableLevel::PT.index(virt)];
+        Some(PhysAddr(
+            pt_entry.get_frame_addr()? + (virt.0 & (PAGE_SIZE - 1)),
+        ))
     }
 
-    /// Clones the PT (Page Table).
+    /// Maps a page of device registers to the virtual address space, uncacheable.
     ///
-    /// # Arguments
-    /// * `src` - A pointer to the source PT to be cloned.
-    /// * `page_table_manager` - A reference to the page table manager.
+    /// Page tables are allocated as needed; mapping a register page that lies inside a huge page
+    /// splits it, which can take a table for each of the PD and PT levels. A previous cacheable
+    /// mapping of the page is invalidated on every CPU.
+    pub unsafe fn map_io(&mut self, virt: VirtAddr, phys: PhysAddr) {
+        let mut frame_alloc = || {
+            memory::alloc_frames(0)
+                .expect("Out of physical memory")
+                .as_mut_ptr()
+        };
+        let mut tlb = TlbBatch::kernel();
+        self.map_range(
+            virt,
+            phys,
+            PAGE_SIZE,
+            PageEntryFlags::WRITABLE | pat::UNCACHEABLE,
+            &mut frame_alloc,
+            &mut tlb,
+        );
+        tlb.flush();
+    }
+
+    /// Allocates a zeroed page.
+    ///
+    /// This function takes a pre-zeroed frame from the zero pool, or allocates a new frame from the
+    /// buddy frame allocator and zeroes it out if the pool is empty.
+    /// The caller reaches the frame through the direct physical map with `PhysAddr::as_mut_ptr`.
     ///
     /// # Safety
-    /// This function is unsafe because it performs raw pointer dereferencing.
+    /// This function is unsafe because it performs raw pointer dereferencing and assumes
+    /// the frame allocator has been initialized.
     ///
     /// # Returns
-    /// A pointer to the newly cloned PT.
-    unsafe fn clone_pt(
-        src: *mut PageTable,
-        page_table_manager: &PageTableManager,
-    ) -> *mut PageTable {
-        let new_pt = page_table_manager.alloc_zeroed_page().0 as *mut PageTable;
-
-        for i in 0..512 {
-            let src_entry = &(*src)[i];
-            if src_entry.get_frame_addr().is_none() {
-                continue;
-            }
-
-            (*new_pt)[i] = *src_entry;
-        }
-
-        new_pt
+    /// The physical address of the newly allocated zeroed page.
+    pub unsafe fn alloc_zeroed_page(&self) -> PhysAddr {
+        zero_pool::alloc_zeroed_frame().expect("Out of physical memory")
     }
 }
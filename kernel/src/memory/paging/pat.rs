@@ -0,0 +1,59 @@
+use super::table::PageEntryFlags;
+use crate::registers::{cpuid::CpuId, msr::Msr};
+
+/// The memory types of the page attribute table.
+#[repr(u8)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum MemoryType {
+    Uncacheable = 0,    // UC: every access goes to the bus, in program order
+    WriteCombining = 1, // WC: writes are buffered and merged into bursts, reads are uncached
+    WriteThrough = 4,   // WT: reads are cached, writes go to memory immediately
+    WriteProtected = 5, // WP: reads are cached, writes invalidate the cache lines
+    WriteBack = 6,      // WB: ordinary cached memory
+    UncachedMinus = 7,  // UC-: uncacheable, but can be overridden to WC by the MTRRs
+}
+
+// The page attribute table programmed on every CPU. An entry is selected by the PAT, PCD and PWT bits
+// of a mapping (bit 2, 1 and 0 of the index). It matches the power-on default except for entry 1,
+// which becomes write-combining, so the PAT bit itself (whose position differs between 4 KiB and
+// huge pages) is never needed.
+const PAT_ENTRIES: [MemoryType; 8] = [
+    MemoryType::WriteBack,      // 0: no flags
+    MemoryType::WriteCombining, // 1: PWT
+    MemoryType::UncachedMinus,  // 2: PCD
+    MemoryType::Uncacheable,    // 3: PCD | PWT
+    MemoryType::WriteBack,      // 4: PAT
+    MemoryType::WriteThrough,   // 5: PAT | PWT
+    MemoryType::UncachedMinus,  // 6: PAT | PCD
+    MemoryType::Uncacheable,    // 7: PAT | PCD | PWT
+];
+
+const IA32_PAT: u32 = 0x277;
+
+/// The page entry flags that map memory write-combining, e.g. a framebuffer.
+pub const WRITE_COMBINING: PageEntryFlags = PageEntryFlags::WRITE_THROUGH;
+
+/// The page entry flags that map memory uncacheable, e.g. device registers.
+/// These select the same memory type with or without a programmed PAT.
+pub const UNCACHEABLE: PageEntryFlags = PageEntryFlags::from_bits_truncate(
+    PageEntryFlags::WRITE_THROUGH.bits() | PageEntryFlags::CACHE_DISABLE.bits(),
+);
+
+/// Programs the page attribute table of the executing CPU.
+///
+/// Every CPU must use the same table. Must be called before the TLB is flushed with global pages
+/// enabled, so that no translation cached with the old memory types survives.
+/// Without PAT support, `WRITE_COMBINING` mappings fall back to write-through.
+pub fn init() {
+    if !CpuId::has_pat() {
+        return;
+    }
+
+    let value = PAT_ENTRIES
+        .iter()
+        .enumerate()
+        .fold(0u64, |pat, (i, &memory_type)| {
+            pat | (memory_type as u64) << (i * 8)
+        });
+    Msr::write(IA32_PAT, value);
+}
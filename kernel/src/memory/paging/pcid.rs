@@ -0,0 +1,71 @@
+use crate::{
+    cpu::percpu::{current_cpu, MAX_CPUS},
+    registers::{cpuid::CpuId, cr3::Cr3, cr4::Cr4},
+};
+use core::sync::atomic::{AtomicBool, AtomicU16, Ordering};
+
+/// The number of process-context identifiers (the low 12 bits of CR3).
+pub const PCID_COUNT: usize = 4096;
+
+/// The PCID of the kernel page table. Processes get the others.
+pub const KERNEL_PCID: u16 = 0;
+
+// When set in a CR3 write with PCIDs enabled, the TLB entries tagged with the new PCID are kept.
+const CR3_NO_FLUSH: u64 = 1 << 63;
+
+static PCID_ENABLED: AtomicBool = AtomicBool::new(false);
+static NEXT_PCID: AtomicU16 = AtomicU16::new(1);
+
+// The owner of the TLB entries each CPU may hold for every PCID, as a process ID; 0 if none.
+// PCIDs are recycled once all of them are handed out, so a CPU must flush a PCID's entries
+// before it loads the address space of a new owner with it.
+static mut PCID_OWNERS: [[u32; PCID_COUNT]; MAX_CPUS] = [[0; PCID_COUNT]; MAX_CPUS];
+
+/// Enables PCIDs on the executing CPU if the processor supports them.
+///
+/// Must be called on every CPU while the kernel page table, which uses `KERNEL_PCID`, is loaded.
+pub fn init() {
+    if CpuId::has_pcid() {
+        Cr4::write(Cr4::read() | Cr4::PCIDE);
+        PCID_ENABLED.store(true, Ordering::Relaxed);
+    }
+}
+
+/// Returns a PCID for a new address space.
+///
+/// PCIDs are handed out round-robin and shared by several address spaces once all of them are in use;
+/// `load` flushes the entries of the previous owner in that case.
+pub fn alloc() -> u16 {
+    loop {
+        let pcid = NEXT_PCID.fetch_add(1, Ordering::Relaxed) % PCID_COUNT as u16;
+        if pcid != KERNEL_PCID {
+            return pcid;
+        }
+    }
+}
+
+/// Loads an address space into CR3, keeping the TLB entries it left on this CPU.
+///
+/// Without PCID support this is a plain CR3 write, which flushes all non-global TLB entries.
+///
+/// # Safety
+///
+/// `page_table` must be a valid PML4 table that maps the executing code, and `pcid`
+/// must have been obtained from `alloc` for the address space identified by `owner`.
+pub unsafe fn load(page_table: u64, pcid: u16, owner: u32) {
+    if !PCID_ENABLED.load(Ordering::Relaxed) {
+        Cr3::write(page_table);
+        return;
+    }
+
+    // Keep the PCID's entries only if this CPU last used it for the same address space.
+    let last_owner = &mut PCID_OWNERS[current_cpu()][pcid as usize];
+    let no_flush = if *last_owner == owner {
+        CR3_NO_FLUSH
+    } else {
+        0
+    };
+    *last_owner = owner;
+
+    Cr3::write(page_table | pcid as u64 | no_flush);
+}
@@ -1,4 +1,7 @@
-use crate::memory::{addr::VirtAddr, PAGE_SIZE};
+use crate::memory::{
+    addr::{PhysAddr, ToPhysAddr, VirtAddr},
+    PAGE_SIZE,
+};
 use bitflags::bitflags;
 use core::ops::{Index, IndexMut};
 
@@ -28,6 +31,14 @@ pub enum TableLevel {
     PT,
 }
 
+/// The page sizes that can be mapped by a single page table entry.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PageSize {
+    Size4K, // Mapped by a PT entry
+    Size2M, // Mapped by a PD entry with HUGE_PAGE set
+    Size1G, // Mapped by a PDP entry with HUGE_PAGE set
+}
+
 /// Represents a single entry in a page table.
 #[derive(Debug, Clone, Copy)]
 #[repr(transparent)]
@@ -97,6 +108,32 @@ impl PageEntry {
     pub fn is_present(&self) -> bool {
         self.flags().contains(PageEntryFlags::PRESENT)
     }
+
+    /// Checks if the entry maps a huge page instead of pointing to a next level table.
+    pub fn is_huge(&self) -> bool {
+        self.flags()
+            .contains(PageEntryFlags::PRESENT | PageEntryFlags::HUGE_PAGE)
+    }
+}
+
+impl PageSize {
+    /// Returns the size of the page in bytes.
+    pub fn bytes(&self) -> usize {
+        match self {
+            PageSize::Size4K => PAGE_SIZE,
+            PageSize::Size2M => 512 * PAGE_SIZE,
+            PageSize::Size1G => 512 * 512 * PAGE_SIZE,
+        }
+    }
+
+    /// Returns the level of the table whose entries map pages of this size.
+    pub fn level(&self) -> TableLevel {
+        match self {
+            PageSize::Size4K => TableLevel::PT,
+            PageSize::Size2M => TableLevel::PD,
+            PageSize::Size1G => TableLevel::PDP,
+        }
+    }
 }
 
 impl TableLevel {
@@ -110,6 +147,16 @@ impl TableLevel {
         }
     }
 
+    /// Returns the size of the memory range covered by one entry of a table at this level.
+    pub fn entry_size(&self) -> usize {
+        match self {
+            TableLevel::PML4 => 512 * 512 * 512 * PAGE_SIZE,
+            TableLevel::PDP => 512 * 512 * PAGE_SIZE,
+            TableLevel::PD => 512 * PAGE_SIZE,
+            TableLevel::PT => PAGE_SIZE,
+        }
+    }
+
     pub fn index(&self, virt_addr: VirtAddr) -> usize {
         match self {
             TableLevel::PML4 => (virt_addr.0 >> 39) & 0x1FF,
@@ -130,16 +177,20 @@ impl PageTablePtr {
     ///
     /// This function navigates to the next level page table for the given virtual address.
     /// If the next level table does not exist, it creates one using the provided frame allocator.
+    /// If the entry maps a huge page, the huge page is split into a table of smaller pages
+    /// with the same translation, so that part of it can be remapped.
     ///
     /// # Arguments
     /// * `virt_addr` - The virtual address for which to find the next level page table.
-    /// * `frame_alloc` - A mutable reference to a closure that allocates frames.
+    /// * `frame_alloc` - A mutable reference to a closure that allocates frames, returned as pointers from
+    ///   `PhysAddr::as_mut_ptr`.
     ///
     /// # Safety
     /// This function is unsafe because it performs raw pointer dereferencing.
     ///
     /// # Returns
-    /// An `Option` containing the next level `PageTablePtr` if successful, or `None` if it fails.
+    /// An `Option` containing the next level `PageTablePtr` if successful, or `None` if it fails,
+    /// including when `frame_alloc` returns a null pointer because no frame is left for a new table.
     pub unsafe fn next_or_create<F: FnMut() -> *mut PageTable>(
         &mut self,
         virt_addr: VirtAddr,
@@ -148,13 +199,15 @@ impl PageTablePtr {
         let index = self.level.index(virt_addr);
         let entry = &self[index];
 
-        if entry.is_present() {
+        if entry.is_huge() {
+            self.split_huge_page(index, frame_alloc)
+        } else if entry.is_present() {
             let addr = entry.get_frame_addr()?;
             let level = self.level.next_level();
-            Some(PageTablePtr::new(addr as *mut PageTable, level))
+            Some(PageTablePtr::new(PhysAddr(addr).as_mut_ptr(), level))
         } else {
             // Create the next level table if not present.
-            Some(self.create_next_table(index, frame_alloc))
+            self.create_next_table(index, frame_alloc)
         }
     }
 
@@ -177,23 +230,61 @@ impl PageTablePtr {
 
         let addr = entry.get_frame_addr().unwrap();
         let level = self.level.next_level();
-        PageTablePtr::new(addr as *mut PageTable, level)
+        PageTablePtr::new(PhysAddr(addr).as_mut_ptr(), level)
     }
 
     unsafe fn create_next_table<F: FnMut() -> *mut PageTable>(
         &mut self,
         index: usize,
         frame_alloc: &mut F,
-    ) -> PageTablePtr {
+    ) -> Option<PageTablePtr> {
         let page_table_addr = frame_alloc();
+        if page_table_addr.is_null() {
+            return None;
+        }
         // Zero out the new page table.
         (page_table_addr as *mut u8).write_bytes(0, PAGE_SIZE);
 
         // Set up the current entry to point to the new table.
-        self[index].set_frame_addr(page_table_addr as usize);
+        self[index].set_frame_addr(page_table_addr.to_phys_addr().0);
         self[index].set_flags(PageEntryFlags::PRESENT | PageEntryFlags::WRITABLE);
 
-        PageTablePtr::new(page_table_addr, self.level.next_level())
+        Some(PageTablePtr::new(page_table_addr, self.level.next_level()))
+    }
+
+    // Replaces a huge page entry with a table of 512 smaller pages that map the same physical range with the same flags.
+    // A 1 GiB page is split into 2 MiB pages and a 2 MiB page into 4 KiB pages.
+    unsafe fn split_huge_page<F: FnMut() -> *mut PageTable>(
+        &mut self,
+        index: usize,
+        frame_alloc: &mut F,
+    ) -> Option<PageTablePtr> {
+        let entry = self[index];
+        let base = entry.get_frame_addr().unwrap();
+        let next_level = self.level.next_level();
+
+        let mut flags = entry.flags();
+        if next_level == TableLevel::PT {
+            // PT entries have no huge page bit (bit 7 is PAT there).
+            flags.remove(PageEntryFlags::HUGE_PAGE);
+        }
+
+        let page_table_addr = frame_alloc();
+        if page_table_addr.is_null() {
+            return None;
+        }
+        for i in 0..512 {
+            (*page_table_addr)[i] = PageEntry((base + i * next_level.entry_size()) | flags.bits());
+        }
+
+        // Point the entry at the new table, keeping the access rights of the huge page.
+        let table_flags = entry.flags()
+            & (PageEntryFlags::PRESENT
+                | PageEntryFlags::WRITABLE
+                | PageEntryFlags::USER_ACCESSIBLE);
+        self[index] = PageEntry(page_table_addr.to_phys_addr().0 | table_flags.bits());
+
+        Some(PageTablePtr::new(page_table_addr, next_level))
     }
 }
 
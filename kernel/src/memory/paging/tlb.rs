@@ -0,0 +1,122 @@
+use crate::{
+    cpu::cross_call::{self, ALL_CPUS},
+    memory::{addr::VirtAddr, PAGE_SIZE},
+    registers::{cr3::Cr3, cr4::Cr4},
+};
+use core::arch::asm;
+
+/// The number of pages above which a shootdown flushes the whole TLB instead of invalidating page by page.
+pub const FULL_FLUSH_THRESHOLD: usize = 33;
+
+// The number of separate ranges a batch holds before it falls back to a full flush.
+const MAX_RANGES: usize = 16;
+
+/// Invalidates the TLB entries of the page containing `addr` on the executing CPU.
+///
+/// This also drops a cached huge page translation that covers `addr`.
+pub fn flush(addr: VirtAddr) {
+    unsafe {
+        asm!("invlpg [{}]", in(reg) addr.0, options(nostack, preserves_flags));
+    }
+}
+
+/// Invalidates all non-global TLB entries of the executing CPU by reloading CR3.
+pub fn flush_all() {
+    Cr3::write(Cr3::read() as u64);
+}
+
+/// Invalidates all TLB entries of the executing CPU, including global ones, by toggling CR4.PGE.
+pub fn flush_global() {
+    let cr4 = Cr4::read();
+    Cr4::write(cr4 & !Cr4::PGE);
+    Cr4::write(cr4);
+}
+
+/// A batch of TLB invalidations for the shared kernel mappings, sent to the other CPUs in a single IPI round.
+///
+/// Callers update the page tables, `add` every range whose mappings changed, and call `flush` once.
+/// Adjacent ranges are merged; above `FULL_FLUSH_THRESHOLD` pages or `MAX_RANGES` ranges the batch
+/// flushes the whole TLB instead. Kernel mappings are global and may be cached by any CPU, so every
+/// online CPU is interrupted.
+pub struct TlbBatch {
+    ranges: [(usize, usize); MAX_RANGES], // Start address and number of pages of each range
+    count: usize,
+    pages: usize,
+    full: bool,
+}
+
+impl TlbBatch {
+    /// Creates a batch for the kernel mappings, which every address space shares.
+    pub fn kernel() -> TlbBatch {
+        TlbBatch {
+            ranges: [(0, 0); MAX_RANGES],
+            count: 0,
+            pages: 0,
+            full: false,
+        }
+    }
+
+    /// Adds a range of pages whose mappings changed.
+    pub fn add(&mut self, start: VirtAddr, pages: usize) {
+        let start = start.0 & !(PAGE_SIZE - 1);
+        self.pages += pages;
+
+        if self.full || self.pages > FULL_FLUSH_THRESHOLD {
+            self.full = true;
+            return;
+        }
+
+        // Extend the previous range if the new one continues it.
+        if self.count > 0 {
+            let last = &mut self.ranges[self.count - 1];
+            if last.0 + last.1 * PAGE_SIZE == start {
+                last.1 += pages;
+                return;
+            }
+        }
+
+        if self.count == MAX_RANGES {
+            self.full = true;
+            return;
+        }
+        self.ranges[self.count] = (start, pages);
+        self.count += 1;
+    }
+
+    /// Invalidates the batched ranges on every online CPU and the executing one, and waits until all of them
+    /// are done. A CPU that is still being brought up invalidates its own changes as well.
+    pub fn flush(self) {
+        if self.pages == 0 {
+            return;
+        }
+
+        cross_call::call_on(
+            ALL_CPUS,
+            Self::invalidate,
+            &self as *const TlbBatch as usize,
+        );
+    }
+
+    // Runs on every target CPU with a pointer to the batch, which stays valid until all of them return.
+    fn invalidate(batch: usize) {
+        let batch = unsafe { &*(batch as *const TlbBatch) };
+
+        if batch.full {
+            flush_global();
+            return;
+        }
+
+        for &(start, pages) in &batch.ranges[..batch.count] {
+            for page in 0..pages {
+                flush(VirtAddr(start + page * PAGE_SIZE));
+            }
+        }
+    }
+}
+
+/// Invalidates a range of kernel mappings on every CPU with a single IPI round.
+pub fn shootdown_kernel(start: VirtAddr, pages: usize) {
+    let mut batch = TlbBatch::kernel();
+    batch.add(start, pages);
+    batch.flush();
+}
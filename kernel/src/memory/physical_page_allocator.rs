@@ -21,7 +21,8 @@ use core::{alloc::Layout, ptr};
 ///
 /// Fields:
 /// - bitmap: A Bitmap struct that represents the usage status of each page frame. A set bit indicates
-///   the page is occupied, and a cleared bit indicates the page is free.
+///   the page is occupied, and a cleared bit indicates the page is free. The bitmap keeps a summary level
+///   of fully used words, so searches for free pages skip occupied memory a word at a time.
 /// - free_memory: The total amount of free memory in bytes. This value is updated as pages are allocated or freed.
 /// - reserved_memory: The total amount of memory in bytes that has been reserved. Reserved pages are not
 ///   available for general allocation but are not considered in use yet.
@@ -101,7 +102,7 @@ impl PhysicalPageAllocator {
 
     /// Allocates a single page of memory using a bitmap to track free and used pages.
     ///
-    /// This function iterates over the bitmap starting from the current index (`self.bitmap_index`) to find
+    /// This function searches the bitmap starting from the current index (`self.bitmap_index`) for
     /// a free page. Once a free page is found, it locks the page, updates the bitmap to mark the page as used,
     /// and then returns the physical address of the allocated page.
     ///
@@ -116,13 +117,8 @@ impl PhysicalPageAllocator {
     /// that concurrent access to the bitmap and memory pages is properly synchronized to prevent data races or
     /// undefined behavior.
     pub unsafe fn alloc_page(&mut self) -> Option<PhysAddr> {
-        // Iterate over the bitmap to find a free page.
-        for i in self.bitmap_index..(self.bitmap.size * 8) {
-            // Check if the current bit (page) is set (meaning it's already used).
-            if self.bitmap.get(i) {
-                continue; // Skip if the page is already used.
-            }
-
+        // Find the first free page, skipping fully used bitmap words.
+        if let Some(i) = self.bitmap.find_first_zero(self.bitmap_index) {
             // Lock the page to prevent it from being allocated again.
             self.lock_page(PhysAddr(i * PAGE_SIZE));
 
@@ -157,35 +153,16 @@ impl PhysicalPageAllocator {
         // Calculate the number of pages required to satisfy the layout.
         let num_pages = (layout.size() + PAGE_SIZE - 1) / PAGE_SIZE;
 
-        // Iterate over the bitmap to find a sequence of contiguous free pages.
-        let mut start = None;
-        let mut count = 0;
-
-        for i in self.bitmap_index..(self.bitmap.size * 8) {
-            if !self.bitmap.get(i) {
-                // Check if the current page is free.
-                if start.is_none() {
-                    start = Some(i);
-                }
-                count += 1;
-
-                // Check if we have found enough contiguous pages.
-                if count == num_pages {
-                    // Lock and mark the pages as used.
-                    for j in start.unwrap()..(start.unwrap() + num_pages) {
-                        self.lock_page(PhysAddr(j * PAGE_SIZE));
-                    }
-
-                    // Update the bitmap index for future searches.
-                    self.bitmap_index = start.unwrap() + num_pages;
-
-                    // Return the physical address of the allocated pages.
-                    return Some(PhysAddr(start.unwrap() * PAGE_SIZE));
-                }
-            } else {
-                start = None;
-                count = 0;
-            }
+        // Search the bitmap word by word for a sequence of contiguous free pages.
+        if let Some(start) = self.bitmap.find_zero_run(num_pages, self.bitmap_index) {
+            // Lock and mark the pages as used.
+            self.lock_pages_silent(PhysAddr(start * PAGE_SIZE), num_pages);
+
+            // Update the bitmap index for future searches.
+            self.bitmap_index = start + num_pages;
+
+            // Return the physical address of the allocated pages.
+            return Some(PhysAddr(start * PAGE_SIZE));
         }
 
         // Log a message and return None if no contiguous pages are available.
@@ -195,8 +172,8 @@ impl PhysicalPageAllocator {
 
     /// Locks a range of memory pages to mark them as in use.
     ///
-    /// This function iterates over a specified range of memory pages starting from a given physical address
-    /// (`start`) and marks each page as locked or in use by calling `lock_page` on each one.
+    /// This function marks a specified range of memory pages starting from a given physical address
+    /// (`start`) as locked or in use, filling whole bitmap words at a time.
     ///
     /// # Safety
     ///
@@ -210,16 +187,48 @@ impl PhysicalPageAllocator {
     /// * `start` - The physical address of the first page to be locked.
     /// * `size` - The number of consecutive pages to lock, starting from `start`.
     pub unsafe fn lock_pages(&mut self, start: PhysAddr, size: usize) {
-        // Iterate over the range of pages and lock each one.
-        for i in 0..size {
-            // Calculate the physical address of the current page to lock.
-            let current_page_address = start.0 + i * PAGE_SIZE;
-            // Lock the current page to mark it as in use.
-            self.lock_page(PhysAddr(current_page_address));
-        }
+        self.lock_pages_silent(start, size);
         println!("Locked {} pages starting from address {:#x}", size, start.0)
     }
 
+    /// Hands every free page of a physical range over to another allocator.
+    ///
+    /// Each maximal run of free pages in the range is locked in the bitmap and passed to `f`
+    /// as its starting address and page count. This is used once the boot-time allocations are done,
+    /// to seed the buddy frame allocator without the two allocators ever owning the same frame.
+    ///
+    /// # Safety
+    ///
+    /// The caller takes ownership of the pages passed to `f`; they are never returned by this allocator again.
+    ///
+    /// # Arguments
+    ///
+    /// * `start` - The physical address of the first page of the range.
+    /// * `size` - The number of pages in the range.
+    /// * `f` - A closure receiving each free run as `(start, pages)`.
+    pub unsafe fn take_free_ranges<F: FnMut(PhysAddr, usize)>(
+        &mut self,
+        start: PhysAddr,
+        size: usize,
+        mut f: F,
+    ) {
+        let end = (start.0 / PAGE_SIZE + size).min(self.bitmap.size);
+        let mut index = start.0 / PAGE_SIZE;
+
+        while let Some(free) = self.bitmap.find_first_zero(index) {
+            if free >= end {
+                break;
+            }
+
+            // The run of free pages ends at the next used page or at the end of the range.
+            let used = self.bitmap.find_first_one(free).unwrap_or(end).min(end);
+            self.lock_pages_silent(PhysAddr(free * PAGE_SIZE), used - free);
+            f(PhysAddr(free * PAGE_SIZE), used - free);
+
+            index = used;
+        }
+    }
+
     /// Returns the amount of free memory in megabytes.
     pub fn free_memory_mb(&self) -> usize {
         self.free_memory / 1024 / 1024
@@ -227,19 +236,11 @@ impl PhysicalPageAllocator {
 
     // Initializes the bitmap based on the provided memory region and total memory.
     unsafe fn init_bitmap(&mut self, region: &Region, total_memory: usize) {
-        let bitmap_size = self.calc_bitmap_size(total_memory);
         self.free_memory = total_memory;
-        // Create a new bitmap at the region's starting address with the calculated size.
-        self.bitmap = Bitmap::new(region.as_mut_ptr(), bitmap_size);
+        // Create a new bitmap at the region's starting address, with one bit per page.
+        self.bitmap = Bitmap::new(region.as_mut_ptr(), total_memory / PAGE_SIZE + 1);
         // Initialize all bitmap bits to 0 (free).
-        for i in 0..bitmap_size {
-            self.bitmap.buffer.add(i as usize).write(0);
-        }
-    }
-
-    // Calculates the required bitmap size based on the total memory size.
-    fn calc_bitmap_size(&self, total_memory_size: usize) -> usize {
-        (total_memory_size / PAGE_SIZE / 8 + 1) as usize
+        self.bitmap.clear();
     }
 
     // Reserves system pages in the bitmap.
@@ -266,51 +267,37 @@ impl PhysicalPageAllocator {
     // Locks the bitmap's memory pages.
     unsafe fn lock_bitmap(&mut self) {
         // Lock the pages occupied by the bitmap itself.
-        let bitmap_size = self.calc_bitmap_size(self.free_memory);
+        let bitmap_size = Bitmap::storage_size(self.bitmap.size);
         self.lock_pages(
-            self.bitmap.buffer.to_phys_addr(),
+            (self.bitmap.buffer as *mut u8).to_phys_addr(),
             bitmap_size / PAGE_SIZE + 1,
         );
     }
 
+    // Locks a range of pages without logging, updating the counters by the number of pages that changed state.
+    unsafe fn lock_pages_silent(&mut self, start: PhysAddr, size: usize) {
+        let locked = self.bitmap.set_range(start.0 / PAGE_SIZE, size, true) * PAGE_SIZE;
+        self.free_memory -= locked;
+        self.used_memory += locked;
+    }
+
     // Reserves a range of pages starting from a given address.
     unsafe fn reserve_pages(&mut self, start: PhysAddr, size: usize) {
-        // Iterate over the range and reserve each page.
-        for i in 0..size {
-            self.reserve_page(start + i * PAGE_SIZE);
-        }
+        // Mark the whole range at once and account only for the pages that were free.
+        let reserved = self.bitmap.set_range(start.0 / PAGE_SIZE, size, true) * PAGE_SIZE;
+        self.free_memory -= reserved;
+        self.reserved_memory += reserved;
     }
 
     // Unreserves a range of pages starting from a given address.
     unsafe fn unreserve_pages(&mut self, start: PhysAddr, size: usize) {
-        // Iterate over the range and unreserve each page.
-        for i in 0..size {
-            self.unreserve_page(start + i * PAGE_SIZE);
-        }
-    }
-
-    // Reserves a single page at the specified address.
-    unsafe fn reserve_page(&mut self, addr: PhysAddr) {
-        let index = addr.0 / PAGE_SIZE;
-        if !self.bitmap.get(index) {
-            self.bitmap.set(index, true);
-            // Update memory counters.
-            self.free_memory -= PAGE_SIZE;
-            self.reserved_memory += PAGE_SIZE;
-        }
-    }
-
-    // Unreserves a single page at the specified address.
-    unsafe fn unreserve_page(&mut self, addr: PhysAddr) {
-        let index = addr.0 / PAGE_SIZE;
-        if self.bitmap.get(index) {
-            self.bitmap.set(index, false);
-            // Update memory counters and the bitmap index.
-            self.free_memory += PAGE_SIZE;
-            self.reserved_memory -= PAGE_SIZE;
-            if self.bitmap_index > index {
-                self.bitmap_index = index;
-            }
+        // Clear the whole range at once and account only for the pages that were reserved.
+        let index = start.0 / PAGE_SIZE;
+        let unreserved = self.bitmap.set_range(index, size, false) * PAGE_SIZE;
+        self.free_memory += unreserved;
+        self.reserved_memory -= unreserved;
+        if unreserved > 0 && self.bitmap_index > index {
+            self.bitmap_index = index;
         }
     }
 
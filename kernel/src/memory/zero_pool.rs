@@ -0,0 +1,149 @@
+use super::{
+    addr::PhysAddr,
+    page_frame::{self, FrameFlags},
+    PAGE_SIZE,
+};
+use crate::{interrupts::without_interrupts, sync::mutex::SpinMutex};
+use core::arch::asm;
+
+/// The number of pre-zeroed frames the refill thread keeps in the pool.
+pub const ZERO_POOL_CAPACITY: usize = 256; // 1 MB
+
+/// Zero pool counters.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ZeroPoolStats {
+    pub hits: u64,   // Allocations served with a pre-zeroed frame
+    pub misses: u64, // Allocations that found the pool empty and zeroed a frame synchronously
+    pub zeroed: u64, // Frames zeroed in the background by the refill thread
+}
+
+/// A stack of frames that are already filled with zeros, refilled by an idle-priority kernel thread.
+///
+/// The frames must stay zeroed while they are in the pool, so they are tracked in an array
+/// instead of being linked through their own memory.
+struct ZeroPool {
+    frames: [PhysAddr; ZERO_POOL_CAPACITY],
+    count: usize,
+    stats: ZeroPoolStats,
+}
+
+// The pool is only locked with interrupts disabled, so the refill thread cannot be preempted while holding it.
+static ZERO_POOL: SpinMutex<ZeroPool> = SpinMutex::new(ZeroPool {
+    frames: [PhysAddr(0); ZERO_POOL_CAPACITY],
+    count: 0,
+    stats: ZeroPoolStats {
+        hits: 0,
+        misses: 0,
+        zeroed: 0,
+    },
+});
+
+/// Allocates a zeroed frame.
+///
+/// A pre-zeroed frame is taken from the pool in O(1); if the pool is empty, a frame is taken
+/// from the frame allocator and zeroed synchronously.
+///
+/// # Returns
+///
+/// The physical address of the frame, or `None` if physical memory is exhausted.
+pub fn alloc_zeroed_frame() -> Option<PhysAddr> {
+    let frame = without_interrupts(|| {
+        let mut pool = ZERO_POOL.lock();
+        if pool.count == 0 {
+            pool.stats.misses += 1;
+            return None;
+        }
+
+        pool.stats.hits += 1;
+        pool.count -= 1;
+        Some(pool.frames[pool.count])
+    });
+
+    // The frame is handed out to be written, so it is no longer known to be zeroed.
+    if let Some(frame) = frame.and_then(page_frame::frame) {
+        frame.clear_flags(FrameFlags::ZEROED);
+    }
+
+    frame.or_else(|| {
+        let frame = super::alloc_frames(0)?;
+        unsafe { frame.as_mut_ptr::<u8>().write_bytes(0, PAGE_SIZE) };
+        Some(frame)
+    })
+}
+
+/// Tops up the pool with freshly zeroed frames until it is full or physical memory runs out.
+///
+/// Frames are zeroed outside the pool lock with non-temporal stores, so refilling neither blocks
+/// allocations nor evicts useful cache lines.
+pub fn refill() {
+    while without_interrupts(|| ZERO_POOL.lock().count) < ZERO_POOL_CAPACITY {
+        let Some(frame) = super::alloc_frames(0) else {
+            return;
+        };
+        unsafe { zero_frame_non_temporal(frame) };
+        if let Some(info) = page_frame::frame(frame) {
+            info.set_flags(FrameFlags::ZEROED);
+        }
+
+        let stored = without_interrupts(|| {
+            let mut pool = ZERO_POOL.lock();
+            if pool.count == ZERO_POOL_CAPACITY {
+                return false;
+            }
+
+            let count = pool.count;
+            pool.frames[count] = frame;
+            pool.count += 1;
+            pool.stats.zeroed += 1;
+            true
+        });
+
+        // Another CPU filled the pool in the meantime.
+        if !stored {
+            unsafe { super::free_frames(frame, 0) };
+            return;
+        }
+    }
+}
+
+/// Returns the pool counters.
+pub fn stats() -> ZeroPoolStats {
+    without_interrupts(|| ZERO_POOL.lock().stats)
+}
+
+/// The entry point of the idle-priority kernel thread that keeps the pool filled.
+///
+/// The thread refills the pool and then halts until the next interrupt, so it only uses time
+/// that no other thread wants.
+pub extern "C" fn refill_thread() {
+    loop {
+        refill();
+        unsafe { asm!("hlt", options(nomem, nostack)) };
+    }
+}
+
+// Fills a frame with zeros using non-temporal stores, which bypass the cache.
+unsafe fn zero_frame_non_temporal(frame: PhysAddr) {
+    let start = frame.as_mut_ptr::<u8>() as usize;
+    let end = start + PAGE_SIZE;
+    asm!(
+        "2:",
+        "movnti [{ptr}], {zero}",
+        "movnti [{ptr} + 8], {zero}",
+        "movnti [{ptr} + 16], {zero}",
+        "movnti [{ptr} + 24], {zero}",
+        "movnti [{ptr} + 32], {zero}",
+        "movnti [{ptr} + 40], {zero}",
+        "movnti [{ptr} + 48], {zero}",
+        "movnti [{ptr} + 56], {zero}",
+        "add {ptr}, 64",
+        "cmp {ptr}, {end}",
+        "jne 2b",
+        // Order the weakly-ordered stores before the frame is handed out.
+        "sfence",
+        ptr = inout(reg) start => _,
+        end = in(reg) end,
+        zero = in(reg) 0u64,
+        options(nostack)
+    );
+}
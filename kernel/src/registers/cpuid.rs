@@ -0,0 +1,58 @@
+use core::arch::asm;
+
+/// The registers returned by the CPUID instruction for a leaf.
+pub struct CpuId {
+    pub eax: u32,
+    pub ebx: u32,
+    pub ecx: u32,
+    pub edx: u32,
+}
+
+impl CpuId {
+    pub fn read(leaf: u32, sub_leaf: u32) -> CpuId {
+        let eax: u32;
+        let rbx: u64;
+        let ecx: u32;
+        let edx: u32;
+        unsafe {
+            // RBX is reserved by the compiler, so it is saved around CPUID and copied out manually.
+            asm!(
+                "mov {tmp:r}, rbx",
+                "cpuid",
+                "xchg {tmp:r}, rbx",
+                tmp = out(reg) rbx,
+                inout("eax") leaf => eax,
+                inout("ecx") sub_leaf => ecx,
+                out("edx") edx,
+                options(nomem, nostack, preserves_flags)
+            );
+        }
+        CpuId {
+            eax,
+            ebx: rbx as u32,
+            ecx,
+            edx,
+        }
+    }
+
+    /// Returns the initial local APIC ID of the executing processor.
+    pub fn apic_id() -> u32 {
+        Self::read(1, 0).ebx >> 24
+    }
+
+    /// Returns whether the processor supports process-context identifiers (PCID, leaf 1 ECX bit 17).
+    pub fn has_pcid() -> bool {
+        Self::read(1, 0).ecx & (1 << 17) != 0
+    }
+
+    /// Returns whether the processor supports the page attribute table (PAT, leaf 1 EDX bit 16).
+    pub fn has_pat() -> bool {
+        Self::read(1, 0).edx & (1 << 16) != 0
+    }
+
+    /// Returns whether the processor supports 1 GiB pages (PDPE1GB, leaf 0x8000_0001 EDX bit 26).
+    pub fn has_1gb_pages() -> bool {
+        Self::read(0x8000_0000, 0).eax >= 0x8000_0001
+            && Self::read(0x8000_0001, 0).edx & (1 << 26) != 0
+    }
+}
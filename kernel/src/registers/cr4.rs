@@ -0,0 +1,33 @@
+use core::arch::asm;
+
+pub struct Cr4;
+
+impl Cr4 {
+    /// Page Global Enable: translations of pages marked GLOBAL are kept across CR3 writes.
+    pub const PGE: u64 = 1 << 7;
+
+    /// Process-Context Identifier Enable: TLB entries are tagged with the PCID in the low 12 bits of CR3.
+    pub const PCIDE: u64 = 1 << 17;
+
+    pub fn write(value: u64) {
+        unsafe {
+            asm!(
+                "mov cr4, {}",
+                in(reg) value,
+                options(nostack)
+            );
+        }
+    }
+
+    pub fn read() -> u64 {
+        let value: u64;
+        unsafe {
+            asm!(
+                "mov {}, cr4",
+                out(reg) value,
+                options(nostack)
+            );
+        }
+        value
+    }
+}
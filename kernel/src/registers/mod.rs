@@ -1,2 +1,5 @@
+pub(crate) mod cpuid;
 pub(crate) mod cr3;
+pub(crate) mod cr4;
+pub(crate) mod msr;
 pub(crate) mod rdtsc;
@@ -0,0 +1,36 @@
+use core::arch::asm;
+
+/// Base address of the GS segment, used to locate the per-CPU area.
+pub const IA32_GS_BASE: u32 = 0xC000_0101;
+
+/// Model-specific register access through `rdmsr` / `wrmsr`.
+pub struct Msr;
+
+impl Msr {
+    pub fn read(msr: u32) -> u64 {
+        let low: u32;
+        let high: u32;
+        unsafe {
+            asm!(
+                "rdmsr",
+                in("ecx") msr,
+                out("eax") low,
+                out("edx") high,
+                options(nomem, nostack, preserves_flags)
+            );
+        }
+        ((high as u64) << 32) | (low as u64)
+    }
+
+    pub fn write(msr: u32, value: u64) {
+        unsafe {
+            asm!(
+                "wrmsr",
+                in("ecx") msr,
+                in("eax") value as u32,
+                in("edx") (value >> 32) as u32,
+                options(nostack, preserves_flags)
+            );
+        }
+    }
+}
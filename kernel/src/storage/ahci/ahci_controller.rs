@@ -1,10 +1,13 @@
 use super::{
-    byte_swap_string, fis::FisRegisterHostToDevice, hba::HbaRegs, print_device_info,
+    byte_swap_string,
+    fis::FisRegisterHostToDevice,
+    hba::{HbaCommandTable, HbaRegs},
+    print_device_info,
     sata_ident::SataIdentity,
 };
 use crate::{
     cpu::io::sleep_for,
-    memory::{self},
+    memory::{self, dma::DmaBuffer},
     pci::pci_device::PciDevice,
     println,
     storage::{
@@ -12,6 +15,7 @@ use crate::{
         register_ahci_device,
     },
 };
+use core::mem::size_of;
 
 // AHCI_ENABLE is a bitmask used to enable AHCI mode in the controller's global host control register.
 pub const AHCI_ENABLE: u32 = 0x80000000; // Bit 31 is typically used to enable AHCI mode.
@@ -113,17 +117,16 @@ impl AhciController {
         // Calculate the total buffer size required for the read operation.
         let buf_size = (sector_count * sata_ident.sector_bytes as u64) as usize;
 
-        // Allocate a DMA buffer for the read operation.
-        let dma_buffer = memory::allocate_dma_buffer(buf_size) as *mut u8;
+        // Take a DMA buffer for the read operation from the DMA pools; it is returned when dropped.
+        let dma_buffer = DmaBuffer::new(buf_size);
 
         // Perform the device I/O operation to read data from the SATA device.
-        Self::perform_device_io(self.hba, port_number, fis, buf_size, false, dma_buffer).map(
-            |buf_phys_addr| {
-                // If the I/O operation succeeds, copy the data from the DMA buffer to the destination buffer.
-                let dma_buffer = buf_phys_addr as *mut u8;
-                dma_buffer.copy_to(buffer, buf_size);
-            },
-        );
+        if let Some(dma_buffer) =
+            Self::perform_device_io(self.hba, port_number, fis, false, dma_buffer)
+        {
+            // If the I/O operation succeeds, copy the data from the DMA buffer to the destination buffer.
+            dma_buffer.as_ptr().copy_to(buffer, buf_size);
+        }
     }
 
     /// Performs a write operation to a SATA device connected to a specific port on the AHCI controller.
@@ -155,16 +158,16 @@ impl AhciController {
         // TODO: parameterize sector size based on SATA device information.
         let buf_size = (sector_count * 512) as usize;
 
-        //Allocate a DMA buffer for the write operation.
-        let dma_buffer = memory::allocate_dma_buffer(buf_size) as *mut u8;
+        // Take a DMA buffer for the write operation from the DMA pools; it is returned when dropped.
+        let dma_buffer = DmaBuffer::new(buf_size);
 
         // Copy the data from the source buffer to the DMA buffer.
-        dma_buffer.copy_from(buffer, buf_size);
+        dma_buffer.as_ptr().copy_from(buffer, buf_size);
 
         //  Perform the device I/O operation to write data to the SATA device.
         // The `perform_device_io` function handles the actual write operation, interacting with the hardware.
         // The 'true' flag indicates that this is a write operation.
-        Self::perform_device_io(self.hba, port_no, fis, buf_size, true, dma_buffer);
+        Self::perform_device_io(self.hba, port_no, fis, true, dma_buffer);
     }
 
     // Gets the base address of the AHCI controller's registers from the PCI device's configuration space.
@@ -218,15 +221,13 @@ impl AhciController {
         // Create a FIS (Frame Information Structure) for the IDENTIFY DEVICE command.
         let fis = FisRegisterHostToDevice::identify_command();
 
-        // Allocate a DMA buffer of 512 bytes to receive the IDENTIFY DEVICE data from the SATA device.
-        let dma_buf = memory::allocate_dma_buffer(512) as *mut u8;
-        let buf_size = 512;
+        // Take a DMA buffer of 512 bytes to receive the IDENTIFY DEVICE data from the SATA device.
+        let dma_buf = DmaBuffer::new(512);
 
         // Perform the device I/O operation to send the IDENTIFY DEVICE command and read the response.
-        // The `perform_device_io` function handles the command execution and returns the physical address
-        // of the DMA buffer with the data if successful.
-        let identity = Self::perform_device_io(hba, port_number, fis, buf_size, false, dma_buf)
-            .map(|buf_phys_addr| *(buf_phys_addr as *mut SataIdentity)); // Convert the physical address to a pointer and dereference it to get the SataIdentity structure.
+        // If the command succeeds, the DMA buffer holds the SataIdentity structure.
+        let identity = Self::perform_device_io(hba, port_number, fis, false, dma_buf)
+            .map(|dma_buf| *(dma_buf.as_ptr() as *mut SataIdentity));
 
         // If the identity structure is successfully read, swap the byte order of the strings
         // (e.g., serial number, model, firmware revision) to correct endianness and return the structure.
@@ -240,40 +241,44 @@ impl AhciController {
 
     // Performs a read or write operation to a SATA device connected to a specific port on the AHCI controller.
     // This function sets up the necessary data structures and issues the command to the controller.
+    // The command table is taken from the DMA pools for the duration of the command, and the data
+    // is transferred directly to or from `dma_buf`.
+    // Returns the data buffer if the command completed. If it failed, the buffer is dropped, unless the
+    // port could not be stopped after a timeout: the HBA may then still access the data buffer and the
+    // command table, so both are leaked rather than returned to the DMA pools.
     unsafe fn perform_device_io(
         hba: *mut HbaRegs,            // Pointer to the AHCI controller's HBA registers.
         port_num: usize, // The port number on the AHCI controller to perform the I/O on.
         fis: FisRegisterHostToDevice, // The FIS (Frame Information Structure) representing the command to be sent.
-        buf_size: usize,              // The size of the buffer for the I/O operation.
         is_write: bool, // Flag indicating whether the operation is a write (`true`) or read (`false`).
-        dma_buf: *mut u8, // Pointer to the DMA buffer to be used for the I/O operation.
-    ) -> Option<u64> {
-        // Returns an `Option<u64>` with the physical address of the DMA buffer on success (for reads).
-
+        dma_buf: DmaBuffer, // The DMA buffer holding the data to write, or receiving the data read.
+    ) -> Option<DmaBuffer> {
         let port = (*hba).port_mut(port_num); // Get a mutable reference to the port using the port number.
 
         // Find an available command slot in the port's command list.
         if let Some(slot) = port.find_cmd_slot() {
             let cmd_header = port.get_cmd_header(slot); // Get the command header for the allocated command slot.
-            let buf_phys_addr = memory::allocate_dma_buffer(buf_size); // Allocate a DMA buffer and get its physical address.
+
+            // Take a zeroed command table (128-byte aligned) from the DMA pools.
+            let cmd_table = DmaBuffer::new_zeroed(size_of::<HbaCommandTable>());
 
             // Set up the command header, including setting up the FIS and other command details.
-            (*cmd_header).setup(buf_phys_addr, 1, fis);
+            (*cmd_header).setup(cmd_table.phys_addr(), 1, fis);
 
             // Retrieve the command table for the command slot.
             let cmd_tbl = (*cmd_header).get_command_table();
             // Set up the Physical Region Descriptor Table (PRDT) entry for the DMA buffer.
-            (*cmd_tbl).setup(buf_phys_addr, buf_size, is_write, dma_buf);
+            (*cmd_tbl).setup(dma_buf.phys_addr(), dma_buf.len());
 
-            // Issue the command to the specified port.
-            Self::issue_command(port_num, hba, slot);
-
-            // Return the physical address of the DMA buffer if the operation is a read; otherwise, return `None` for writes.
-            if !is_write {
-                Some(buf_phys_addr)
-            } else {
-                None
+            // Issue the command to the specified port and wait for it to complete.
+            if Self::issue_command(port_num, hba, slot) {
+                return Some(dma_buf);
+            }
+            if (*hba).port(port_num).command_engine_running() {
+                core::mem::forget(cmd_table);
+                core::mem::forget(dma_buf);
             }
+            None
         } else {
             // If no command slot is available, print an error message and return `None`.
             println!(
@@ -287,7 +292,10 @@ impl AhciController {
 
     // Issues a command to a specific port on the AHCI controller.
     // This function sets the command issue bit and waits for the command to complete.
-    unsafe fn issue_command(port_no: usize, hba: *mut HbaRegs, slot: usize) {
+    // Returns `true` if the command completed. If it timed out, the port's command engine is stopped and,
+    // if it did stop, started again for the next command. The caller must not free the command's buffers
+    // while the engine is still running.
+    unsafe fn issue_command(port_no: usize, hba: *mut HbaRegs, slot: usize) -> bool {
         let port = (*hba).port_mut(port_no); // Get a mutable reference to the port using the port number.
 
         port.sata_error = 0xFFFF_FFFF; // Clear any existing SATA errors by setting the SATA error register to all ones.
@@ -302,5 +310,20 @@ impl AhciController {
             sleep_for(10); // Sleep for a short period to avoid busy-waiting.
             timeout -= 10;
         }
+
+        if port.command_issue & (1 << slot) == 0 {
+            return true;
+        }
+
+        println!(
+            "AHCI port {}: command in slot {} timed out, resetting the port",
+            port_no, slot
+        );
+        port.stop_command();
+        if !port.command_engine_running() {
+            port.clear_errors();
+            port.start_command();
+        }
+        false
     }
 }
@@ -1,5 +1,5 @@
 use super::{hba::DeviceSignature, read_sectors, sata_ident::SataIdentity, write_sectors};
-use crate::memory;
+use crate::memory::dma::DmaBuffer;
 
 /// Represents a device connected to an AHCI port, providing read and write capabilities.
 #[derive(Clone, Copy)]
@@ -67,7 +67,7 @@ impl AhciDevice {
         write_sectors(self.port_number, buffer, start_sector, sectors_count);
 
         // Check if write was successful by reading the written sectors
-        let check_buffer = memory::allocate_dma_buffer(512) as *mut u8;
-        self.read_sectors(check_buffer, start_sector, sectors_count);
+        let check_buffer = DmaBuffer::new(sectors_count as usize * 512);
+        self.read_sectors(check_buffer.as_ptr(), start_sector, sectors_count);
     }
 }
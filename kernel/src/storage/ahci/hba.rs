@@ -1,7 +1,8 @@
 use super::fis::FisRegisterHostToDevice;
 use crate::{
     cpu::io::sleep_for,
-    memory, println,
+    memory::{self, addr::PhysAddr},
+    println,
     storage::ahci::ahci_controller::{AHCI_ENABLE, AHCI_ENABLE_TIMEOUT},
 };
 use bitfield_struct::bitfield;
@@ -183,6 +184,12 @@ impl HbaPort {
         }
     }
 
+    /// Returns whether the command engine still runs or receives FISes (CR or FR set),
+    /// i.e. whether the HBA may still access the command list, command tables or data buffers.
+    pub fn command_engine_running(&self) -> bool {
+        self.command & (CMD_FIS_RECEIVE_RUNNING_BIT | CMD_LIST_RUNNING_BIT) != 0
+    }
+
     /// Starts the command engine for this HBA port.
     ///
     /// Waits for the CR (Command List Running) bit to clear, then sets FRE and ST bits to start the port.
@@ -224,8 +231,9 @@ impl HbaPort {
         // Ensure no commands are running before rebasing
         self.stop_command();
 
-        // Allocate memory for the command list (1 page) and map it to an I/O accessible address
-        let command_list_base = memory::map_io_pages(1) as u32;
+        // Allocate memory for the command list (32 headers of 32 bytes, 1 KB aligned) from the DMA pools.
+        // The command list lives as long as the port, so the buffer is never returned.
+        let command_list_base = memory::allocate_dma_buffer(1024) as u32;
 
         if command_list_base == 0 {
             println!("Failed to allocate memory for the command list.");
@@ -266,9 +274,8 @@ impl HbaPort {
     /// A mutable reference to the `HbaCommandHeader` for the specified command slot.
     pub fn get_cmd_header(&self, slot: usize) -> &mut HbaCommandHeader {
         unsafe {
-            &mut *((self.command_list_base as u64
-                + (slot as u64 * size_of::<HbaCommandHeader>() as u64))
-                as *mut HbaCommandHeader)
+            let command_list = PhysAddr(self.command_list_base as usize);
+            &mut *(command_list + slot * size_of::<HbaCommandHeader>()).as_mut_ptr()
         }
     }
 }
@@ -376,8 +383,8 @@ impl HbaCommandHeader {
         // Set the length of the PRDT.
         self.dword0.set_prdt_length(prdt_len);
 
-        // Write the FIS to the command table base.
-        let fis_ptr = self.command_table_base as *mut FisRegisterHostToDevice;
+        // Write the FIS to the command table base through the direct physical map.
+        let fis_ptr = PhysAddr(buf_phys_addr as usize).as_mut_ptr::<FisRegisterHostToDevice>();
         unsafe { fis_ptr.write_volatile(fis) };
     }
 
@@ -391,12 +398,10 @@ impl HbaCommandHeader {
     ///
     /// The returned pointer must be used with care, as improper use can lead to undefined behavior.
     pub fn get_command_table(&self) -> *mut HbaCommandTable {
-        // Calculate the base address of the command table.
-        let table_base = self.command_table_base as u64;
-        let table_upper_base = self.command_table_base_upper as u64;
-        let cmd_tbl_addr = (table_base + table_upper_base) as *mut HbaCommandTable;
-
-        cmd_tbl_addr
+        // Calculate the physical base address of the command table and reach it through the direct physical map.
+        let table_base = self.command_table_base as usize;
+        let table_upper_base = self.command_table_base_upper as usize;
+        PhysAddr(table_upper_base << 32 | table_base).as_mut_ptr()
     }
 }
 
@@ -407,23 +412,13 @@ impl HbaCommandTable {
     ///
     /// # Parameters
     ///
-    /// - `buf_phys_addr`: The physical address of the buffer to be used for the data transfer.
+    /// - `buf_phys_addr`: The physical address of the DMA buffer used for the data transfer.
     /// - `buf_size`: The size of the buffer in bytes.
-    /// - `is_write`: A boolean flag indicating whether the operation is a write (`true`) or a read (`false`).
-    /// - `dma_buf`: A mutable pointer to the DMA buffer used for data transfer.
-    pub fn setup(&mut self, buf_phys_addr: u64, buf_size: usize, is_write: bool, dma_buf: *mut u8) {
+    pub fn setup(&mut self, buf_phys_addr: u64, buf_size: usize) {
         // Set up the Physical Region Descriptor Table entry for the buffer
         self.physical_region_descriptor_table[0] = HbaPhysicalRegionDescriptorTableEntry {
-            data_base_address: if is_write {
-                dma_buf as u32
-            } else {
-                buf_phys_addr as u32
-            },
-            data_base_address_upper: if is_write {
-                (dma_buf as u64 >> 32) as u32
-            } else {
-                (buf_phys_addr >> 32) as u32
-            },
+            data_base_address: buf_phys_addr as u32,
+            data_base_address_upper: (buf_phys_addr >> 32) as u32,
             reserved1: 0,
             data_byte_count_reserved2_interrupt: DataByteCountReserved2Interrupt::new()
                 .with_data_byte_count(buf_size as u32)
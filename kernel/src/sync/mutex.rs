@@ -55,6 +55,18 @@ impl<T> SpinMutex<T> {
             data: unsafe { &mut *self.data.get() },
         }
     }
+
+    // Attempts to acquire the lock without spinning.
+    // Returns a SpinMutexGuard if the lock was free, or None if it is held.
+    pub fn try_lock(&self) -> Option<SpinMutexGuard<T>> {
+        self.lock
+            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+            .ok()
+            .map(|_| SpinMutexGuard {
+                lock: &self.lock,
+                data: unsafe { &mut *self.data.get() },
+            })
+    }
 }
 
 // Implements Deref for SpinMutexGuard to provide read-only access to the protected data.
@@ -0,0 +1,158 @@
+use super::{
+    id::Tid,
+    scheduler::{entity, SchedClass, Task},
+};
+use crate::registers::rdtsc::Rdtsc;
+use alloc::{collections::BTreeMap, sync::Arc, vec::Vec};
+
+/// The fixed-point shift of CPU bandwidths: a bandwidth of `1 << BW_SHIFT` is the whole CPU.
+pub const BW_SHIFT: u32 = 20;
+
+/// The share of each CPU that deadline threads may reserve. The rest stays for the other classes,
+/// so that fixed-priority and fair threads cannot be starved by admitted reservations.
+pub const BW_LIMIT: u64 = (95 << BW_SHIFT) / 100;
+
+/// Returns the bandwidth of a reservation of `runtime` cycles every `period` cycles.
+pub fn bandwidth(runtime: u64, period: u64) -> u64 {
+    ((runtime as u128) << BW_SHIFT).div_ceil(period as u128) as u64
+}
+
+/// The earliest-deadline-first scheduling class of one CPU, with every thread served by a constant
+/// bandwidth server (CBS).
+///
+/// A deadline thread reserves `runtime` cycles of every `period`. It runs with an absolute deadline and
+/// a remaining budget; the ready thread with the earliest deadline runs first. The budget is charged on
+/// every tick, and a thread that has used it up is throttled until its deadline, when the next period's
+/// budget is granted, so an overrunning thread cannot take more than its reservation. A thread that wakes
+/// up with more budget than it could use at its reserved rate before its deadline gets a new deadline one
+/// period away instead.
+///
+/// Admission control keeps the total reserved bandwidth of each CPU below `BW_LIMIT`, which makes every
+/// deadline feasible under EDF. Deadline threads are not stolen by other CPUs, since their bandwidth is
+/// reserved on this one.
+///
+/// Fields:
+/// - ready: The ready threads, keyed by absolute deadline and thread ID.
+/// - throttled: The threads that have used up their budget, keyed by the time of their replenishment.
+/// - misses: The number of deadlines that passed before a thread received its budget.
+pub struct DeadlineClass {
+    ready: BTreeMap<(u64, Tid), Arc<Task>>,
+    throttled: BTreeMap<(u64, Tid), Arc<Task>>,
+    misses: u64,
+}
+
+impl DeadlineClass {
+    pub const fn new() -> Self {
+        DeadlineClass {
+            ready: BTreeMap::new(),
+            throttled: BTreeMap::new(),
+            misses: 0,
+        }
+    }
+
+    // Queues a thread by its deadline.
+    fn insert_ready(&mut self, thread: Arc<Task>) {
+        let key = unsafe { (entity(&thread).dl_deadline, thread.tid) };
+        self.ready.insert(key, thread);
+    }
+
+    // Records a missed deadline and starts a new period for the thread from `now`.
+    fn miss(&mut self, thread: &Arc<Task>, now: u64) {
+        let se = unsafe { entity(thread) };
+        se.dl_deadline = now + se.dl_period;
+        se.dl_budget = se.dl_runtime as i64;
+        self.misses += 1;
+    }
+}
+
+impl SchedClass for DeadlineClass {
+    fn enqueue(&mut self, thread: Arc<Task>, wakeup: bool) {
+        let se = unsafe { entity(&thread) };
+        if se.dl_throttled {
+            let key = (se.dl_deadline, thread.tid);
+            self.throttled.insert(key, thread);
+            return;
+        }
+
+        // The CBS wakeup rule: keep the current deadline only if the remaining budget can be used
+        // at the reserved rate before it, i.e. budget / (deadline - now) <= runtime / period.
+        if wakeup {
+            let now = Rdtsc::read();
+            let fits = now < se.dl_deadline
+                && (se.dl_budget.max(0) as u128) * (se.dl_period as u128)
+                    <= (se.dl_runtime as u128) * ((se.dl_deadline - now) as u128);
+            if !fits {
+                se.dl_deadline = now + se.dl_period;
+                se.dl_budget = se.dl_runtime as i64;
+            }
+        }
+        self.insert_ready(thread);
+    }
+
+    fn pick_next(&mut self) -> Option<Arc<Task>> {
+        self.ready.pop_first().map(|(_, thread)| thread)
+    }
+
+    fn steal(&mut self, _count: usize) -> Vec<Arc<Task>> {
+        Vec::new()
+    }
+
+    fn len(&self) -> usize {
+        self.ready.len()
+    }
+
+    // Enforces the budget of the running thread, and preempts it for a ready thread with an earlier deadline.
+    fn tick(&mut self, current: &Arc<Task>, cycles: u64) -> bool {
+        let se = unsafe { entity(current) };
+        let now = se.exec_start;
+        se.dl_budget -= cycles as i64;
+
+        if se.dl_budget <= 0 {
+            se.dl_throttled = true;
+            return true;
+        }
+        if now >= se.dl_deadline {
+            self.miss(current, now);
+        }
+
+        let deadline = unsafe { entity(current).dl_deadline };
+        self.ready
+            .first_key_value()
+            .map_or(false, |((earliest, _), _)| *earliest < deadline)
+    }
+
+    // Replenishes the throttled threads whose next period has started, and restarts the period of
+    // ready threads whose deadline has passed while they waited.
+    fn timer(&mut self, now: u64) {
+        while let Some(entry) = self.throttled.first_entry() {
+            if entry.key().0 > now {
+                break;
+            }
+            let thread = entry.remove();
+            let se = unsafe { entity(&thread) };
+            se.dl_throttled = false;
+            // An overrun of the last tick is paid from the following periods.
+            while se.dl_budget <= 0 {
+                se.dl_deadline += se.dl_period;
+                se.dl_budget += se.dl_runtime as i64;
+            }
+            if se.dl_deadline <= now {
+                se.dl_deadline = now + se.dl_period;
+            }
+            self.insert_ready(thread);
+        }
+
+        while let Some(entry) = self.ready.first_entry() {
+            if entry.key().0 >= now {
+                break;
+            }
+            let thread = entry.remove();
+            self.miss(&thread, now);
+            self.insert_ready(thread);
+        }
+    }
+
+    fn deadline_misses(&self) -> u64 {
+        self.misses
+    }
+}
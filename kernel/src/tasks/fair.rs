@@ -0,0 +1,135 @@
+use super::{
+    id::Tid,
+    scheduler::{entity, SchedClass, Task, CYCLES_PER_MS},
+    thread::Priority,
+};
+use alloc::{collections::BTreeMap, sync::Arc, vec::Vec};
+
+/// The period in which every ready fair thread of a CPU should get to run once.
+pub const LATENCY_TARGET: u64 = 6 * CYCLES_PER_MS;
+
+/// The shortest slice a fair thread gets, so that a long queue does not make switching dominate.
+/// Once `LATENCY_TARGET` would have to be split into shorter slices, the period grows instead.
+pub const MIN_GRANULARITY: u64 = 3 * CYCLES_PER_MS / 4;
+
+// The weight at which virtual runtime advances at the rate of real runtime.
+const NICE_0_WEIGHT: u64 = 1024;
+
+/// Returns the weight of a thread priority in the fair class. A thread's share of the CPU is its weight
+/// divided by the total weight of the ready threads, so each priority gets four times the share of the next lower one.
+/// `Idle` threads belong to the idle class by default and only get a weight if made fair explicitly.
+pub fn weight(priority: Priority) -> u64 {
+    match priority {
+        Priority::High => 4 * NICE_0_WEIGHT,
+        Priority::Medium => NICE_0_WEIGHT,
+        Priority::Low => NICE_0_WEIGHT / 4,
+        Priority::Idle => NICE_0_WEIGHT / 64,
+    }
+}
+
+/// The fair scheduling class of one CPU, in the style of CFS.
+///
+/// Every thread accumulates virtual runtime: its runtime scaled by `NICE_0_WEIGHT / weight`, so heavier
+/// threads age more slowly. Ready threads are kept in a balanced tree ordered by virtual runtime, and
+/// the thread that has received the least weighted CPU time runs next. The running thread is preempted
+/// once it has used its slice: its weighted share of `LATENCY_TARGET`.
+///
+/// Fields:
+/// - tree: The ready threads, keyed by virtual runtime and thread ID.
+/// - min_vruntime: A monotonic lower bound of the virtual runtimes on the CPU. Waking threads are placed
+///   relative to it, so that a long sleep does not turn into a long monopoly of the CPU.
+/// - load: The total weight of the threads in the tree.
+pub struct FairClass {
+    tree: BTreeMap<(u64, Tid), Arc<Task>>,
+    min_vruntime: u64,
+    load: u64,
+}
+
+impl FairClass {
+    pub const fn new() -> Self {
+        FairClass {
+            tree: BTreeMap::new(),
+            min_vruntime: 0,
+            load: 0,
+        }
+    }
+
+    // Returns the slice of a running thread of the given weight.
+    fn slice(&self, weight: u64) -> u64 {
+        let running = self.tree.len() as u64 + 1;
+        let period = LATENCY_TARGET.max(running * MIN_GRANULARITY);
+        (period * weight / (self.load + weight)).max(MIN_GRANULARITY)
+    }
+
+    // Advances `min_vruntime` towards the smallest virtual runtime on the CPU.
+    fn update_min_vruntime(&mut self, current: u64) {
+        let smallest = match self.tree.first_key_value() {
+            Some(((vruntime, _), _)) => current.min(*vruntime),
+            None => current,
+        };
+        self.min_vruntime = self.min_vruntime.max(smallest);
+    }
+
+    // Removes the weight of a thread that has left the tree from the load.
+    fn unload(&mut self, thread: &Arc<Task>) {
+        self.load -= weight(thread.priority);
+    }
+}
+
+impl SchedClass for FairClass {
+    fn enqueue(&mut self, thread: Arc<Task>, wakeup: bool) {
+        let key = unsafe {
+            let se = entity(&thread);
+            if se.migrated {
+                se.vruntime += self.min_vruntime;
+                se.migrated = false;
+            } else if wakeup {
+                // A thread that slept keeps at most half a period of credit.
+                se.vruntime = se
+                    .vruntime
+                    .max(self.min_vruntime.saturating_sub(LATENCY_TARGET / 2));
+            }
+            self.load += weight(thread.priority);
+            (se.vruntime, thread.tid)
+        };
+        self.tree.insert(key, thread);
+    }
+
+    fn pick_next(&mut self) -> Option<Arc<Task>> {
+        let (_, thread) = self.tree.pop_first()?;
+        self.unload(&thread);
+        Some(thread)
+    }
+
+    // Takes the threads with the largest virtual runtimes, which would have waited longest on this CPU.
+    // Their virtual runtimes are made relative to this CPU's `min_vruntime`, and rebased on the thief's by `enqueue`.
+    fn steal(&mut self, count: usize) -> Vec<Arc<Task>> {
+        let mut stolen = Vec::new();
+        while stolen.len() < count {
+            let Some((_, thread)) = self.tree.pop_last() else {
+                break;
+            };
+            self.unload(&thread);
+            unsafe {
+                let se = entity(&thread);
+                se.vruntime = se.vruntime.saturating_sub(self.min_vruntime);
+                se.migrated = true;
+            }
+            stolen.push(thread);
+        }
+        stolen
+    }
+
+    fn len(&self) -> usize {
+        self.tree.len()
+    }
+
+    fn tick(&mut self, current: &Arc<Task>, cycles: u64) -> bool {
+        let weight = weight(current.priority);
+        let se = unsafe { entity(current) };
+        se.vruntime += cycles * NICE_0_WEIGHT / weight;
+        self.update_min_vruntime(se.vruntime);
+
+        !self.tree.is_empty() && se.slice_runtime >= self.slice(weight)
+    }
+}
@@ -21,8 +21,14 @@ impl IdAllocator<Tid> for Tid {
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
 pub(crate) struct Pid(usize);
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
 pub(crate) struct Tid(usize);
 
+impl Pid {
+    pub fn as_u32(&self) -> u32 {
+        self.0 as u32
+    }
+}
+
 static MAX_PID: AtomicUsize = AtomicUsize::new(1);
 static MAX_TID: AtomicUsize = AtomicUsize::new(1);
@@ -1,20 +1,25 @@
 use crate::{
-    memory::{
-        addr::VirtAddr,
-        paging::{page_table_manager::PageTableManager, table::PageTable, ROOT_PAGE_TABLE},
-    },
-    registers::cr3::Cr3,
-    ALLOCATOR, INITIAL_RSP,
+    cpu::percpu::{online_cpus, MAX_CPUS},
+    memory::{self, addr::VirtAddr, paging::page_table_manager::PageTableManager},
+    println,
+    registers::{cr3::Cr3, rdtsc::Rdtsc},
+    INITIAL_RSP,
 };
 use core::{arch::asm, ptr::copy_nonoverlapping};
-use scheduler::SCHEDULER;
+use scheduler::{scheduler, CYCLES_PER_MS};
 
+pub(crate) mod deadline;
+pub(crate) mod fair;
 pub(crate) mod id;
 pub(crate) mod process;
 pub(crate) mod scheduler;
 pub(crate) mod switch;
 pub(crate) mod thread;
 
+/// The period and the runtime reserved in every period for `stats_thread`.
+pub const STATS_PERIOD_MS: u64 = 1000;
+pub const STATS_RUNTIME_MS: u64 = 10;
+
 pub const KERNEL_STACK_SIZE: usize = 0x2000; // 8 KB
 pub const KERNEL_STACK_START: u64 = 0x000700000000000; // 128 TB
 
@@ -38,19 +43,18 @@ pub const KERNEL_STACK_START: u64 = 0x000700000000000; // 128 TB
 /// https://web.archive.org/web/20160326122214/http://jamesmolloy.co.uk/tutorial_html/9.-Multitasking.html
 pub unsafe fn move_stack(new_stack_start: *mut u8, size: u64) {
     // Initialize the root page table and page table manager.
-    let root_page_table = unsafe { &mut *(ROOT_PAGE_TABLE as *mut PageTable) };
+    let root_page_table = memory::active_level_4_table();
     let mut page_table_manager = PageTableManager::new(root_page_table);
 
     // Frame allocator closure.
     let page_table_manager_clone = page_table_manager.clone();
-    let mut frame_alloc = || page_table_manager_clone.alloc_zeroed_page().0 as *mut PageTable;
+    let mut frame_alloc = || page_table_manager_clone.alloc_zeroed_page().as_mut_ptr();
 
     unsafe {
         // Allocate new stack pages and map them.
         let mut addr = new_stack_start as u64;
         while addr >= (new_stack_start as u64 - size) {
-            let page = ALLOCATOR.alloc_page();
-            let phys_addr = page_table_manager.phys_addr(VirtAddr(page as usize));
+            let phys_addr = memory::alloc_frames(0).expect("Out of physical memory");
 
             page_table_manager.map_memory(
                 VirtAddr(addr as usize),
@@ -103,26 +107,25 @@ pub unsafe fn move_stack(new_stack_start: *mut u8, size: u64) {
 
 /// Schedules the next thread to run by invoking the scheduler's `schedule` method.
 ///
-/// This function checks if the global `SCHEDULER` is initialized. If it is, it
-/// calls the `schedule` method on the scheduler to perform a context switch to the next thread.
+/// This function checks if the scheduler has been published. If it has, it
+/// calls the `schedule` method on the scheduler to perform a context switch to the next thread
+/// of the executing CPU's run queue.
 ///
 /// # Safety
 ///
 /// This function is unsafe because it directly manipulates global state and
 /// performs a context switch, which can have side effects on the entire system.
 pub fn schedule() {
-    unsafe {
-        // Check if the global SCHEDULER is initialized
-        if let Some(scheduler) = SCHEDULER.as_mut() {
-            // Call the schedule method to perform a context switch
-            scheduler.schedule();
-        }
+    // Check if the scheduler has been published
+    if let Some(scheduler) = scheduler() {
+        // Call the schedule method to perform a context switch
+        scheduler.schedule();
     }
 }
 
 /// Retrieves the current page table pointer for the running thread.
 ///
-/// This function checks if the global `SCHEDULER` is initialized. If it is, it
+/// This function checks if the scheduler has been published. If it has, it
 /// retrieves the page table pointer for the currently running thread and returns it as an `Option<u64>`.
 ///
 /// # Returns
@@ -134,18 +137,46 @@ pub fn schedule() {
 /// This function is unsafe because it directly manipulates global state and
 /// accesses the page table pointer of the currently running thread.
 pub fn get_current_page_table() -> Option<u64> {
-    unsafe {
-        // Check if the global SCHEDULER is initialized
-        if let Some(scheduler) = SCHEDULER.as_mut() {
-            // Retrieve the current thread's page table pointer
-            let page_table = scheduler
-                .get_current_thread() // Get the current thread
-                .lock() // Lock the thread for safe access
-                .process // Access the associated process
-                .borrow() // Borrow the process for access
-                .page_table as u64; // Get the page table pointer as u64
-            return Some(page_table);
+    // Check if the scheduler has been published and the CPU has started scheduling
+    let thread = scheduler()?.get_current_thread()?;
+    // Retrieve the current thread's page table pointer
+    let page_table = thread
+        .lock() // Lock the thread for safe access
+        .page_table() as u64; // Get the page table pointer of its process, or the root page table
+    Some(page_table)
+}
+
+/// Prints the run queue length, steals, migrations, the average context switch cost and the missed
+/// deadlines of every online CPU.
+pub fn print_stats() {
+    if let Some(scheduler) = scheduler() {
+        let online = online_cpus();
+        for cpu in (0..MAX_CPUS).filter(|&cpu| online & (1 << cpu) != 0) {
+            let stats = scheduler.stats(cpu);
+            println!(
+                "CPU {} scheduler: {} queued, {} steals, {} migrations, {} switches at {} cycles each, {} deadline misses",
+                cpu,
+                stats.queue_len,
+                stats.steals,
+                stats.migrations,
+                stats.switches,
+                stats.switch_cycles / stats.switches.max(1),
+                stats.deadline_misses
+            );
         }
-        None
+    }
+}
+
+/// The entry point of the thread that reports the scheduler's counters once every `STATS_PERIOD_MS`.
+///
+/// It is meant to run as a deadline thread with a reservation of `STATS_RUNTIME_MS` every period, so the
+/// report keeps its rate however busy the CPUs are, and sleeps from one report to the next.
+pub extern "C" fn stats_thread() {
+    let scheduler = scheduler().expect("Thread runs without a scheduler");
+    let mut release = Rdtsc::read();
+    loop {
+        print_stats();
+        release += STATS_PERIOD_MS * CYCLES_PER_MS;
+        scheduler.block_current(Some(release));
     }
 }
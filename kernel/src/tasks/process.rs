@@ -5,33 +5,56 @@ use super::{
 };
 use crate::{
     gdt::PrivilegeLevel,
-    memory::paging::{page_table_manager::PageTableManager, table::PageTable, ROOT_PAGE_TABLE},
+    memory::{
+        self,
+        addr::ToPhysAddr,
+        paging::{page_table_manager::PageTableManager, pcid, table::PageTable},
+    },
     println,
+    sync::mutex::SpinMutex,
 };
-use alloc::rc::Rc;
+use alloc::sync::Arc;
 use alloc::vec::Vec;
-use core::cell::RefCell;
 
 /// Represents a process in the system, containing a PID, a page table, and a list of threads.
 #[derive(Clone)]
 pub struct Process {
-    pub pid: Pid,                          // Process ID
-    pub page_table: *mut PageTable,        // Pointer to the process's page table
-    pub threads: Vec<Rc<RefCell<Thread>>>, // List of threads belonging to the process
+    pub pid: Pid,                             // Process ID
+    pub page_table: *mut PageTable, // Pointer to the process's page table in the direct map
+    pub pcid: u16, // Process-context identifier tagging the TLB entries of the page table
+    pub threads: Vec<Arc<SpinMutex<Thread>>>, // List of threads belonging to the process
 }
 
+// The page table is owned by the process, and threads on every CPU share the process behind a lock.
+unsafe impl Send for Process {}
+
 impl Process {
-    /// Creates a new process with a unique PID and a cloned root page table.
+    /// Creates a new process with a unique PID and a page table that shares the kernel mappings.
     pub fn new() -> Self {
         Process {
-            pid: Pid::next(),                               // Get the next available PID
-            page_table: unsafe { clone_root_page_table() }, // Clone the root page table
-            threads: Vec::new(),                            // Initialize an empty list of threads
+            pid: Pid::next(),                             // Get the next available PID
+            page_table: unsafe { new_root_page_table() }, // Share the kernel half of the root page table
+            pcid: pcid::alloc(),                          // Tag the process's TLB entries
+            threads: Vec::new(),                          // Initialize an empty list of threads
         }
     }
 
+    /// Loads the process's page table into CR3, keeping the TLB entries of its PCID when they are still valid.
+    pub fn load_address_space(&self) {
+        unsafe {
+            pcid::load(
+                self.page_table.to_phys_addr().0 as u64,
+                self.pcid,
+                self.pid.as_u32(),
+            )
+        };
+    }
+
     /// Creates a new kernel process with the given function and priority.
     ///
+    /// The process gets an address space of its own; use `Thread::new_kernel` for kernel work
+    /// that only needs the kernel mappings.
+    ///
     /// # Arguments
     ///
     /// * `func` - Entry point function for the kernel thread.
@@ -43,11 +66,11 @@ impl Process {
     pub fn create_kernel_process(
         func: extern "C" fn(),
         priority: Priority,
-    ) -> Rc<RefCell<Process>> {
-        let process = Rc::new(RefCell::new(Process::new()));
+    ) -> Arc<SpinMutex<Process>> {
+        let process = Arc::new(SpinMutex::new(Process::new()));
         let thread = Thread::new(
             func as *const usize,   // Set the entry point to the function
-            process.clone(),        // Reference to the process this thread belongs to
+            Some(process.clone()),  // Reference to the process this thread belongs to
             PrivilegeLevel::Kernel, // Kernel privilege level
             priority,               // Thread priority
         );
@@ -59,9 +82,9 @@ impl Process {
 
         // Add the new thread to the process's list of threads
         process
-            .borrow_mut()
+            .lock()
             .threads
-            .push(Rc::new(RefCell::new(thread)));
+            .push(Arc::new(SpinMutex::new(thread)));
 
         process
     }
@@ -75,20 +98,20 @@ impl Process {
     /// # Returns
     ///
     /// A reference-counted pointer to the new process.
-    pub fn create_user_process(priority: Priority) -> Rc<RefCell<Process>> {
-        let process = Rc::new(RefCell::new(Process::new()));
+    pub fn create_user_process(priority: Priority) -> Arc<SpinMutex<Process>> {
+        let process = Arc::new(SpinMutex::new(Process::new()));
         let thread = Thread::new_user(process.clone(), priority);
 
         process
-            .borrow_mut()
+            .lock()
             .threads
-            .push(Rc::new(RefCell::new(thread)));
+            .push(Arc::new(SpinMutex::new(thread)));
 
         process
     }
 }
 
-/// Clones the root page table.
+/// Creates a root page table that references the kernel page tables of the root page table.
 ///
 /// # Safety
 ///
@@ -96,8 +119,7 @@ impl Process {
 ///
 /// # Returns
 ///
-/// A pointer to the cloned page table.
-unsafe fn clone_root_page_table() -> *mut PageTable {
-    let root_page_table = &mut *(ROOT_PAGE_TABLE as *mut PageTable);
-    PageTableManager::clone_pml4(root_page_table as *mut PageTable)
+/// A pointer to the new page table.
+unsafe fn new_root_page_table() -> *mut PageTable {
+    PageTableManager::new_address_space(memory::active_level_4_table())
 }
@@ -1,99 +1,754 @@
 use super::{
-    process::Process,
+    deadline::{self, DeadlineClass},
+    fair::FairClass,
+    id::Tid,
     switch::switch,
-    thread::{Priority, Status, Thread},
+    thread::{Policy, Priority, Status, Thread, PRIORITY_LEVELS},
 };
-use crate::{interrupts::no_interrupts, println, sync::mutex::SpinMutex};
-use alloc::{collections::VecDeque, sync::Arc};
+use crate::{
+    cpu::percpu::{current_cpu, online_cpus, MAX_CPUS},
+    data_types::intrusive_list::{IntrusiveList, Link},
+    interrupts::{no_interrupts, without_interrupts},
+    registers::rdtsc::Rdtsc,
+    sync::mutex::SpinMutex,
+};
+use alloc::{boxed::Box, collections::BTreeMap, sync::Arc, vec, vec::Vec};
+use core::{
+    cell::UnsafeCell,
+    mem::offset_of,
+    ops::Deref,
+    ptr,
+    sync::atomic::{AtomicPtr, AtomicUsize, Ordering},
+};
+
+// The scheduler shared by all CPUs, published once by `init`.
+static SCHEDULER: AtomicPtr<Scheduler> = AtomicPtr::new(ptr::null_mut());
+
+/// Publishes the scheduler to every CPU.
+///
+/// The scheduler is stored with release ordering, so a CPU that finds it through `scheduler` also
+/// sees its run queues fully initialized.
+///
+/// # Panics
+///
+/// Panics if a scheduler has already been published.
+pub fn init(scheduler: Scheduler) -> &'static Scheduler {
+    let scheduler = Box::into_raw(Box::new(scheduler));
+    SCHEDULER
+        .compare_exchange(
+            ptr::null_mut(),
+            scheduler,
+            Ordering::AcqRel,
+            Ordering::Acquire,
+        )
+        .expect("Scheduler already initialized");
+    unsafe { &*scheduler }
+}
+
+/// Returns the scheduler, or `None` before `init` has published it.
+pub fn scheduler() -> Option<&'static Scheduler> {
+    unsafe { SCHEDULER.load(Ordering::Acquire).as_ref() }
+}
+
+/// The TSC cycles per millisecond by which scheduling periods are measured. Like `sleep_for`, this
+/// assumes a 1 GHz TSC until the TSC frequency is calibrated.
+pub const CYCLES_PER_MS: u64 = 1_000_000;
+
+/// Per-CPU scheduling counters.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SchedStats {
+    pub steals: u64,          // Threads this CPU took from the run queues of other CPUs
+    pub migrations: u64,      // Threads that ran on this CPU after last running on another one
+    pub queue_len: usize,     // Threads currently waiting in the CPU's run queue
+    pub switches: u64,        // Context switches performed by the CPU
+    pub switch_cycles: u64, // TSC cycles from entering `schedule` to finishing the switch on the new stack, summed
+    pub deadline_misses: u64, // Deadlines of deadline threads that passed before the thread received its budget
+}
+
+/// The scheduler's bookkeeping for a thread.
+///
+/// The entity belongs to the run queue of the CPU that runs or holds the thread, and is only accessed
+/// under that run queue's lock, without locking the thread.
+///
+/// Fields:
+/// - run_link: The link in a run list of the fixed-priority and idle classes.
+/// - exec_start: The TSC value at which the thread's runtime was last charged.
+/// - slice_runtime: The cycles the thread has run since it was last picked.
+/// - vruntime: The weighted runtime by which the fair class orders its threads.
+/// - migrated: Whether `vruntime` is relative to the run queue the thread was stolen from.
+/// - dl_runtime, dl_period: The reservation of a deadline thread: `dl_runtime` cycles every `dl_period` cycles.
+/// - dl_deadline: The absolute deadline (TSC value) of the deadline thread's current period.
+/// - dl_budget: The cycles left of the current period's runtime; negative after an overrun.
+/// - dl_throttled: Whether the deadline thread has used up its budget and waits for its next period.
+pub struct SchedEntity {
+    pub(super) run_link: Link,
+    pub(super) exec_start: u64,
+    pub(super) slice_runtime: u64,
+    pub(super) vruntime: u64,
+    pub(super) migrated: bool,
+    pub(super) dl_runtime: u64,
+    pub(super) dl_period: u64,
+    pub(super) dl_deadline: u64,
+    pub(super) dl_budget: i64,
+    pub(super) dl_throttled: bool,
+}
+
+impl SchedEntity {
+    pub const fn new() -> Self {
+        SchedEntity {
+            run_link: Link::new(),
+            exec_start: 0,
+            slice_runtime: 0,
+            vruntime: 0,
+            migrated: false,
+            dl_runtime: 0,
+            dl_period: 0,
+            dl_deadline: 0,
+            dl_budget: 0,
+            dl_throttled: false,
+        }
+    }
+}
+
+/// A thread as the scheduler holds it.
+///
+/// The thread itself is behind its own lock. The scheduler's `SchedEntity` is kept outside of that lock,
+/// so that a run queue can update it, and relink the neighbours of a thread in a run list, while another
+/// CPU holds the lock of the same thread. The scheduling parameters are fixed when the thread is handed
+/// to the scheduler, so the classes read them without locking the thread either.
+///
+/// Fields:
+/// - tid, priority, policy: Copies of the thread's ID, priority and policy.
+/// - sched: The scheduler's bookkeeping, owned by the run queue of the thread's CPU.
+/// - thread: The thread.
+pub struct Task {
+    pub(super) tid: Tid,
+    pub(super) priority: Priority,
+    pub(super) policy: Policy,
+    sched: UnsafeCell<SchedEntity>,
+    thread: SpinMutex<Thread>,
+}
+
+// The entity is only accessed under the lock of the run queue that owns it, and the thread under its own lock.
+unsafe impl Send for Task {}
+unsafe impl Sync for Task {}
+
+impl Task {
+    fn new(thread: Thread) -> Self {
+        Task {
+            tid: thread.tid,
+            priority: thread.priority,
+            policy: thread.policy,
+            sched: UnsafeCell::new(SchedEntity::new()),
+            thread: SpinMutex::new(thread),
+        }
+    }
+}
+
+impl Deref for Task {
+    type Target = SpinMutex<Thread>;
+
+    fn deref(&self) -> &Self::Target {
+        &self.thread
+    }
+}
+
+/// Returns the scheduler entity of a thread.
+///
+/// # Safety
+///
+/// The caller must hold the lock of the run queue that owns the entity, or own the only handle of the thread.
+pub(super) unsafe fn entity(thread: &Arc<Task>) -> &mut SchedEntity {
+    &mut *thread.sched.get()
+}
+
+/// A scheduling class: the policy that orders the ready threads of one CPU.
+///
+/// Every run queue has one instance of each class, consulted in the order of `Policy`: a ready thread of
+/// an earlier class always runs before the threads of later classes. A class owns the handles of the
+/// threads queued in it and may keep its per-thread state in their `SchedEntity`. All methods are called
+/// with the run queue locked.
+pub trait SchedClass {
+    /// Queues a ready thread. `wakeup` is set for a thread that is new or was blocked,
+    /// and clear for a thread that was preempted or stolen.
+    fn enqueue(&mut self, thread: Arc<Task>, wakeup: bool);
+
+    /// Takes the thread that should run next, if the class has a ready thread.
+    fn pick_next(&mut self) -> Option<Arc<Task>>;
+
+    /// Takes up to `count` ready threads for another CPU to run.
+    fn steal(&mut self, count: usize) -> Vec<Arc<Task>>;
+
+    /// Returns the number of queued threads.
+    fn len(&self) -> usize;
+
+    /// Charges `cycles` of CPU time to the running thread `current` of this class.
+    ///
+    /// # Returns
+    ///
+    /// `true` if `current` should give up the CPU to a queued thread of the class.
+    fn tick(&mut self, current: &Arc<Task>, cycles: u64) -> bool;
+
+    /// Called on every scheduling tick of the CPU with the current TSC value, before the running thread is charged.
+    fn timer(&mut self, _now: u64) {}
+
+    /// Returns the number of deadlines the threads of the class have missed on this CPU.
+    fn deadline_misses(&self) -> u64 {
+        0
+    }
+}
+
+/// The fixed-priority scheduling class: strict priority, round-robin within a priority.
+///
+/// Ready threads are linked into one intrusive run list per priority through the `run_link` of their
+/// entity, and `ready_mask` has a bit set for every non-empty list, so picking the next thread is a bit
+/// scan and a list pop. A queued thread is held by the reference of its `Arc` that was turned into a raw
+/// pointer on enqueue.
+///
+/// A second instance is the idle class, consulted after every other class; it only holds `Idle` threads,
+/// which take turns on every tick.
+pub struct PriorityClass {
+    run_lists: [IntrusiveList; PRIORITY_LEVELS],
+    ready_mask: u32, // Bit `p` is set if `run_lists[p]` is not empty
+    len: usize,
+}
+
+impl PriorityClass {
+    pub const fn new() -> Self {
+        PriorityClass {
+            run_lists: [IntrusiveList::new(); PRIORITY_LEVELS],
+            ready_mask: 0,
+            len: 0,
+        }
+    }
+
+    // Returns the highest priority that has a queued thread.
+    fn best_priority(&self) -> Option<usize> {
+        match self.ready_mask {
+            0 => None,
+            mask => Some(mask.trailing_zeros() as usize),
+        }
+    }
+
+    // Takes back the reference of a thread whose run link has just been removed from a run list.
+    unsafe fn unlinked(&mut self, link: *mut Link) -> Arc<Task> {
+        let sched = (link as *mut u8).sub(offset_of!(SchedEntity, run_link));
+        let task = sched.sub(offset_of!(Task, sched)) as *const Task;
+        self.len -= 1;
+        Arc::from_raw(task)
+    }
+}
+
+impl SchedClass for PriorityClass {
+    // Links a ready thread to the back of the run list of its priority.
+    fn enqueue(&mut self, thread: Arc<Task>, _wakeup: bool) {
+        let prio = thread.priority as usize;
+        unsafe {
+            let task = Arc::into_raw(thread);
+            self.run_lists[prio].push_back(ptr::addr_of_mut!((*(*task).sched.get()).run_link));
+        }
+        self.ready_mask |= 1 << prio;
+        self.len += 1;
+    }
+
+    // Takes the first thread of the highest non-empty priority.
+    fn pick_next(&mut self) -> Option<Arc<Task>> {
+        let prio = self.best_priority()?;
+        let link = self.run_lists[prio].pop()?;
+        if self.run_lists[prio].is_empty() {
+            self.ready_mask &= !(1 << prio);
+        }
+        Some(unsafe { self.unlinked(link) })
+    }
+
+    // Takes threads highest priority first. The owner pops from the front of its run lists,
+    // so the threads are taken from the back, like a thief in a Chase-Lev deque.
+    fn steal(&mut self, count: usize) -> Vec<Arc<Task>> {
+        let mut stolen = Vec::new();
+        for prio in 0..PRIORITY_LEVELS {
+            while stolen.len() < count {
+                match self.run_lists[prio].pop_back() {
+                    Some(link) => stolen.push(unsafe { self.unlinked(link) }),
+                    None => break,
+                }
+            }
+            if self.run_lists[prio].is_empty() {
+                self.ready_mask &= !(1 << prio);
+            }
+        }
+        stolen
+    }
+
+    fn len(&self) -> usize {
+        self.len
+    }
+
+    // Threads of equal priority take turns on every tick.
+    fn tick(&mut self, current: &Arc<Task>, _cycles: u64) -> bool {
+        let prio = current.priority as usize;
+        self.best_priority().map_or(false, |best| best <= prio)
+    }
+}
+
+/// The run queue of a single CPU.
+///
+/// Fields:
+/// - current_thread: The thread the CPU is running, or its idle thread; `None` until the CPU has started scheduling.
+/// - idle_thread: The thread that stands for the CPU's boot context; it runs when nothing else is ready
+///   and is never queued. It is created by `Scheduler::start_cpu`.
+/// - prev_thread: The thread the CPU is switching away from. Its registers are only saved once `switch`
+///   has left its stack, so it is queued again by `finish_switch` rather than by `schedule`.
+/// - classes: The scheduling classes, indexed by `Policy`.
+/// - sleepers: The threads blocked with a timeout on this CPU, keyed by the TSC value at which they are woken.
+/// - deadline_bw: The CPU bandwidth reserved by the deadline threads admitted to this CPU.
+/// - switch_start: The TSC value at the start of the context switch in progress.
+/// - stats: The counters reported by `Scheduler::stats`.
+struct RunQueue {
+    current_thread: Option<Arc<Task>>,
+    idle_thread: Option<Arc<Task>>,
+    prev_thread: Option<Arc<Task>>,
+    classes: Vec<Box<dyn SchedClass>>,
+    sleepers: BTreeMap<(u64, Tid), Arc<Task>>,
+    deadline_bw: u64,
+    switch_start: u64,
+    stats: SchedStats,
+}
+
+impl RunQueue {
+    fn new() -> Self {
+        RunQueue {
+            current_thread: None,
+            idle_thread: None,
+            prev_thread: None,
+            classes: vec![
+                Box::new(DeadlineClass::new()),
+                Box::new(PriorityClass::new()),
+                Box::new(FairClass::new()),
+                Box::new(PriorityClass::new()),
+            ],
+            sleepers: BTreeMap::new(),
+            deadline_bw: 0,
+            switch_start: 0,
+            stats: SchedStats::default(),
+        }
+    }
+
+    // Queues a ready thread in the class of its policy.
+    fn push(&mut self, thread: Arc<Task>, wakeup: bool) {
+        let policy = thread.policy;
+        self.classes[policy as usize].enqueue(thread, wakeup);
+        self.update_len();
+    }
+
+    // Takes the next thread of the first class that has a ready thread.
+    fn pop_next(&mut self) -> Option<Arc<Task>> {
+        let thread = self
+            .classes
+            .iter_mut()
+            .find_map(|class| class.pick_next())?;
+        self.update_len();
+        Some(thread)
+    }
 
-pub static mut SCHEDULER: Option<Scheduler> = None;
+    // Takes half of the queued threads, from the first classes first.
+    fn take_half(&mut self) -> Vec<Arc<Task>> {
+        let count = (self.stats.queue_len + 1) / 2;
+        let mut stolen = Vec::with_capacity(count);
+        for class in self.classes.iter_mut() {
+            stolen.extend(class.steal(count - stolen.len()));
+        }
+        self.update_len();
+        stolen
+    }
+
+    // Counts the threads that are ready to run; throttled deadline threads are not.
+    fn update_len(&mut self) {
+        self.stats.queue_len = self.classes.iter().map(|class| class.len()).sum();
+    }
+
+    // Returns whether a class consulted before `policy` has a ready thread.
+    fn earlier_class_ready(&self, policy: Policy) -> bool {
+        self.classes[..policy as usize]
+            .iter()
+            .any(|class| class.len() > 0)
+    }
 
-extern "C" fn idle_thread() {
-    loop {
-        println!("Idle thread running");
+    fn is_idle(&self, thread: &Arc<Task>) -> bool {
+        self.idle_thread
+            .as_ref()
+            .map_or(false, |idle| Arc::ptr_eq(thread, idle))
     }
 }
 
+/// A scheduler with one run queue per CPU.
+///
+/// Every CPU picks threads from its own queue, so scheduling decisions on different CPUs do not contend.
+/// Within a queue, threads are ordered by the scheduling class of their policy.
+/// A CPU only takes part once it has called `start_cpu`.
+/// A CPU that runs out of work steals half of the longest queue of its peers. A woken thread is queued
+/// on the CPU it last ran on, where its working set is most likely still cached.
+///
+/// Only ready threads are queued. A thread blocks only while it runs (`block_current`), and is queued
+/// again once it is woken and its registers are saved, so the classes never hold a blocked thread and
+/// need no way to unlink one from the middle of their queues. A thread that blocks with a timeout is
+/// kept with the sleepers of its CPU instead, which `schedule` wakes on the first tick after the timeout.
+///
+/// Run queues are locked before threads. Run queue locks are only taken with interrupts disabled,
+/// so that the timer interrupt cannot spin on a lock held by the code it interrupted.
 pub struct Scheduler {
-    current_thread: Arc<SpinMutex<Thread>>,
-    idle_thread: Arc<SpinMutex<Thread>>,
-    ready_queue: [VecDeque<Arc<SpinMutex<Thread>>>; 4],
+    run_queues: [SpinMutex<RunQueue>; MAX_CPUS],
+    queue_lens: [AtomicUsize; MAX_CPUS], // Mirrors the queue lengths, so that a thief can pick a victim without locking
 }
 
 impl Scheduler {
-    /// Creates a new Scheduler instance with an idle thread.
+    /// Creates a new Scheduler instance with an empty run queue for every CPU.
     pub fn new() -> Self {
-        let idle_process = Process::create_kernel_process(idle_thread, Priority::Idle);
-        let idle_thread = Arc::new(SpinMutex::new(
-            idle_process.borrow().threads[0].borrow().clone(),
-        ));
-        let mut ready_queue: [VecDeque<Arc<SpinMutex<Thread>>>; 4] = Default::default();
-        ready_queue[Priority::Idle as usize].push_back(idle_thread.clone());
-
         Scheduler {
-            current_thread: idle_thread.clone(),
-            idle_thread: idle_thread.clone(),
-            ready_queue,
+            run_queues: core::array::from_fn(|_| SpinMutex::new(RunQueue::new())),
+            queue_lens: [const { AtomicUsize::new(0) }; MAX_CPUS],
+        }
+    }
+
+    /// Starts scheduling threads on the executing CPU, called once by every CPU when it comes online.
+    ///
+    /// The context the CPU runs in becomes its idle thread, so no stack is allocated for it: the CPU
+    /// returns to that context whenever no thread is ready. Until then, `schedule` leaves the CPU alone.
+    pub fn start_cpu(&self) {
+        let idle_thread = Arc::new(Task::new(Thread::new_idle()));
+        without_interrupts(|| {
+            let mut rq = self.run_queues[current_cpu()].lock();
+            assert!(rq.idle_thread.is_none(), "CPU already started scheduling");
+            rq.current_thread = Some(idle_thread.clone());
+            rq.idle_thread = Some(idle_thread);
+        });
+    }
+
+    /// Adds a new thread to the ready queue of the executing CPU.
+    ///
+    /// # Returns
+    ///
+    /// The shared handle of the thread, e.g. to wake it after it has blocked.
+    pub fn add_thread(&self, mut thread: Thread) -> Arc<Task> {
+        let cpu = current_cpu();
+        thread.last_cpu = cpu;
+        let thread = Arc::new(Task::new(thread));
+        self.enqueue(cpu, thread.clone());
+        thread
+    }
+
+    /// Admits a thread to the deadline class with a reservation of `runtime` cycles every `period` cycles
+    /// (see `CYCLES_PER_MS`), and queues it on the online CPU with the most unreserved bandwidth.
+    ///
+    /// The reservation is released when the thread exits.
+    ///
+    /// # Returns
+    ///
+    /// The shared handle of the thread, or the thread itself if the reservation is invalid or no CPU has
+    /// enough unreserved bandwidth left for it.
+    pub fn add_deadline_thread(
+        &self,
+        thread: Thread,
+        runtime: u64,
+        period: u64,
+    ) -> Result<Arc<Task>, Thread> {
+        if runtime == 0 || runtime > period {
+            return Err(thread);
+        }
+        let bw = deadline::bandwidth(runtime, period);
+
+        without_interrupts(|| {
+            let online = online_cpus();
+            let cpu = (0..MAX_CPUS)
+                .filter(|&cpu| online & (1 << cpu) != 0)
+                .min_by_key(|&cpu| self.run_queues[cpu].lock().deadline_bw)
+                .unwrap_or(current_cpu());
+
+            let mut rq = self.run_queues[cpu].lock();
+            if rq.deadline_bw + bw > deadline::BW_LIMIT {
+                return Err(thread);
+            }
+            rq.deadline_bw += bw;
+
+            let mut thread = thread.with_policy(Policy::Deadline);
+            thread.last_cpu = cpu;
+            let thread = Arc::new(Task::new(thread));
+            unsafe {
+                let se = entity(&thread);
+                se.dl_runtime = runtime;
+                se.dl_period = period;
+            }
+            rq.push(thread.clone(), true);
+            self.queue_lens[cpu].store(rq.stats.queue_len, Ordering::Relaxed);
+            Ok(thread)
+        })
+    }
+
+    /// Makes a blocked thread ready and queues it on the CPU it last ran on.
+    ///
+    /// A thread that is still being switched away from is queued by `finish_switch` instead.
+    pub fn wake_thread(&self, thread: &Arc<Task>) {
+        let (cpu, on_cpu) = {
+            let mut locked = thread.lock();
+            if locked.status != Status::Blocked {
+                return;
+            }
+            locked.status = Status::Ready;
+            (locked.last_cpu, locked.on_cpu)
+        };
+
+        if !on_cpu {
+            self.enqueue(cpu, thread.clone());
         }
     }
 
-    /// Adds a new thread to the scheduler's ready queue.
-    pub fn add_thread(&mut self, thread: Thread) {
-        let prio = thread.priority;
-        let thread = Arc::new(SpinMutex::new(thread));
-        self.ready_queue[prio as usize].push_back(thread);
+    /// Blocks the current thread until `wake_thread` is called for it, and switches to the next thread.
+    ///
+    /// # Arguments
+    ///
+    /// * `timeout` - The TSC value at which the thread is woken if `wake_thread` has not been called by then.
+    ///   A thread woken early may still be woken by its timeout after it has blocked again, so the caller
+    ///   must check for the event it waits for.
+    pub fn block_current(&self, timeout: Option<u64>) {
+        no_interrupts(|| {
+            if let Some(current) = self.get_current_thread() {
+                current.lock().status = Status::Blocked;
+                if let Some(timeout) = timeout {
+                    let mut rq = self.run_queues[current_cpu()].lock();
+                    rq.sleepers.insert((timeout, current.tid), current);
+                }
+                self.schedule();
+            }
+        });
     }
 
-    /// Returns the current thread being executed.
-    pub fn get_current_thread(&self) -> Arc<SpinMutex<Thread>> {
-        self.current_thread.clone()
+    /// Terminates the current thread and switches to the next thread.
+    ///
+    /// The thread is dropped once the switch away from it is complete, and the bandwidth of a deadline
+    /// thread is returned to its CPU then.
+    pub fn exit_current(&self) -> ! {
+        no_interrupts(|| {
+            if let Some(current) = self.get_current_thread() {
+                current.lock().status = Status::Terminated;
+                self.schedule();
+            }
+        });
+        unreachable!("Terminated thread was scheduled again");
     }
 
-    /// Schedules the next thread to run.
-    pub fn schedule(&mut self) {
+    /// Returns the thread the executing CPU is running, or `None` if the CPU has not started scheduling.
+    pub fn get_current_thread(&self) -> Option<Arc<Task>> {
+        without_interrupts(|| self.run_queues[current_cpu()].lock().current_thread.clone())
+    }
+
+    /// Returns the scheduling counters of a CPU.
+    pub fn stats(&self, cpu: usize) -> SchedStats {
+        without_interrupts(|| {
+            let rq = self.run_queues[cpu].lock();
+            let mut stats = rq.stats;
+            stats.deadline_misses = rq.classes.iter().map(|class| class.deadline_misses()).sum();
+            stats
+        })
+    }
+
+    /// Schedules the next thread to run on the executing CPU. Must be called with interrupts disabled.
+    ///
+    /// The runtime of the current thread is charged to its scheduling class. The thread keeps the CPU
+    /// unless it stopped running, a thread of an earlier class is ready, or its own class wants to
+    /// preempt it. Sleepers whose timeout has passed are woken first, and a CPU without queued threads
+    /// then tries to steal from its peers.
+    pub fn schedule(&self) {
+        let now = Rdtsc::read();
+        let cpu = current_cpu();
+        self.wake_sleepers(cpu, now);
+
+        let out_of_work = {
+            let rq = self.run_queues[cpu].lock();
+            let current = match &rq.current_thread {
+                Some(current) => current,
+                None => return,
+            };
+            rq.stats.queue_len == 0
+                && (rq.is_idle(current) || current.lock().status != Status::Running)
+        };
+        if out_of_work {
+            self.steal(cpu);
+        }
+
+        let mut rq = self.run_queues[cpu].lock();
+        for class in rq.classes.iter_mut() {
+            class.timer(now);
+        }
+        rq.update_len();
+
+        let current = rq.current_thread.clone().unwrap();
+        let is_idle = rq.is_idle(&current);
+
         // Get current thread info
-        let (mut current_sp, current_prio, current_status) = {
-            let locked = self.current_thread.lock();
-            (locked.stack_pointer, locked.priority, locked.status)
+        let (current_sp, current_running) = {
+            let mut locked = current.lock();
+            (
+                &mut locked.stack_pointer as *mut u64,
+                locked.status == Status::Running || is_idle,
+            )
+        };
+
+        // Charge the runtime of the current thread and decide whether it keeps the CPU
+        let preempt = if is_idle {
+            rq.stats.queue_len > 0
+        } else {
+            let cycles = unsafe {
+                let se = entity(&current);
+                let cycles = now - se.exec_start;
+                se.exec_start = now;
+                se.slice_runtime += cycles;
+                cycles
+            };
+            let expired = rq.classes[current.policy as usize].tick(&current, cycles);
+            !current_running || expired || rq.earlier_class_ready(current.policy)
         };
+        if !preempt {
+            return;
+        }
+
+        // A throttled deadline thread must leave the CPU even if nothing else is ready
+        let throttled = !is_idle && unsafe { entity(&current).dl_throttled };
 
         // Get the next thread to run
-        let next_thread = self.get_next_thread();
-        let next_sp = {
+        let next_thread = match rq.pop_next() {
+            Some(thread) => thread,
+            None if current_running && !throttled => return,
+            None => rq.idle_thread.clone().unwrap(),
+        };
+        self.queue_lens[cpu].store(rq.stats.queue_len, Ordering::Relaxed);
+
+        let next_sp = unsafe {
+            let se = entity(&next_thread);
+            se.exec_start = now;
+            se.slice_runtime = 0;
+
             let mut next_locked = next_thread.lock();
+            debug_assert_eq!(
+                next_locked.status,
+                Status::Ready,
+                "Queued thread is not ready"
+            );
+            if next_locked.last_cpu != cpu {
+                next_locked.last_cpu = cpu;
+                rq.stats.migrations += 1;
+            }
             next_locked.status = Status::Running;
+            next_locked.on_cpu = true;
             next_locked.stack_pointer
         };
 
-        // Update the current thread status and move it to the ready queue if it was running
-        if current_status == Status::Running {
-            {
-                let mut current_locked = self.current_thread.lock();
-                current_locked.status = Status::Ready;
-            }
-            self.ready_queue[current_prio as usize].push_back(self.current_thread.clone());
+        // The current thread goes back to its class once its registers are saved
+        if current_running {
+            current.lock().status = Status::Ready;
         }
+        rq.prev_thread = Some(current);
 
         // Switch to the next thread
-        self.current_thread = Arc::clone(&next_thread);
+        rq.current_thread = Some(next_thread);
+        rq.switch_start = now;
+        drop(rq);
+
+        unsafe { switch(&mut *current_sp, &next_sp) };
+    }
+
+    /// Completes a context switch on the stack of the new thread.
+    ///
+    /// The previous thread's registers have been saved by now, so it may be queued again and run on any CPU.
+    /// The cycles the switch took are added to the CPU's `switch_cycles`.
+    pub fn finish_switch(&self) {
+        let cpu = current_cpu();
+        let mut rq = self.run_queues[cpu].lock();
 
-        switch(&mut current_sp, &next_sp);
+        if let Some(prev) = rq.prev_thread.take() {
+            rq.stats.switches += 1;
+            rq.stats.switch_cycles += Rdtsc::read() - rq.switch_start;
+
+            let status = {
+                let mut locked = prev.lock();
+                locked.on_cpu = false;
+                locked.status
+            };
+            match status {
+                Status::Ready if !rq.is_idle(&prev) => {
+                    rq.push(prev, false);
+                    self.queue_lens[cpu].store(rq.stats.queue_len, Ordering::Relaxed);
+                }
+                // Deadline threads only run on the CPU they were admitted to
+                Status::Terminated if prev.policy == Policy::Deadline => {
+                    let se = unsafe { entity(&prev) };
+                    rq.deadline_bw -= deadline::bandwidth(se.dl_runtime, se.dl_period);
+                }
+                _ => {}
+            }
+        }
     }
 
     /// Reschedules the next thread to run, disabling interrupts during the operation.
-    pub fn reschedule(&mut self) {
+    pub fn reschedule(&self) {
         no_interrupts(|| self.schedule());
     }
 
-    /// Returns the next thread to be scheduled, based on priority and status.
-    fn get_next_thread(&mut self) -> Arc<SpinMutex<Thread>> {
-        for prio in 0..self.ready_queue.len() {
-            while let Some(thread) = self.ready_queue[prio].pop_front() {
-                if thread.lock().status == Status::Ready {
-                    return thread.clone();
+    // Wakes the sleepers of `cpu` whose timeout has passed by `now`.
+    fn wake_sleepers(&self, cpu: usize, now: u64) {
+        let mut woken = Vec::new();
+        {
+            let mut rq = self.run_queues[cpu].lock();
+            while let Some(entry) = rq.sleepers.first_entry() {
+                if entry.key().0 > now {
+                    break;
                 }
+                woken.push(entry.remove());
+            }
+        }
+        for thread in woken {
+            self.wake_thread(&thread);
+        }
+    }
+
+    // Queues a new or woken thread on a CPU.
+    fn enqueue(&self, cpu: usize, thread: Arc<Task>) {
+        without_interrupts(|| {
+            let mut rq = self.run_queues[cpu].lock();
+            rq.push(thread, true);
+            self.queue_lens[cpu].store(rq.stats.queue_len, Ordering::Relaxed);
+        });
+    }
+
+    // Moves half of the longest run queue of the other online CPUs to the queue of `cpu`.
+    // Only one run queue is locked at a time, and a peer whose queue is locked is left alone
+    // until the next tick, so thieves never wait for each other.
+    fn steal(&self, cpu: usize) {
+        let online = online_cpus();
+        let victim = (0..MAX_CPUS)
+            .filter(|&peer| peer != cpu && online & (1 << peer) != 0)
+            .max_by_key(|&peer| self.queue_lens[peer].load(Ordering::Relaxed));
+
+        let victim = match victim {
+            Some(victim) if self.queue_lens[victim].load(Ordering::Relaxed) > 0 => victim,
+            _ => return,
+        };
+
+        let stolen = match self.run_queues[victim].try_lock() {
+            Some(mut peer) => {
+                let stolen = peer.take_half();
+                self.queue_lens[victim].store(peer.stats.queue_len, Ordering::Relaxed);
+                stolen
             }
+            None => return,
+        };
+        if stolen.is_empty() {
+            return;
+        }
+
+        let mut rq = self.run_queues[cpu].lock();
+        rq.stats.steals += stolen.len() as u64;
+        for thread in stolen {
+            rq.push(thread, false);
         }
-        self.idle_thread.clone()
+        self.queue_lens[cpu].store(rq.stats.queue_len, Ordering::Relaxed);
     }
 }
@@ -1,5 +1,8 @@
-use super::get_current_page_table;
-use crate::registers::cr3::Cr3;
+use super::scheduler::scheduler;
+use crate::{
+    memory::{addr::ToPhysAddr, PAGE_SIZE},
+    registers::cr3::Cr3,
+};
 use core::arch::asm;
 
 /// Switches the current task to a new task by saving the state of the current task
@@ -101,10 +104,23 @@ pub extern "C" fn start_thread(stack_pointer: u64) {
 
 /// This function sets the CR3 register to the current page table.
 /// It is used during the context switch to update the page table
-/// for the new task.
+/// for the new task. The write is tagged with the process's PCID, so the kernel's
+/// global entries and the warm entries of other processes stay in the TLB.
+/// It is skipped when the new task runs on the page table that is already loaded,
+/// such as another thread of the same process or a kernel thread after a kernel thread.
+///
+/// It runs after the registers of the previous task have been saved, so it also hands the previous
+/// task back to the scheduler, which may then run it on another CPU.
 #[no_mangle]
 pub unsafe extern "C" fn set_cr3() {
-    if let Some(page_table) = get_current_page_table() {
-        Cr3::write(page_table);
+    if let Some(scheduler) = scheduler() {
+        scheduler.finish_switch();
+
+        let thread = scheduler.get_current_thread().unwrap();
+        let thread = thread.lock();
+
+        if Cr3::read() & !(PAGE_SIZE - 1) != thread.page_table().to_phys_addr().0 {
+            thread.load_address_space();
+        }
     }
 }
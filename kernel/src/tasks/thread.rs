@@ -3,18 +3,23 @@ use super::{
     process::Process,
 };
 use crate::{
+    cpu::percpu::current_cpu,
     gdt::PrivilegeLevel,
     memory::{
-        addr::{PhysAddr, VirtAddr},
-        paging::{page_table_manager::PageTableManager, table::PageTable},
+        self,
+        paging::{
+            page_table_manager::PageTableManager,
+            pcid::{self, KERNEL_PCID},
+            table::PageTable,
+            ROOT_PAGE_TABLE, USER_SPACE_START,
+        },
     },
     print, println,
-    registers::cr3::Cr3,
-    tasks::switch::start_thread,
-    ALLOCATOR,
+    sync::mutex::SpinMutex,
+    tasks::{scheduler::scheduler, switch::start_thread},
 };
-use alloc::rc::Rc;
-use core::{cell::RefCell, mem::size_of, ptr::copy_nonoverlapping};
+use alloc::sync::Arc;
+use core::{mem::size_of, ptr::copy_nonoverlapping};
 
 /// Represents the CPU state for a thread, to be saved and restored during context switches.
 #[derive(Default)]
@@ -42,6 +47,9 @@ pub struct State {
     ss: u64,     // Stack segment
 }
 
+/// The number of thread priority levels.
+pub const PRIORITY_LEVELS: usize = 4;
+
 /// Enum representing the priority levels of a thread. Lower values indicate higher priority.
 #[derive(PartialEq, Eq, PartialOrd, Ord, Clone, Copy)]
 pub enum Priority {
@@ -51,6 +59,26 @@ pub enum Priority {
     Idle = 3,
 }
 
+/// Enum representing the scheduling class of a thread, in the order the classes are consulted.
+#[derive(PartialEq, Eq, Clone, Copy, Debug)]
+pub enum Policy {
+    Deadline = 0,      // Earliest deadline first within an admitted CPU reservation
+    FixedPriority = 1, // Strict priority, round-robin within a priority
+    Fair = 2,          // A share of the CPU weighted by priority
+    Idle = 3,          // Only when no thread of another class is ready, round-robin
+}
+
+impl Policy {
+    /// Returns the default policy of a thread of the given priority: `Idle` threads go to the idle class,
+    /// so that they never take a share of the CPU from ready fair threads, and all others are fair.
+    pub fn for_priority(priority: Priority) -> Self {
+        match priority {
+            Priority::Idle => Policy::Idle,
+            _ => Policy::Fair,
+        }
+    }
+}
+
 /// Enum representing the possible statuses of a thread.
 #[derive(PartialEq, Eq, Clone, Copy, Debug)]
 pub enum Status {
@@ -61,13 +89,18 @@ pub enum Status {
 }
 
 /// Represents a thread in the system, including its ID, process, stack pointer, priority, and status.
+///
+/// Kernel threads belong to no process and run on the root page table.
 #[derive(Clone)]
 pub struct Thread {
-    pub tid: Tid,                      // Thread ID
-    pub process: Rc<RefCell<Process>>, // Process the thread belongs to
-    pub stack_pointer: u64,            // Stack pointer
-    pub priority: Priority,            // Thread priority
-    pub status: Status,                // Current status of the thread
+    pub tid: Tid,                                 // Thread ID
+    pub process: Option<Arc<SpinMutex<Process>>>, // Process the thread belongs to, or None for a kernel thread
+    pub stack_pointer: u64,                       // Stack pointer
+    pub priority: Priority,                       // Thread priority
+    pub status: Status,                           // Current status of the thread
+    pub last_cpu: usize, // CPU the thread last ran on, whose run queue it joins when woken
+    pub on_cpu: bool,    // Whether a CPU runs the thread or has yet to save its registers
+    pub policy: Policy,  // Scheduling class of the thread
 }
 
 // Define the opcode for an infinite loop instruction.
@@ -89,12 +122,12 @@ impl Thread {
     /// # Arguments
     ///
     /// * `entry_point` - The entry point of the thread (function to start execution).
-    /// * `process` - Reference to the process this thread belongs to.
+    /// * `process` - Reference to the process this thread belongs to, or None for a kernel thread.
     /// * `privilege_level` - Privilege level of the thread (Kernel/User).
     /// * `priority` - Priority of the thread.
     pub(super) fn new(
         entry_point: *const usize,
-        process: Rc<RefCell<Process>>,
+        process: Option<Arc<SpinMutex<Process>>>,
         privilege_level: PrivilegeLevel,
         priority: Priority,
     ) -> Self {
@@ -117,6 +150,9 @@ impl Thread {
                 stack_pointer: stack as u64,
                 priority,
                 status: Status::Ready, // Set the initial status to Ready
+                last_cpu: current_cpu(),
+                on_cpu: false,
+                policy: Policy::for_priority(priority),
             }
         }
     }
@@ -127,29 +163,83 @@ impl Thread {
     ///
     /// * `process` - Reference to the process this thread belongs to.
     /// * `priority` - Priority of the thread.
-    pub fn new_user(process: Rc<RefCell<Process>>, priority: Priority) -> Self {
+    pub fn new_user(process: Arc<SpinMutex<Process>>, priority: Priority) -> Self {
         // Set the entry point to an infinite loop (halts the CPU when thread finishes)
         let entry_point = unsafe {
             let code = INFINITE_LOOP.as_ptr() as *const usize;
             let size = INFINITE_LOOP.len();
-            Self::map_user_memory(process.borrow().page_table, code, size)
+            Self::map_user_memory(process.lock().page_table, code, size)
         };
 
         // println!("Entry point: {:#x}", entry_point);
 
         Self::new(
             entry_point as *const usize,
-            process,
+            Some(process),
             PrivilegeLevel::User,
             priority,
         )
     }
 
+    /// Creates a new kernel thread that runs on the root page table without a process.
+    ///
+    /// Switching between kernel threads, or from a thread of any process to a kernel thread and back,
+    /// does not need to build or load an address space of its own.
+    ///
+    /// # Arguments
+    ///
+    /// * `func` - Entry point function for the kernel thread.
+    /// * `priority` - Priority of the kernel thread.
+    pub fn new_kernel(func: extern "C" fn(), priority: Priority) -> Self {
+        Self::new(func as *const usize, None, PrivilegeLevel::Kernel, priority)
+    }
+
+    /// Creates the idle thread of the executing CPU, which stands for the context the CPU was started in.
+    ///
+    /// The thread has no stack of its own: it runs on the boot stack of the CPU, and its stack pointer is
+    /// only filled in when a switch away from it saves the registers. It is running from the start.
+    pub fn new_idle() -> Self {
+        Thread {
+            tid: Tid::next(),
+            process: None,
+            stack_pointer: 0,
+            priority: Priority::Idle,
+            status: Status::Running,
+            last_cpu: current_cpu(),
+            on_cpu: true,
+            policy: Policy::Idle,
+        }
+    }
+
+    /// Returns the thread with another scheduling policy than the default of its priority, e.g.
+    /// `Policy::FixedPriority` for a thread that must run before every fair thread.
+    ///
+    /// The policy is fixed once the thread is handed to the scheduler.
+    pub fn with_policy(mut self, policy: Policy) -> Self {
+        self.policy = policy;
+        self
+    }
+
+    /// Returns the page table the thread runs on: its process's page table, or the root page table for a kernel thread.
+    pub fn page_table(&self) -> *mut PageTable {
+        match &self.process {
+            Some(process) => process.lock().page_table,
+            None => memory::active_level_4_table(),
+        }
+    }
+
+    /// Loads the page table of the thread into CR3, tagged with its PCID.
+    pub fn load_address_space(&self) {
+        match &self.process {
+            Some(process) => process.lock().load_address_space(),
+            None => unsafe { pcid::load(ROOT_PAGE_TABLE as u64, KERNEL_PCID, 0) },
+        }
+    }
+
     /// Executes the thread by setting up the page table and stack pointer, and then starting the thread.
     pub fn run(&self) {
-        let page_table = self.process.borrow().page_table;
         // Load the page table for this thread's process
-        Cr3::write(page_table as u64);
+        self.load_address_space();
 
         println!(
             "Executing thread with stack pointer: {:#x}",
@@ -169,27 +259,22 @@ impl Thread {
     ///
     /// # Returns
     ///
-    /// The virtual address where the code is mapped.
+    /// The virtual address where the code is mapped, at the start of the process's user space.
     unsafe fn map_user_memory(
         page_table: *mut PageTable,
         address: *const usize,
         size: usize,
     ) -> usize {
-        let page_table_manager = PageTableManager::new(page_table);
-        let virt_addr = ALLOCATOR.alloc_page();
-        let phys_addr = page_table_manager.phys_addr(VirtAddr(virt_addr as usize));
-
-        // Copy the code into the allocated virtual page
-        copy_nonoverlapping(address as *const u8, virt_addr as *mut u8, size);
-
-        // Map the virtual page to the physical page in the page table
-        PageTableManager::map_user_page(
-            page_table,
-            VirtAddr(virt_addr as usize),
-            PhysAddr(phys_addr.0 as usize),
-        );
+        // Allocate a frame for the code
+        let phys_addr = memory::alloc_frames(0).expect("Out of physical memory");
+
+        // Copy the code into the allocated frame through the direct physical map
+        copy_nonoverlapping(address as *const u8, phys_addr.as_mut_ptr::<u8>(), size);
 
-        virt_addr as usize
+        // Map the frame into the user space of the process's page table
+        PageTableManager::map_user_page(page_table, USER_SPACE_START, phys_addr);
+
+        USER_SPACE_START.0
     }
 
     /// Initializes the stack frame for the thread, setting up the initial CPU state.
@@ -204,9 +289,16 @@ impl Thread {
     ///
     /// The top of the stack.
     unsafe fn init_stack(cs: u64, ss: u64, rip: u64) -> *mut u64 {
-        let stack = ALLOCATOR.alloc_page(); // Allocate a new page for the stack
+        // Allocate a new frame for the stack from the per-CPU frame cache, reached through the direct physical map
+        let stack = memory::alloc_frames(0)
+            .expect("Out of physical memory")
+            .as_mut_ptr::<u8>();
         let stack_top = (stack.add(STACK_SIZE)) as *mut u64; // Calculate the top of the stack
-        let stack_top = stack_top.sub(size_of::<State>()); // Make room for the State struct
+
+        // The entry point returns into `exit_thread`, which ends the thread
+        let return_address = stack_top.sub(1);
+        *return_address = exit_thread as u64;
+        let stack_top = return_address.sub(size_of::<State>()); // Make room for the State struct
 
         let state = stack_top as *mut State;
 
@@ -215,7 +307,7 @@ impl Thread {
             (*state).rip = rip; // Set the instruction pointer to the entry point
             (*state).cs = cs; // Set the code segment selector
             (*state).rflags = 0x202; // Set the RFLAGS register to enable interrupts
-            (*state).rsp = stack_top as u64; // Set the stack pointer to the top of the stack
+            (*state).rsp = return_address as u64; // Set the stack pointer to the return address
             (*state).ss = ss; // Set the stack segment selector
 
             // print_stack(stack_top as *mut u8, 256);
@@ -225,6 +317,13 @@ impl Thread {
     }
 }
 
+// Ends a kernel thread whose entry point has returned.
+extern "C" fn exit_thread() -> ! {
+    scheduler()
+        .expect("Thread runs without a scheduler")
+        .exit_current()
+}
+
 /// Prints the contents of the stack for debugging purposes.
 ///
 /// # Arguments
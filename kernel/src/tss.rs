@@ -2,7 +2,7 @@ use super::gdt::SegmentAttributes;
 use super::gdt::SegmentType;
 use crate::gdt::PrivilegeLevel;
 use crate::gdt::SegmentSelector;
-use crate::{gdt::GDT, println};
+use crate::{cpu::percpu::MAX_CPUS, gdt::GDT, println};
 use alloc::vec;
 use core::arch::asm;
 use core::ptr::addr_of;
@@ -89,30 +89,32 @@ impl TssDescriptor {
 
 /// Loads the Task State Segment (TSS) into the CPU.
 ///
-/// This function initializes the TSS with a kernel stack pointer, updates the
-/// GDT entry for the TSS, and loads the TSS into the CPU's TR register. This
+/// This function initializes the TSS of a CPU with a kernel stack pointer, updates the
+/// TSS entry of the CPU's GDT, and loads the TSS into the CPU's TR register. This
 /// is necessary for proper task switching and interrupt handling.
 ///
 /// # Safety
 /// This function is unsafe because it modifies global state and interacts with
-/// CPU registers directly.
-pub unsafe fn load_tss() {
+/// CPU registers directly. It must run on the CPU `cpu`, after its GDT has been loaded.
+pub unsafe fn load_tss(cpu: usize) {
     // Allocate a stack for the kernel
     let kernel_stack = vec![0; 0x14000];
 
     // Initialize the TSS with the kernel stack pointer
     // The privilege stack table and interrupt stack table are initialized with the kernel stack pointer
-    TSS = TaskStateSegment::new(kernel_stack.as_ptr() as u64 + kernel_stack.len() as u64);
+    TSS[cpu] = TaskStateSegment::new(kernel_stack.as_ptr() as u64 + kernel_stack.len() as u64);
+    core::mem::forget(kernel_stack);
 
     // Calculate the address of the TSS
-    let tss_addr = addr_of!(TSS) as *const _ as u64;
+    let tss_addr = addr_of!(TSS[cpu]) as *const _ as u64;
 
     // Update the GDT entry for the TSS
-    GDT.tss.base_low = tss_addr as u16;
-    GDT.tss.base_middle = (tss_addr >> 16) as u8;
-    GDT.tss.attributes = GDT.tss.attributes.with_present(true);
-    GDT.tss.base_high = (tss_addr >> 24) as u8;
-    GDT.tss.base_upper = (tss_addr >> 32) as u32;
+    let gdt = &mut GDT[cpu];
+    gdt.tss.base_low = tss_addr as u16;
+    gdt.tss.base_middle = (tss_addr >> 16) as u8;
+    gdt.tss.attributes = gdt.tss.attributes.with_present(true);
+    gdt.tss.base_high = (tss_addr >> 24) as u8;
+    gdt.tss.base_upper = (tss_addr >> 32) as u32;
 
     // Load the TSS into the CPU's TR register
     asm!(
@@ -127,5 +129,5 @@ pub unsafe fn load_tss() {
     println!("TR register: {:04x}", tr);
 }
 
-/// The global Task State Segment (TSS).
-pub static mut TSS: TaskStateSegment = TaskStateSegment::new(0);
+/// The Task State Segments (TSS), one per CPU.
+pub static mut TSS: [TaskStateSegment; MAX_CPUS] = [const { TaskStateSegment::new(0) }; MAX_CPUS];